@@ -0,0 +1,138 @@
+// Titon MVHR - In-process MQTT broker stand-in for host builds
+// Just enough broker for one firmware client: retained messages, topic filters
+// with + and #, a last will, and an outage switch. Other "clients" (a test
+// driver playing Home Assistant) publish straight into it; everything the
+// firmware publishes is handed to an observer callback.
+
+#ifndef HOST_BROKER_H
+#define HOST_BROKER_H
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+struct BrokerMessage {
+  std::string topic;
+  std::string payload;
+  bool retained;
+};
+
+struct BrokerCounters {
+  uint32_t connects;
+  uint32_t client_messages;   // published by the firmware
+  uint64_t client_bytes;      // topic + payload
+  uint32_t delivered;         // handed to the firmware
+};
+
+class HostBroker {
+public:
+  HostBroker() : counters_() {}
+
+  // Observer for every message the firmware publishes
+  std::function<void(const BrokerMessage&)> on_client_publish;
+
+  // Outage switch: going offline drops the session and fires the will
+  void set_online(bool online) {
+    online_ = online;
+    if (!online) client_drop();
+  }
+  bool online() const { return online_; }
+
+  // Publish as another client (e.g. Home Assistant commands or birth message)
+  void publish(const std::string& topic, const std::string& payload, bool retain = false) {
+    route(BrokerMessage{ topic, payload, retain });
+  }
+
+  const std::map<std::string, std::string>& retained() const { return retained_; }
+  const BrokerCounters& counters() const { return counters_; }
+
+  // ---- firmware client side ----
+  bool client_connect(const char* will_topic, const char* will_message, bool will_retain) {
+    if (!online_) return false;
+    connected_ = true;
+    subscriptions_.clear();
+    inbox_.clear();
+    will_ = BrokerMessage{ will_topic ? will_topic : "", will_message ? will_message : "", will_retain };
+    counters_.connects++;
+    return true;
+  }
+  bool client_connected() const { return connected_; }
+
+  // Session lost without a DISCONNECT (link or broker down): fire the will
+  void client_drop() {
+    if (!connected_) return;
+    connected_ = false;
+    if (!will_.topic.empty()) route(will_);
+  }
+
+  bool client_publish(const std::string& topic, const std::string& payload, bool retain) {
+    if (!connected_) return false;
+    counters_.client_messages++;
+    counters_.client_bytes += topic.size() + payload.size();
+    BrokerMessage m{ topic, payload, retain };
+    if (on_client_publish) on_client_publish(m);
+    route(m);
+    return true;
+  }
+
+  bool client_subscribe(const std::string& filter) {
+    if (!connected_) return false;
+    subscriptions_.push_back(filter);
+    for (const auto& r : retained_) {
+      if (matches(filter, r.first)) inbox_.push_back(BrokerMessage{ r.first, r.second, true });
+    }
+    return true;
+  }
+
+  bool client_next(BrokerMessage& out) {
+    if (!connected_ || inbox_.empty()) return false;
+    out = inbox_.front();
+    inbox_.pop_front();
+    counters_.delivered++;
+    return true;
+  }
+
+  static bool matches(const std::string& filter, const std::string& topic) {
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+      if (filter[f] == '#') return true;
+      if (filter[f] == '+') {
+        while (t < topic.size() && topic[t] != '/') t++;
+        f++;
+        continue;
+      }
+      if (t >= topic.size() || filter[f] != topic[t]) return false;
+      f++;
+      t++;
+    }
+    return t == topic.size();
+  }
+
+private:
+  void route(const BrokerMessage& m) {
+    if (m.retained) {
+      if (m.payload.empty()) retained_.erase(m.topic);
+      else retained_[m.topic] = m.payload;
+    }
+    if (!connected_) return;
+    for (const auto& filter : subscriptions_) {
+      if (matches(filter, m.topic)) {
+        inbox_.push_back(BrokerMessage{ m.topic, m.payload, false });
+        break;
+      }
+    }
+  }
+
+  bool online_ = true;
+  bool connected_ = false;
+  BrokerMessage will_;
+  std::vector<std::string> subscriptions_;
+  std::deque<BrokerMessage> inbox_;
+  std::map<std::string, std::string> retained_;
+  BrokerCounters counters_;
+};
+
+#endif  // HOST_BROKER_H
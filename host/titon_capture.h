@@ -0,0 +1,261 @@
+// Titon MVHR - Bus and command captures for host replay
+// A capture is a text file of timestamped records, one per line:
+//
+//   # titon-capture 1
+//   <t_us> tx <bytes>            what the gateway wrote to the RS485 UART
+//   <t_us> rx <bytes>            what it read back (replies, other masters, noise)
+//   <t_us> mqtt <topic> <bytes>  a command delivered to the gateway
+//
+// Times are microseconds from the start of the capture. Bytes are printable
+// ASCII as-is with everything else (and '\', and spaces in topics) escaped as
+// \xHH, so "0384+00003\x0d\x0a" reads like the wire and stray CR/LF, -99999
+// replies and line noise survive a round trip. Lines starting with '#' are
+// comments, so captures can be trimmed or written by hand from a logic
+// analyser dump.
+//
+// titon_host --capture FILE records one; CaptureSim plays one back as the
+// controller for titon_replay.
+
+#ifndef TITON_CAPTURE_H
+#define TITON_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+enum CaptureKind { CAPTURE_TX, CAPTURE_RX, CAPTURE_MQTT };
+
+struct CaptureRecord {
+  uint64_t t_us;
+  CaptureKind kind;
+  std::string topic;  // CAPTURE_MQTT only
+  std::string data;
+};
+
+// ========== FORMAT ==========
+inline std::string capture_escape(const uint8_t* data, size_t len, bool escape_space = false) {
+  std::string out;
+  char hex[8];
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = data[i];
+    if (c >= ' ' && c < 127 && c != '\\' && !(escape_space && c == ' ')) {
+      out += (char)c;
+    } else {
+      snprintf(hex, sizeof(hex), "\\x%02x", c);
+      out += hex;
+    }
+  }
+  return out;
+}
+
+inline bool capture_unescape(const char* text, std::string& out) {
+  out.clear();
+  for (const char* p = text; *p; p++) {
+    if (*p != '\\') {
+      out += *p;
+      continue;
+    }
+    unsigned value;
+    if (p[1] != 'x' || sscanf(p + 2, "%2x", &value) != 1 || !p[2] || !p[3]) return false;
+    out += (char)value;
+    p += 3;
+  }
+  return true;
+}
+
+class CaptureWriter {
+public:
+  explicit CaptureWriter(FILE* file) : file_(file) { fputs("# titon-capture 1\n", file_); }
+
+  void bytes(uint64_t t_us, CaptureKind kind, const uint8_t* data, size_t len) {
+    fprintf(file_, "%llu %s %s\n", (unsigned long long)t_us, kind == CAPTURE_TX ? "tx" : "rx",
+            capture_escape(data, len).c_str());
+  }
+
+  void mqtt(uint64_t t_us, const std::string& topic, const std::string& payload) {
+    fprintf(file_, "%llu mqtt %s %s\n", (unsigned long long)t_us,
+            capture_escape((const uint8_t*)topic.data(), topic.size(), true).c_str(),
+            capture_escape((const uint8_t*)payload.data(), payload.size()).c_str());
+  }
+
+  void flush() { fflush(file_); }
+
+private:
+  FILE* file_;
+};
+
+inline bool capture_parse(const char* line, CaptureRecord& r) {
+  char kind[8];
+  unsigned long long t;
+  int used = 0;
+  if (sscanf(line, "%llu %7s%n", &t, kind, &used) != 2) return false;
+  r.t_us = t;
+  const char* rest = line + used;
+  if (*rest == ' ') rest++;  // one separator; the bytes may start with spaces
+  if (!strcmp(kind, "tx") || !strcmp(kind, "rx")) {
+    r.kind = kind[0] == 't' ? CAPTURE_TX : CAPTURE_RX;
+    return capture_unescape(rest, r.data);
+  }
+  if (strcmp(kind, "mqtt")) return false;
+  const char* space = strchr(rest, ' ');
+  r.kind = CAPTURE_MQTT;
+  return space && capture_unescape(std::string(rest, space).c_str(), r.topic) && capture_unescape(space + 1, r.data);
+}
+
+// False with the line number in *bad_line if a record doesn't parse
+inline bool capture_load(const char* path, std::vector<CaptureRecord>& records, int* bad_line) {
+  FILE* f = fopen(path, "r");
+  if (!f) return false;
+  std::string line;
+  int number = 0;
+  bool ok = true;
+  for (int c; ok && (c = fgetc(f)) != EOF;) {
+    if (c != '\n') {
+      line += (char)c;
+      continue;
+    }
+    number++;
+    if (!line.empty() && line[0] != '#') {
+      CaptureRecord r;
+      ok = capture_parse(line.c_str(), r);
+      if (ok) records.push_back(r);
+    }
+    line.clear();
+  }
+  fclose(f);
+  if (!ok && bad_line) *bad_line = number;
+  return ok;
+}
+
+// ========== REPLAY CONTROLLER ==========
+// Stands in for TitonSim on a host bus, answering from a capture. Every
+// recorded read keeps the rx bytes that followed it up to the end of its
+// reply line, with their delays from the request's first byte, and the n-th
+// time the firmware sends that request it gets the n-th recorded answer: the
+// same values, timeouts, faulty-sensor replies and garbage, at the recorded
+// pace, even if the firmware now polls in a different order. Several reads
+// in one tx (a burst) take the reply lines that follow in turn. Replies end
+// at the next tx or after REPLY_WINDOW_US of silence. Rx bytes recorded
+// outside any read (another master, noise on an idle line) are played at
+// their recorded time.
+class CaptureSim {
+public:
+  struct Counters {
+    uint32_t requests;
+    uint32_t answered;   // had a recorded answer left
+    uint32_t unmatched;  // no recorded answer left: left unanswered
+    uint32_t unsolicited_bytes;
+  };
+
+  static constexpr uint64_t REPLY_WINDOW_US = 500000;
+  static constexpr uint64_t BYTE_US = 10 * 1000000 / 1200;  // 1200 baud 8N1
+
+  CaptureSim(const std::vector<CaptureRecord>& records, uint64_t start_us) : counters_() {
+    std::vector<Pending> window;  // reads of the last tx, in the order they were sent
+    size_t next = 0;              // the one the next rx bytes answer
+    uint64_t heard_us = 0;        // end of the tx, then the last rx
+    for (const CaptureRecord& r : records) {
+      if (r.kind == CAPTURE_TX) {
+        window.clear();
+        next = 0;
+        heard_us = r.t_us + r.data.size() * BYTE_US;
+        size_t from = 0;
+        for (size_t end; (end = r.data.find('\n', from)) != std::string::npos; from = end + 1) {
+          std::string request = request_key(r.data.substr(from, end + 1 - from));
+          if (!is_read(request)) continue;
+          answers_[request].push_back(std::deque<Chunk>());
+          window.push_back(Pending{ &answers_[request].back(), r.t_us + from * BYTE_US });
+        }
+      } else if (r.kind == CAPTURE_RX) {
+        if (r.t_us - heard_us > REPLY_WINDOW_US) next = window.size();
+        heard_us = r.t_us;
+        size_t from = 0;
+        while (from < r.data.size() && next < window.size()) {
+          size_t end = r.data.find('\n', from);
+          size_t take = end == std::string::npos ? r.data.size() - from : end + 1 - from;
+          window[next].reply->push_back(Chunk{ r.t_us - window[next].start_us, r.data.substr(from, take) });
+          if (end != std::string::npos) next++;
+          from += take;
+        }
+        if (from < r.data.size()) {
+          schedule(start_us + r.t_us, r.data.substr(from));
+          counters_.unsolicited_bytes += r.data.size() - from;
+        }
+      }
+    }
+  }
+
+  void receive(const uint8_t* data, size_t len, uint64_t now_us) {
+    size_t held = line_.size();  // bytes of the first request sent in an earlier write
+    line_.append((const char*)data, len);
+    size_t from = 0;
+    for (size_t end; (end = line_.find('\n', from)) != std::string::npos; from = end + 1) {
+      std::string request = request_key(line_.substr(from, end + 1 - from));
+      if (!is_read(request)) continue;
+      counters_.requests++;
+      auto it = answers_.find(request);
+      if (it == answers_.end() || it->second.empty()) {
+        counters_.unmatched++;
+        continue;
+      }
+      counters_.answered++;
+      uint64_t request_us = now_us + (from > held ? from - held : 0) * BYTE_US;
+      for (const Chunk& c : it->second.front()) schedule(request_us + c.delay_us, c.data);
+      it->second.pop_front();
+    }
+    line_.erase(0, from);
+  }
+
+  size_t transmit(uint8_t* out, size_t len, uint64_t now_us) {
+    size_t n = 0;
+    while (n < len && !out_.empty() && out_.begin()->first <= now_us) {
+      std::string& pending = out_.begin()->second;
+      size_t take = std::min(len - n, pending.size());
+      memcpy(out + n, pending.data(), take);
+      n += take;
+      pending.erase(0, take);
+      if (pending.empty()) out_.erase(out_.begin());
+    }
+    return n;
+  }
+
+  const Counters& counters() const { return counters_; }
+
+private:
+  struct Chunk {
+    uint64_t delay_us;
+    std::string data;
+  };
+
+  struct Pending {
+    std::deque<Chunk>* reply;
+    uint64_t start_us;         // first byte of the request
+  };
+
+  // The request as the controller parses it: up to the LF, CR stripped
+  static std::string request_key(const std::string& raw) {
+    std::string key;
+    for (char c : raw) {
+      if (c != '\r' && c != '\n') key += c;
+    }
+    return key;
+  }
+  static bool is_read(const std::string& request) { return request.size() >= 4 && request[3] == '1'; }
+
+  void schedule(uint64_t at_us, const std::string& data) {
+    if (data.empty()) return;
+    out_.emplace(at_us, data);
+  }
+
+  std::map<std::string, std::deque<std::deque<Chunk>>> answers_;
+  std::multimap<uint64_t, std::string> out_;
+  std::string line_;
+  Counters counters_;
+};
+
+#endif  // TITON_CAPTURE_H
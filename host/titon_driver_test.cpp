@@ -0,0 +1,260 @@
+// Titon MVHR - titon driver class checks
+// Runs the titon class (titon.h) and TitonUnits against the simulated
+// controller behind the host HAL, on the virtual clock, so every run is the
+// same and a minute of bus time takes a fraction of a second:
+//
+// - callbacks: one per polled register at start, then only when a value
+//   moves past its deadband
+// - writes: two speed commands coalesce into one write that is read back;
+//   a write the controller ignores is re-sent and given up after
+//   VERIFY_ATTEMPTS; a command register (factory reset) is sent once and
+//   never read back
+// - relays: a boost pulse closes SW2 and opens it again on time
+// - units: two units sharing a UART and one on its own all stay within a
+//   second of their poll periods
+// - bursts: TitonLine batches reads for a controller that holds its replies,
+//   and falls back, backing off its reprobes, for one that answers the first
+//   read of a window and misses the rest or answers nothing
+//
+// Build and run from the repository root:
+//   g++ -std=gnu++17 -O2 -I. -o titon_driver_test host/titon_driver_test.cpp host/titon_hal_host.cpp -lpthread
+//   ./titon_driver_test
+// Exit status: 0 all checks passed, 1 a check failed.
+
+#include "titon_host.h"
+#include "titon.h"
+
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const char* test, const char* what) {
+  if (ok) return;
+  printf("%s: %s\n", test, what);
+  failures++;
+}
+
+// ========== CALLBACK COUNTS ==========
+int value_changes = 0;
+int status_changes = 0;
+int temperature_changes = 0;
+std::string last_debug;
+
+void on_value(RegisterId, int32_t) { value_changes++; }
+void on_status() { status_changes++; }
+void on_temperature() { temperature_changes++; }
+void on_debug(const char* message) { last_debug = message; }
+
+void reset_counts() {
+  value_changes = status_changes = temperature_changes = 0;
+  last_debug.clear();
+}
+
+// Fresh controller on HAL_UART_BUS behind DE/RE pin 4
+void begin_sim(uint32_t seed) {
+  host_sim_begin(seed, 4);
+  reset_counts();
+}
+
+// Default wiring unless given a UART and DE/RE pins
+void connect(titon& unit, int uart = HAL_UART_BUS, int de_pin = 4, int re_pin = 4) {
+  unit.setValueChangedCallback(on_value);
+  unit.setStatusChangedCallback(on_status);
+  unit.setTemperatureChangedCallback(on_temperature);
+  unit.setDebugPrintCallback(on_debug);
+  unit.setDebug(true);
+  unit.connect(16, 17, de_pin, re_pin, uart);
+}
+
+// Loops every 100 us of virtual time
+template <typename Unit>
+void run(Unit& unit, uint32_t ms) {
+  for (uint32_t i = 0; i < ms * 10; i++) {
+    unit.loop();
+    host_clock_advance(100);
+  }
+}
+
+int polled_registers() {
+  int n = 0;
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (TITON_REGISTERS[i].poll_period_ms) n++;
+  }
+  return n;
+}
+
+// ========== TESTS ==========
+void test_callbacks() {
+  const char* test = "callbacks";
+  begin_sim(1);
+  titon unit;
+  connect(unit);
+  run(unit, 10000);
+  check(value_changes == polled_registers(), test, "not one value callback per polled register at start");
+  check(unit.getFanSpeed() == 2 && unit.getInsideTemp() > 21.4f, test, "values not cached");
+
+  reset_counts();
+  run(unit, 60000);
+  check(value_changes == 0, test, "callbacks without a change");
+
+  host_sim().set_register(30, 216);  // within the 0.2°C deadband
+  host_sim().set_register(36, 55);
+  run(unit, 60000);
+  check(value_changes == 1 && temperature_changes == 1, test, "humidity change not reported once");
+
+  host_sim().set_register(30, 217);  // exactly the deadband
+  run(unit, 60000);
+  check(value_changes == 2 && temperature_changes == 2, test, "temperature change not reported once");
+}
+
+void test_writes() {
+  const char* test = "writes";
+  begin_sim(2);
+  titon unit;
+  connect(unit);
+  run(unit, 10000);
+
+  unit.setFanSpeed(3);
+  unit.setFanSpeed(4);
+  run(unit, 5000);
+  const WriteCounters& w = unit.getWriteCounters();
+  check(host_sim().counters().writes == 1 && w.coalesced == 1, test, "speed commands not coalesced");
+  check(host_sim().register_value(384) == 4 && unit.getFanSpeed() == 4, test, "speed not written");
+  check(w.failed == 0 && w.retries == 0, test, "speed write not verified first time");
+
+  unit.setFanSpeed(4);
+  run(unit, 5000);
+  check(host_sim().counters().writes == 1 && w.suppressed == 1, test, "write equal to the readback not dropped");
+
+  host_sim().faults.ignore_write = 1.0;
+  unit.setBoostInhibit(true);
+  run(unit, 10000);
+  check(host_sim().counters().writes == 1 + TitonWrites::VERIFY_ATTEMPTS, test, "ignored write not re-sent");
+  check(w.failed == 1 && last_debug == "Write not taken by the controller", test, "ignored write not given up");
+
+  // The controller acts on 068 rather than storing it, so a readback would
+  // mismatch and re-send the reset
+  host_sim().faults.ignore_write = 0.0;
+  uint32_t writes = host_sim().counters().writes;
+  uint32_t retries = w.retries;
+  unit.writeRegister(REG_FACTORY_RESET, 21930);
+  for (int ms = 0; ms < 2000 && host_sim().register_value(68) != 21930; ms++) run(unit, 1);
+  check(host_sim().register_value(68) == 21930, test, "factory reset not sent");
+  host_sim().set_register(68, 0);
+  run(unit, 5000);
+  check(host_sim().counters().writes == writes + 1 && w.retries == retries, test, "factory reset read back");
+}
+
+void test_relays() {
+  const char* test = "relays";
+  begin_sim(3);
+  titon unit;
+  connect(unit);
+  unit.setRelayPins(25, 26, 27);
+  run(unit, 10000);
+
+  int before = status_changes;
+  unit.setSwitchOn();
+  run(unit, 1000);
+  check(unit.isRelayOn(2) && host_gpio_level(26), test, "SW2 not closed by the pulse");
+  run(unit, TitonRelays::BOOST_PULSE_MS);
+  check(!unit.isRelayOn(2) && !host_gpio_level(26), test, "SW2 not opened after the pulse");
+  check(status_changes == before + 2, test, "relay edges not reported");
+}
+
+void test_units() {
+  const char* test = "units";
+  begin_sim(4);
+  host_bus_add(1, 5, 6, 5);
+  host_bus_add(1, 7, 8, 6);
+  titon a, b, c;
+  connect(a, 1, 5, 6);
+  connect(b, 1, 7, 8);
+  connect(c);
+  TitonUnits units;
+  check(units.add(a) && units.add(b) && units.add(c), test, "units not added");
+
+  titon tied;
+  connect(tied, 1, 9, 9);
+  check(!units.add(tied), test, "tied DE/RE pins accepted on a shared UART");
+
+  run(units, 60000);
+  check(a.getMaxOverdueMs() < 1000 && b.getMaxOverdueMs() < 1000 && c.getMaxOverdueMs() < 1000, test,
+        "a unit fell behind its poll periods");
+  check(a.isValid(REG_STATUS_WORD) && b.isValid(REG_STATUS_WORD) && c.isValid(REG_STATUS_WORD), test,
+        "a unit never read");
+}
+
+// Two reads per window through TitonLine itself, framed like titon.h does
+void run_line(TitonLine& line, TitonFramer& framer, uint32_t ms) {
+  for (uint32_t i = 0; i < ms * 10; i++) {
+    if (line.idle()) {
+      line.read(TITON_REGISTERS[REG_STATUS_WORD].read_cmd, nullptr);
+      line.read(TITON_REGISTERS[REG_CURRENT_SPEED].read_cmd, nullptr);
+    }
+    uint8_t chunk[32];
+    size_t n;
+    while ((n = hal_uart_read(chunk, sizeof(chunk), line.uart())) > 0) {
+      framer.feed(chunk, n);
+      TitonFrame frame;
+      FrameStatus status;
+      while ((status = framer.next(frame)) != FRAME_NONE) {
+        if (status == FRAME_OK) line.on_frame(frame.address, frame.value);
+      }
+    }
+    line.service();
+    host_clock_advance(100);
+  }
+}
+
+void test_bursts() {
+  const char* test = "bursts";
+  begin_sim(5);
+  host_sim().faults.hold_replies = true;
+  TitonLine held;
+  TitonFramer held_framer;
+  held.begin(16, 17, 4, 4);
+  held.set_burst(true);
+  run_line(held, held_framer, 10000);
+  check(held.counters().burst_mode == BURST_ON && held.counters().burst_failures == 0, test,
+        "bursts not kept by a controller that holds its replies");
+
+  begin_sim(6);
+  TitonLine tied;
+  TitonFramer tied_framer;
+  tied.begin(16, 17, 4, 4);
+  tied.set_burst(true);
+  run_line(tied, tied_framer, 10000);
+  check(tied.counters().burst_mode == BURST_OFF && host_sim().counters().unheard == 1, test,
+        "failed probe not taken as one read per window");
+  check(tied.counters().reprobe_ms == TitonLine::BURST_REPROBE_MS, test, "first reprobe not after BURST_REPROBE_MS");
+  run_line(tied, tied_framer, TitonLine::BURST_REPROBE_MS + 10000);
+  check(tied.counters().burst_mode == BURST_OFF && tied.counters().reprobe_ms == 2 * TitonLine::BURST_REPROBE_MS,
+        test, "reprobes not backed off");
+
+  // A window nobody answers is a failed probe too, not a probe forever
+  begin_sim(7);
+  host_sim().faults.no_reply = 1.0;
+  TitonLine silent;
+  TitonFramer silent_framer;
+  silent.begin(16, 17, 4, 4);
+  silent.set_burst(true);
+  run_line(silent, silent_framer, 10000);
+  check(silent.counters().burst_mode == BURST_OFF, test, "unanswered probe left bursts on");
+}
+
+}  // namespace
+
+int main() {
+  Serial.quiet = true;
+  host_clock_virtual(0);
+  test_callbacks();
+  test_writes();
+  test_relays();
+  test_units();
+  test_bursts();
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+// Titon MVHR - TitonFramer corpus, fuzz and benchmark
+// Checks the framer in titon_frame.h on the host, no Arduino needed:
+//
+// - corpus: hand-written lines with the status and value each must decode
+//   to: good frames, -99999, CR/LF variants, overlong, truncated and garbage
+//   lines. Each is fed whole and one byte at a time.
+// - fuzz: seeded random byte streams (mutated frames, noise, partial lines)
+//   in random-sized chunks. Every line ends in exactly one status, the
+//   counters add up, line() stays terminated and within
+//   TITON_FRAME_MAX_LEN, and the framer resynchronises on the next good
+//   frame.
+// - bench: ns per byte over a realistic reply stream, with the heap
+//   allocations counted (there must be none) and the 99.9th percentile
+//   time per 16-byte chunk, which bounds the work per byte (the slowest
+//   chunk on a host is a preemption, not the framer).
+//
+// Build and run from the repository root:
+//   g++ -std=gnu++17 -O2 -I. -o titon_frame_test host/titon_frame_test.cpp
+//   ./titon_frame_test [--seed N] [--fuzz N] [--bench N]
+// Exit status: 0 all checks passed, 1 a check failed, 2 bad arguments.
+
+#include "titon_frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+#include <string>
+
+// ========== ALLOCATION COUNTING ==========
+namespace {
+uint64_t allocations = 0;
+}
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+// ========== CORPUS ==========
+struct CorpusCase {
+  const char* input;           // bytes on the wire, ending the line
+  FrameStatus status;
+  int address;                 // FRAME_OK / FRAME_SENSOR_FAULT only
+  int32_t value;
+};
+
+constexpr CorpusCase CORPUS[] = {
+  // Well-formed replies
+  { "0030+00215\r\n", FRAME_OK, 30, 215 },
+  { "0384+00002\n", FRAME_OK, 384, 2 },
+  { "0031-00042\r", FRAME_OK, 31, -42 },
+  { "0061+99999\r\n", FRAME_OK, 61, 99999 },
+  { "1+1\n", FRAME_OK, 1, 1 },
+  { "\r\n\r\n0036+00048\r\n", FRAME_OK, 36, 48 },         // blank lines first
+  { "\x01\x7f\xff" "0032+00085\r\n", FRAME_OK, 32, 85 },  // noise before the line
+  { "00\x01" "30+00215\r\n", FRAME_OK, 30, 215 },         // noise inside it
+  // Faulty sensor
+  { "0032-99999\r\n", FRAME_SENSOR_FAULT, 32, -99999 },
+  // Overlong: too many digits or too many characters
+  { "00300+00215\r\n", FRAME_OVERLONG, 0, 0 },
+  { "0030+002150\r\n", FRAME_OVERLONG, 0, 0 },
+  { "0030+00215000000000000000\r\n", FRAME_OVERLONG, 0, 0 },
+  { "000000000000000000000000000000000000000000000000000000000000000000000000\n", FRAME_OVERLONG, 0, 0 },
+  // Truncated: the line ends before the value is complete
+  { "0030\r\n", FRAME_MALFORMED, 0, 0 },
+  { "0030+\r\n", FRAME_MALFORMED, 0, 0 },
+  { "+00215\r\n", FRAME_MALFORMED, 0, 0 },
+  { "-\r\n", FRAME_MALFORMED, 0, 0 },
+  // Garbage
+  { "0030*00215\r\n", FRAME_MALFORMED, 0, 0 },
+  { "0030+00 15\r\n", FRAME_MALFORMED, 0, 0 },
+  { "0030++00215\r\n", FRAME_MALFORMED, 0, 0 },
+  { "hello\r\n", FRAME_MALFORMED, 0, 0 },
+  { "0030+0021x\r\n", FRAME_MALFORMED, 0, 0 },
+};
+
+// Feeds input in chunks of `chunk` bytes and collects the first frame
+FrameStatus decode(TitonFramer& framer, const std::string& input, size_t chunk, TitonFrame& frame) {
+  FrameStatus result = FRAME_NONE;
+  for (size_t at = 0; at < input.size();) {
+    at += framer.feed((const uint8_t*)input.data() + at, std::min(chunk, input.size() - at));
+    for (FrameStatus s; (s = framer.next(frame)) != FRAME_NONE;) {
+      if (result == FRAME_NONE) result = s;
+    }
+  }
+  return result;
+}
+
+int run_corpus() {
+  const char* const NAMES[] = { "none", "ok", "malformed", "overlong", "sensor_fault" };
+  int failures = 0;
+  for (const CorpusCase& c : CORPUS) {
+    std::string input = c.input;
+    for (size_t chunk : { input.size(), (size_t)1 }) {
+      TitonFramer framer;
+      TitonFrame frame{};
+      FrameStatus s = decode(framer, input, chunk, frame);
+      bool ok = s == c.status;
+      if (ok && (s == FRAME_OK || s == FRAME_SENSOR_FAULT)) ok = frame.address == c.address && frame.value == c.value;
+      if (ok) continue;
+      printf("corpus: %-28.28s chunk %zu: got %s %d/%ld, want %s %d/%ld\n", framer.line(), chunk, NAMES[s],
+             frame.address, (long)frame.value, NAMES[c.status], c.address, (long)c.value);
+      failures++;
+    }
+  }
+  printf("corpus:  %zu lines, %d failures\n", sizeof(CORPUS) / sizeof(CORPUS[0]), failures);
+  return failures;
+}
+
+// ========== FUZZ ==========
+uint32_t rng = 1;
+uint32_t next_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+// A good frame, a mutation of one, or noise, always ending the line
+std::string random_line(bool& good) {
+  char text[32];
+  snprintf(text, sizeof(text), "%04u%c%05u", next_random() % 1000, next_random() & 1 ? '+' : '-',
+           next_random() % 100000);
+  std::string line = text;
+  good = true;
+  switch (next_random() % 7) {
+    case 0:                    // flip one character
+      line[next_random() % line.size()] = (char)(next_random() & 0xFF);
+      good = false;
+      break;
+    case 1:                    // truncate
+      line.resize(next_random() % line.size());
+      good = false;
+      break;
+    case 2:                    // run on
+      for (int n = 1 + next_random() % 40; n > 0; n--) line += (char)('0' + next_random() % 10);
+      good = false;
+      break;
+    case 3:                    // noise
+      line.clear();
+      for (int n = next_random() % 24; n > 0; n--) line += (char)(next_random() & 0xFF);
+      good = false;
+      break;
+    case 4:                    // faulty sensor
+      line.replace(4, 6, "-99999");
+      break;
+    default:
+      break;
+  }
+  const char* const ENDINGS[] = { "\r\n", "\n", "\r" };
+  return line + ENDINGS[next_random() % 3];
+}
+
+int run_fuzz(int lines) {
+  TitonFramer framer;
+  TitonFrame frame{};
+  uint32_t statuses = 0, good_lines = 0, good_decoded = 0;
+  int failures = 0;
+  uint8_t chunk[24];
+  std::string stream;
+  for (int i = 0; i < lines; i++) {
+    bool good;
+    std::string line = random_line(good);
+    // A known-good frame after each line checks the framer resynchronises
+    stream = line + "0384+00003\r\n";
+    good_lines += good;
+    FrameStatus last = FRAME_NONE;
+    for (size_t at = 0; at < stream.size();) {
+      size_t n = std::min((size_t)(1 + next_random() % sizeof(chunk)), stream.size() - at);
+      memcpy(chunk, stream.data() + at, n);
+      at += framer.feed(chunk, n);
+      for (FrameStatus s; (s = framer.next(frame)) != FRAME_NONE;) {
+        statuses++;
+        if (strlen(framer.line()) > TITON_FRAME_MAX_LEN) {
+          printf("fuzz: line() longer than TITON_FRAME_MAX_LEN\n");
+          failures++;
+        }
+        if (good && last == FRAME_NONE && (s == FRAME_OK || s == FRAME_SENSOR_FAULT)) good_decoded++;
+        last = s;
+      }
+    }
+    // The stream's last line is the known-good frame
+    if (last != FRAME_OK || frame.address != 384 || frame.value != 3) {
+      printf("fuzz: no resync after line %d\n", i);
+      failures++;
+    }
+  }
+  const FrameCounters& c = framer.counters();
+  uint32_t counted = c.ok + c.malformed + c.overlong + c.faults;
+  if (counted != statuses) {
+    printf("fuzz: counters add up to %u, %u statuses returned\n", counted, statuses);
+    failures++;
+  }
+  if (good_decoded != good_lines) {
+    printf("fuzz: %u of %u good lines decoded\n", good_decoded, good_lines);
+    failures++;
+  }
+  if (c.overruns) {
+    printf("fuzz: %u overruns with the ring drained every chunk\n", c.overruns);
+    failures++;
+  }
+  printf("fuzz:    %d lines, %u statuses (%u ok, %u malformed, %u overlong, %u faults, %u noise bytes), "
+         "%d failures\n",
+         lines, statuses, c.ok, c.malformed, c.overlong, c.faults, c.noise, failures);
+  return failures;
+}
+
+// ========== BENCHMARK ==========
+int run_bench(int passes) {
+  std::string stream;
+  for (int i = 0; i < 64; i++) {
+    char text[24];
+    snprintf(text, sizeof(text), "%04d%c%05d\r\n", 30 + i % 8, i % 5 ? '+' : '-', i * 37 % 100000);
+    stream += text;
+  }
+  const size_t CHUNK = 16;     // what bus_loop() reads per UART call
+  TitonFramer framer;
+  TitonFrame frame{};
+  volatile int32_t sink = 0;   // keeps the decode from being optimised out
+  uint64_t allocations_before = allocations;
+  const int BUCKETS = 1000;     // 10 ns each, the last one open-ended
+  static uint64_t chunk_ns[BUCKETS];
+  auto t0 = std::chrono::steady_clock::now();
+  for (int p = 0; p < passes; p++) {
+    for (size_t at = 0; at < stream.size(); at += CHUNK) {
+      auto c0 = std::chrono::steady_clock::now();
+      framer.feed((const uint8_t*)stream.data() + at, std::min(CHUNK, stream.size() - at));
+      for (FrameStatus s; (s = framer.next(frame)) != FRAME_NONE;) sink = sink + s + frame.value;
+      uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - c0).count();
+      chunk_ns[std::min<uint64_t>(ns / 10, BUCKETS - 1)]++;
+    }
+  }
+  double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+  uint64_t allocated = allocations - allocations_before;
+  double bytes = (double)passes * stream.size();
+  uint64_t chunks = 0, seen = 0;
+  for (int i = 0; i < BUCKETS; i++) chunks += chunk_ns[i];
+  int p999 = 0;
+  while (p999 < BUCKETS - 1 && (seen += chunk_ns[p999]) < chunks - chunks / 1000) p999++;
+  printf("bench:   %.0f bytes, %.2f ns/byte, %.1f ns/frame, p99.9 %zu-byte chunk %d ns, %llu allocations\n",
+         bytes, ns / bytes, ns / bytes * 12, CHUNK, (p999 + 1) * 10, (unsigned long long)allocated);
+  if (allocated) {
+    printf("bench: the framer allocated\n");
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int fuzz_lines = 200000;
+  int bench_passes = 20000;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool has_value = i + 1 < argc;
+    if (a == "--seed" && has_value) rng = (uint32_t)strtoul(argv[++i], nullptr, 0);
+    else if (a == "--fuzz" && has_value) fuzz_lines = atoi(argv[++i]);
+    else if (a == "--bench" && has_value) bench_passes = atoi(argv[++i]);
+    else {
+      fprintf(stderr, "usage: titon_frame_test [--seed N] [--fuzz N] [--bench N]\n");
+      return 2;
+    }
+  }
+  if (!rng) rng = 1;
+
+  int failures = run_corpus() + run_fuzz(fuzz_lines) + run_bench(bench_passes);
+  printf("%s\n", failures ? "FAILED" : "passed");
+  return failures ? 1 : 0;
+}
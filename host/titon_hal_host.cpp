@@ -0,0 +1,405 @@
+// Titon MVHR - HAL implementation for Linux host builds
+// Time is the host's monotonic clock, so loop timings measured on the host are
+// real, unless host_clock_virtual() hands it to the driver for accelerated
+// replay. The RS485 UART is wired to a TitonSim (or a CaptureSim); Wi-Fi is a
+// flag; MQTT goes to the in-process HostBroker. Flash files live in memory for
+// the run.
+
+#include "titon_host.h"
+
+#include <stdarg.h>
+#include <chrono>
+#include <atomic>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+HostConsole Serial;
+
+namespace {
+
+const int GPIO_COUNT = 40;
+
+std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+struct HostBus {
+  int port;
+  int de_pin;
+  int re_pin;
+  TitonSim* sim;
+  CaptureSim* replay;  // answers instead of sim when set
+};
+std::vector<HostBus> buses;
+HostBroker broker;
+std::mt19937 rng(1);
+
+bool gpio_level[GPIO_COUNT];
+int adc_raw[GPIO_COUNT];
+int adc_stream_pin = -1;
+uint64_t adc_stream_next_us = 0;
+const uint64_t ADC_STREAM_PERIOD_US = 10000;
+std::minstd_rand adc_rng(7);
+uint32_t tx_while_receiving = 0;
+
+std::vector<std::thread> tasks;
+std::atomic<bool> tasks_running(true);
+
+std::map<std::string, std::vector<uint8_t>> files;
+uint64_t fs_bytes_written = 0;
+std::map<std::string, int32_t> nvs;  // lost on exit, like a freshly erased chip
+uint32_t nvs_writes = 0;
+
+bool wifi_available = true;
+bool wifi_started = false;
+uint32_t wifi_up_at = 0;
+const uint32_t WIFI_ASSOCIATE_MS = 50;
+
+std::atomic<bool> clock_virtual(false);
+std::atomic<uint64_t> clock_virtual_us(0);
+
+CaptureWriter* capture = nullptr;
+uint64_t capture_start_us = 0;
+
+uint64_t now_us() {
+  if (clock_virtual.load(std::memory_order_relaxed)) return clock_virtual_us.load(std::memory_order_relaxed);
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start_time).count();
+}
+
+void bus_receive(HostBus& bus, const uint8_t* data, size_t len) {
+  if (bus.replay) bus.replay->receive(data, len, now_us());
+  else bus.sim->receive(data, len, now_us());
+}
+
+size_t bus_transmit(HostBus& bus, uint8_t* data, size_t len) {
+  return bus.replay ? bus.replay->transmit(data, len, now_us()) : bus.sim->transmit(data, len, now_us());
+}
+
+}  // namespace
+
+int HostConsole::printf(const char* format, ...) {
+  if (quiet) return 0;
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+// ========== CLOCK ==========
+uint32_t hal_millis() { return (uint32_t)(now_us() / 1000); }
+uint32_t hal_micros() { return (uint32_t)now_us(); }
+void hal_delay_ms(uint32_t ms) { hal_delay_us(ms * 1000); }
+void hal_delay_us(uint32_t us) {
+  if (clock_virtual.load(std::memory_order_relaxed)) clock_virtual_us.fetch_add(us, std::memory_order_relaxed);
+  else std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+// The host "cycle counter" ticks in nanoseconds
+uint32_t hal_cycles() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_time).count();
+}
+uint32_t hal_cycles_per_us() { return 1000; }
+
+// ========== GPIO / ADC ==========
+void hal_gpio_output(int pin) {}
+
+void hal_gpio_write(int pin, bool high) {
+  if (pin >= 0 && pin < GPIO_COUNT) gpio_level[pin] = high;
+}
+
+void hal_adc_begin(int pin) {}
+
+int hal_adc_read(int pin) {
+  return (pin >= 0 && pin < GPIO_COUNT) ? adc_raw[pin] : 0;
+}
+
+// The stream delivers the host_set_adc() level at 100 Hz with a few counts
+// of noise and an occasional spike, like the real divider input
+bool hal_adc_stream_begin(int pin) {
+  adc_stream_pin = pin;
+  adc_stream_next_us = now_us();
+  return pin >= 0 && pin < GPIO_COUNT;
+}
+
+bool hal_adc_stream_read(int* raw) {
+  if (adc_stream_pin < 0 || now_us() < adc_stream_next_us) return false;
+  adc_stream_next_us += ADC_STREAM_PERIOD_US;
+  int v = adc_raw[adc_stream_pin] + (int)(adc_rng() % 17) - 8;
+  if (adc_rng() % 50 == 0) v += (adc_rng() & 1) ? 400 : -400;
+  *raw = std::max(0, std::min(4095, v));
+  return true;
+}
+
+// ========== RS485 UART ==========
+void hal_uart_begin(uint32_t baud, int rx_pin, int tx_pin, int port) {
+  for (const HostBus& bus : buses) {
+    if (bus.port == port) return;
+  }
+  buses.push_back(HostBus{ port, -1, -1, new TitonSim(baud), nullptr });
+}
+
+// Bytes sent with every driver on the port disabled never reach a bus
+size_t hal_uart_write(const uint8_t* data, size_t len, int port) {
+  bool sent = false;
+  for (HostBus& bus : buses) {
+    if (bus.port != port || (bus.de_pin >= 0 && !gpio_level[bus.de_pin])) continue;
+    bus_receive(bus, data, len);
+    sent = true;
+  }
+  if (!sent) tx_while_receiving += len;
+  if (capture) capture->bytes(now_us() - capture_start_us, CAPTURE_TX, data, len);
+  return len;
+}
+
+// A disabled receiver loses what its controller sends
+size_t hal_uart_read(uint8_t* data, size_t len, int port) {
+  size_t n = 0;
+  for (HostBus& bus : buses) {
+    if (bus.port != port) continue;
+    if (bus.re_pin >= 0 && gpio_level[bus.re_pin]) {
+      uint8_t discard[64];
+      while (bus_transmit(bus, discard, sizeof(discard)) > 0) {}
+      continue;
+    }
+    n += bus_transmit(bus, data + n, len - n);
+  }
+  if (capture && n) capture->bytes(now_us() - capture_start_us, CAPTURE_RX, data, n);
+  return n;
+}
+
+// ========== ENTROPY ==========
+// Fixed so host runs are repeatable; host_sim_begin() reseeds
+uint32_t hal_entropy() { return 0x7171; }
+
+void hal_random_seed(uint32_t seed) { rng.seed(seed); }
+
+long hal_random(long lo, long hi) {
+  if (hi <= lo) return lo;
+  return lo + (long)(rng() % (unsigned long)(hi - lo));
+}
+
+// ========== TASKS ==========
+// A thread per task; the core number is ignored. Sleeping 1 ms between
+// passes mirrors the one-tick vTaskDelay on the ESP32.
+void hal_task_start(const char* name, void (*body)(), int core) {
+  tasks.emplace_back([body] {
+    while (tasks_running.load(std::memory_order_relaxed)) {
+      body();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+}
+
+// ========== FLASH FILES ==========
+bool hal_fs_begin() { return true; }
+
+bool hal_fs_append(const char* path, const void* data, size_t len) {
+  std::vector<uint8_t>& f = files[path];
+  f.insert(f.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+  fs_bytes_written += len;
+  return true;
+}
+
+size_t hal_fs_read(const char* path, size_t offset, void* data, size_t len) {
+  auto it = files.find(path);
+  if (it == files.end() || offset >= it->second.size()) return 0;
+  size_t n = std::min(len, it->second.size() - offset);
+  memcpy(data, it->second.data() + offset, n);
+  return n;
+}
+
+size_t hal_fs_size(const char* path) {
+  auto it = files.find(path);
+  return it == files.end() ? 0 : it->second.size();
+}
+
+void hal_fs_remove(const char* path) { files.erase(path); }
+
+// ========== NVS ==========
+bool hal_nvs_begin(const char* name) { return true; }
+
+bool hal_nvs_get(const char* key, int32_t* value) {
+  auto it = nvs.find(key);
+  if (it == nvs.end()) return false;
+  *value = it->second;
+  return true;
+}
+
+bool hal_nvs_put(const char* key, int32_t value) {
+  nvs[key] = value;
+  nvs_writes++;
+  return true;
+}
+
+// ========== WI-FI ==========
+void hal_wifi_init() {}
+
+void hal_wifi_connect(const char* ssid, const char* password) {
+  wifi_started = true;
+  wifi_up_at = hal_millis() + WIFI_ASSOCIATE_MS;
+}
+
+bool hal_wifi_connected() {
+  return wifi_available && wifi_started && (int32_t)(hal_millis() - wifi_up_at) >= 0;
+}
+
+void hal_wifi_ip(char* buffer, size_t size) {
+  snprintf(buffer, size, "127.0.0.1");
+}
+
+// ========== MQTT CLIENT ==========
+MqttClient& hal_mqtt() {
+  static MqttClient client;
+  return client;
+}
+
+bool MqttClient::connect(const char* id, const char* user, const char* pass,
+                         const char* will_topic, uint8_t will_qos, bool will_retain, const char* will_message) {
+  if (!hal_wifi_connected()) return false;
+  return broker.client_connect(will_topic, will_message, will_retain);
+}
+
+bool MqttClient::connected() {
+  // The TCP session dies with the link
+  if (!hal_wifi_connected()) broker.client_drop();
+  return broker.client_connected();
+}
+
+int MqttClient::state() {
+  return connected() ? 0 : -2;  // MQTT_CONNECTED / MQTT_CONNECT_FAILED
+}
+
+bool MqttClient::loop() {
+  if (!connected()) return false;
+  BrokerMessage m;
+  while (broker.client_next(m)) {
+    if (!callback_) continue;
+    std::string topic = m.topic;
+    std::string payload = m.payload;
+    // Retained messages are the firmware's own, so a replay recreates them
+    if (capture && !m.retained) capture->mqtt(now_us() - capture_start_us, topic, payload);
+    callback_(&topic[0], (uint8_t*)&payload[0], (unsigned int)payload.size());
+  }
+  return true;
+}
+
+bool MqttClient::subscribe(const char* topic) {
+  return connected() && broker.client_subscribe(topic);
+}
+
+bool MqttClient::publish(const char* topic, const char* payload, bool retained) {
+  return publish(topic, (const uint8_t*)payload, (unsigned int)strlen(payload), retained);
+}
+
+bool MqttClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  // Fixed header (up to 5) + topic length prefix (2) + topic + payload
+  if (5 + 2 + strlen(topic) + length > buffer_size_) return false;
+  if (!connected()) return false;
+  return broker.client_publish(topic, std::string((const char*)payload, length), retained);
+}
+
+bool MqttClient::beginPublish(const char* topic, unsigned int length, bool retained) {
+  if (!connected()) return false;
+  streaming_ = true;
+  stream_topic_ = topic;
+  stream_payload_.clear();
+  stream_length_ = length;
+  stream_retained_ = retained;
+  return true;
+}
+
+size_t MqttClient::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+size_t MqttClient::write(const uint8_t* data, size_t length) {
+  if (!streaming_) return 0;
+  stream_payload_.append((const char*)data, length);
+  return length;
+}
+
+int MqttClient::endPublish() {
+  if (!streaming_) return 0;
+  streaming_ = false;
+  if (stream_payload_.size() != stream_length_) return 0;
+  return broker.client_publish(stream_topic_, stream_payload_, stream_retained_) ? 1 : 0;
+}
+
+// ========== SIMULATION CONTROL ==========
+TitonSim& host_sim(int bus) {
+  if (buses.empty()) buses.push_back(HostBus{ HAL_UART_BUS, -1, -1, new TitonSim(), nullptr });
+  return *buses[bus].sim;
+}
+
+HostBroker& host_broker() { return broker; }
+
+void host_sim_begin(uint32_t seed, int de_pin) {
+  for (HostBus& bus : buses) {
+    delete bus.sim;
+    delete bus.replay;
+  }
+  buses.clear();
+  buses.push_back(HostBus{ HAL_UART_BUS, de_pin, de_pin, new TitonSim(1200, seed), nullptr });
+  rng.seed(seed);
+}
+
+int host_bus_add(int port, int de_pin, int re_pin, uint32_t seed) {
+  buses.push_back(HostBus{ port, de_pin, re_pin, new TitonSim(1200, seed), nullptr });
+  return (int)buses.size() - 1;
+}
+
+CaptureSim& host_replay_begin(const std::vector<CaptureRecord>& records) {
+  host_sim();
+  delete buses[0].replay;
+  buses[0].replay = new CaptureSim(records, now_us());
+  return *buses[0].replay;
+}
+
+void host_capture_begin(FILE* file) {
+  delete capture;
+  capture = file ? new CaptureWriter(file) : nullptr;
+  capture_start_us = now_us();
+}
+
+void host_capture_flush() {
+  if (capture) capture->flush();
+}
+
+void host_clock_virtual(uint64_t start_us) {
+  clock_virtual_us.store(start_us);
+  clock_virtual.store(true);
+}
+
+void host_clock_advance(uint64_t us) { clock_virtual_us.fetch_add(us, std::memory_order_relaxed); }
+
+uint64_t host_clock_us() { return now_us(); }
+
+// Losing the AP drops the association; a connect issued during the outage
+// completes once the AP is back
+void host_set_wifi_available(bool available) {
+  if (wifi_available && !available) wifi_started = false;
+  wifi_available = available;
+}
+
+void host_set_adc(int pin, int raw) {
+  if (pin >= 0 && pin < GPIO_COUNT) adc_raw[pin] = raw;
+}
+
+bool host_gpio_level(int pin) {
+  return pin >= 0 && pin < GPIO_COUNT && gpio_level[pin];
+}
+
+uint32_t host_tx_while_receiving() { return tx_while_receiving; }
+
+uint64_t host_fs_bytes_written() { return fs_bytes_written; }
+
+uint32_t host_nvs_writes() { return nvs_writes; }
+
+void host_stop_tasks() {
+  tasks_running.store(false);
+  for (auto& t : tasks) t.join();
+  tasks.clear();
+}
@@ -0,0 +1,155 @@
+// Titon MVHR - Host (Linux) side of the HAL
+// Declarations for the functions titon_hal.h wraps on the ESP32, plus the
+// minimal Serial console, byte type and MQTT client the firmware expects.
+// Implemented in titon_hal_host.cpp.
+
+#ifndef TITON_HOST_H
+#define TITON_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "titon_sim.h"
+#include "titon_capture.h"
+#include "host_broker.h"
+
+using std::min;
+using std::max;
+typedef uint8_t byte;
+
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
+// ========== CONSOLE ==========
+// Stands in for the Arduino Serial object the firmware logs through
+class HostConsole {
+public:
+  bool quiet = false;
+
+  void begin(unsigned long) {}
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  void print(const char* s) { if (!quiet) fputs(s, stdout); }
+  void print(int v) { print((long)v); }
+  void print(unsigned v) { print((unsigned long)v); }
+  void print(long v) { if (!quiet) ::printf("%ld", v); }
+  void print(unsigned long v) { if (!quiet) ::printf("%lu", v); }
+  void print(double v) { if (!quiet) ::printf("%.2f", v); }
+  void println() { print("\n"); }
+  template <typename T> void println(T v) { print(v); println(); }
+};
+extern HostConsole Serial;
+
+// ========== HAL ==========
+uint32_t hal_millis();
+uint32_t hal_micros();
+void hal_delay_ms(uint32_t ms);
+void hal_delay_us(uint32_t us);
+uint32_t hal_cycles();
+uint32_t hal_cycles_per_us();
+
+void hal_gpio_output(int pin);
+void hal_gpio_write(int pin, bool high);
+void hal_adc_begin(int pin);
+int hal_adc_read(int pin);
+bool hal_adc_stream_begin(int pin);
+bool hal_adc_stream_read(int* raw);
+
+#define HAL_UART_BUS 2
+void hal_uart_begin(uint32_t baud, int rx_pin, int tx_pin, int port = HAL_UART_BUS);
+size_t hal_uart_write(const uint8_t* data, size_t len, int port = HAL_UART_BUS);
+size_t hal_uart_read(uint8_t* data, size_t len, int port = HAL_UART_BUS);
+
+uint32_t hal_entropy();
+void hal_random_seed(uint32_t seed);
+long hal_random(long lo, long hi);
+
+void hal_task_start(const char* name, void (*body)(), int core);
+
+bool hal_fs_begin();
+bool hal_fs_append(const char* path, const void* data, size_t len);
+size_t hal_fs_read(const char* path, size_t offset, void* data, size_t len);
+size_t hal_fs_size(const char* path);
+void hal_fs_remove(const char* path);
+
+bool hal_nvs_begin(const char* name);
+bool hal_nvs_get(const char* key, int32_t* value);
+bool hal_nvs_put(const char* key, int32_t value);
+
+void hal_wifi_init();
+void hal_wifi_connect(const char* ssid, const char* password);
+bool hal_wifi_connected();
+void hal_wifi_ip(char* buffer, size_t size);
+
+// ========== MQTT CLIENT ==========
+// The PubSubClient subset the firmware uses, talking to the HostBroker.
+// Like PubSubClient, publish() refuses messages that don't fit the buffer;
+// beginPublish()/write() stream past it.
+class MqttClient {
+public:
+  typedef void (*Callback)(char* topic, uint8_t* payload, unsigned int length);
+
+  MqttClient& setServer(const char*, uint16_t) { return *this; }
+  MqttClient& setCallback(Callback cb) { callback_ = cb; return *this; }
+  bool setBufferSize(uint16_t size) { buffer_size_ = size; return true; }
+  MqttClient& setSocketTimeout(uint16_t) { return *this; }
+
+  bool connect(const char* id, const char* user, const char* pass,
+               const char* will_topic, uint8_t will_qos, bool will_retain, const char* will_message);
+  bool connected();
+  int state();
+  bool loop();
+  bool subscribe(const char* topic);
+
+  bool publish(const char* topic, const char* payload, bool retained = false);
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained = false);
+  bool beginPublish(const char* topic, unsigned int length, bool retained);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* data, size_t length);
+  int endPublish();
+
+private:
+  Callback callback_ = nullptr;
+  uint16_t buffer_size_ = 256;
+  bool streaming_ = false;
+  bool stream_retained_ = false;
+  unsigned int stream_length_ = 0;
+  std::string stream_topic_;
+  std::string stream_payload_;
+};
+
+MqttClient& hal_mqtt();
+
+// ========== SIMULATION CONTROL ==========
+// For the host driver: the simulated world behind the HAL. Each bus is one
+// simulated controller on a UART port; a port can carry several buses, each
+// behind its own transceiver (bytes go to the buses whose DE pin is high and
+// come from those whose RE pin is low, -1 = always). host_sim_begin() resets
+// to the single gateway bus on HAL_UART_BUS.
+TitonSim& host_sim(int bus = 0);
+HostBroker& host_broker();
+void host_sim_begin(uint32_t seed, int de_pin);
+int host_bus_add(int port, int de_pin, int re_pin, uint32_t seed);
+CaptureSim& host_replay_begin(const std::vector<CaptureRecord>& records);  // bus 0 answers from a capture
+void host_capture_begin(FILE* file);  // records UART traffic and MQTT commands; nullptr stops
+void host_capture_flush();
+// The clock stops following the host and moves only by host_clock_advance()
+// and hal_delay_*(), so a replay runs as fast as the CPU allows and the same
+// way every time. Single-threaded builds only (TITON_DUAL_CORE=0).
+void host_clock_virtual(uint64_t start_us);
+void host_clock_advance(uint64_t us);
+uint64_t host_clock_us();
+void host_set_wifi_available(bool available);
+void host_set_adc(int pin, int raw);
+bool host_gpio_level(int pin);
+uint32_t host_tx_while_receiving();
+void host_stop_tasks();  // joins hal_task_start() threads
+uint64_t host_fs_bytes_written();
+uint32_t host_nvs_writes();
+
+#endif  // TITON_HOST_H
@@ -0,0 +1,178 @@
+// Titon MVHR - Linux host driver
+// Runs the unmodified firmware (setup() + loop()) against the simulated
+// controller and in-process broker from titon_hal_host.cpp, then prints what
+// happened on the bus and on MQTT.
+//
+// Build from the repository root (ArduinoJson is header-only):
+//   g++ -std=gnu++17 -O2 -I. -I<path-to>/ArduinoJson/src -o titon_host
+//       -x c++ titon.cpp -x none host/titon_hal_host.cpp host/titon_host_main.cpp -lpthread
+// Add -fsanitize=thread -g -O1 to check the bus/network task split under
+// ThreadSanitizer, or -DTITON_DUAL_CORE=0 to run both sides from loop().
+//
+// Usage:
+//   titon_host [--seconds N] [--seed N] [--quiet]
+//              [--drop P] [--noise P] [--no-reply P] [--ignore-write P] [--fault ADDR]...
+//              [--master MS] [--hold-replies]
+//              [--wifi-outage START:LEN] [--broker-outage START:LEN]
+//              [--cmd T:JSON]... [--capture FILE]
+// Times are in seconds from start; probabilities are per byte / per request.
+// --master adds a wall controller reading one register every MS milliseconds.
+// --hold-replies makes the controller answer a batch of reads after the
+// batch instead of over it, so the firmware's burst reads are kept.
+// --capture records the run's bus traffic and commands for titon_replay.
+
+#include "titon_host.h"
+
+#include <string>
+#include <vector>
+
+void setup();
+void loop();
+
+namespace {
+
+const char* COMMAND_TOPIC = "homeassistant/climate/titon_mvhr_1/command";
+const int RS485_DE_PIN = 4;
+
+struct Window {
+  double start = -1;
+  double length = 0;
+  bool contains(double t) const { return start >= 0 && t >= start && t < start + length; }
+};
+
+struct ScheduledCommand {
+  double at;
+  std::string payload;
+  bool sent;
+};
+
+bool parse_window(const char* arg, Window& w) {
+  return sscanf(arg, "%lf:%lf", &w.start, &w.length) == 2;
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: titon_host [--seconds N] [--seed N] [--quiet] [--drop P] [--noise P]\n"
+          "                  [--no-reply P] [--ignore-write P] [--fault ADDR]... [--master MS]\n"
+          "                  [--hold-replies]"
+          " [--wifi-outage START:LEN]"
+          " [--broker-outage START:LEN] [--cmd T:JSON]...\n"
+          "                  [--capture FILE]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  double seconds = 30;
+  uint32_t seed = 1;
+  bool quiet = false;
+  SimFaults faults{ 0.0, 0.0, 0.0, 20000 };
+  std::vector<int> fault_addresses;
+  uint32_t master_ms = 0;
+  Window wifi_outage, broker_outage;
+  std::vector<ScheduledCommand> commands;
+  const char* capture_path = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool has_value = i + 1 < argc;
+    if (a == "--quiet") quiet = true;
+    else if (a == "--seconds" && has_value) seconds = atof(argv[++i]);
+    else if (a == "--seed" && has_value) seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+    else if (a == "--drop" && has_value) faults.drop_byte = atof(argv[++i]);
+    else if (a == "--noise" && has_value) faults.noise_byte = atof(argv[++i]);
+    else if (a == "--no-reply" && has_value) faults.no_reply = atof(argv[++i]);
+    else if (a == "--ignore-write" && has_value) faults.ignore_write = atof(argv[++i]);
+    else if (a == "--fault" && has_value) fault_addresses.push_back(atoi(argv[++i]));
+    else if (a == "--master" && has_value) master_ms = (uint32_t)atoi(argv[++i]);
+    else if (a == "--hold-replies") faults.hold_replies = true;
+    else if (a == "--capture" && has_value) capture_path = argv[++i];
+    else if (a == "--wifi-outage" && has_value && parse_window(argv[++i], wifi_outage)) {}
+    else if (a == "--broker-outage" && has_value && parse_window(argv[++i], broker_outage)) {}
+    else if (a == "--cmd" && has_value) {
+      const char* arg = argv[++i];
+      const char* colon = strchr(arg, ':');
+      if (!colon) { usage(); return 2; }
+      commands.push_back(ScheduledCommand{ atof(arg), colon + 1, false });
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  host_sim_begin(seed, RS485_DE_PIN);
+  host_sim().faults = faults;
+  host_sim().master_period_us = master_ms * 1000;
+  for (int address : fault_addresses) host_sim().set_sensor_fault(address, true);
+  host_set_adc(34, 1517);  // ~50% RH through the 68k/22k divider
+  Serial.quiet = quiet;
+
+  HostBroker& broker = host_broker();
+  uint32_t state_messages = 0, backlog_messages = 0, event_messages = 0;
+  auto ends_with = [](const std::string& s, const char* tail) {
+    size_t n = strlen(tail);
+    return s.size() >= n && s.compare(s.size() - n, n, tail) == 0;
+  };
+  broker.on_client_publish = [&](const BrokerMessage& m) {
+    if (ends_with(m.topic, "/state")) state_messages++;
+    else if (ends_with(m.topic, "/backlog")) backlog_messages++;
+    else if (ends_with(m.topic, "/events")) event_messages++;
+  };
+
+  FILE* capture = nullptr;
+  if (capture_path) {
+    capture = fopen(capture_path, "w");
+    if (!capture) {
+      perror(capture_path);
+      return 1;
+    }
+    host_capture_begin(capture);
+  }
+
+  setup();
+
+  uint32_t start = hal_millis();
+  uint64_t loops = 0;
+  for (;;) {
+    double t = (hal_millis() - start) / 1000.0;
+    if (t >= seconds) break;
+
+    host_set_wifi_available(!wifi_outage.contains(t));
+    broker.set_online(!broker_outage.contains(t));
+    for (auto& c : commands) {
+      if (!c.sent && t >= c.at) {
+        broker.publish(COMMAND_TOPIC, c.payload);
+        c.sent = true;
+      }
+    }
+
+    loop();
+    loops++;
+  }
+  host_stop_tasks();
+  if (capture) {
+    host_capture_begin(nullptr);
+    fclose(capture);
+  }
+
+  double elapsed = (hal_millis() - start) / 1000.0;
+  const SimCounters& sc = host_sim().counters();
+  const BrokerCounters& bc = broker.counters();
+  printf("\n===== host run: %.1f s =====\n", elapsed);
+  printf("loop:       %llu passes, %.0f/s\n", (unsigned long long)loops, loops / elapsed);
+  printf("controller: %u requests (%u reads, %u writes, %u bad, %u ignored)\n",
+         sc.requests, sc.reads, sc.writes, sc.bad_requests, sc.ignored);
+  printf("bus:        %u bytes in, %u bytes out, %u dropped, %u noise, %u sent with DE low\n",
+         sc.bytes_in, sc.bytes_out, sc.dropped, sc.noise, host_tx_while_receiving());
+  if (master_ms) printf("master:     %u requests from the wall controller\n", sc.master_requests);
+  printf("collisions: %u (%u requests unheard)\n", sc.collisions, sc.unheard);
+  printf("bus load:   %.1f%% of %u baud\n",
+         100.0 * (sc.bytes_in + sc.bytes_out + sc.noise) * host_sim().byte_us() / 1e6 / elapsed, 1200u);
+  printf("mqtt:       %u connects, %u messages (%u state), %llu bytes, %u delivered, %zu retained\n",
+         bc.connects, bc.client_messages, state_messages, (unsigned long long)bc.client_bytes,
+         bc.delivered, broker.retained().size());
+  printf("outbox:     %u backlog, %u events delivered, %llu bytes written to flash\n",
+         backlog_messages, event_messages, (unsigned long long)host_fs_bytes_written());
+  printf("settings:   %u NVS writes\n", host_nvs_writes());
+  return 0;
+}
@@ -0,0 +1,300 @@
+// Titon MVHR - Capture replay and benchmark
+// Runs the unmodified firmware (setup() + loop()) against a recorded capture
+// (see titon_capture.h): CaptureSim answers its RS485 requests from the
+// recording and the recorded MQTT commands are published at their times. The
+// clock is virtual by default, stepping as fast as the CPU allows, so an hour
+// of capture replays in seconds and the same way every time; --realtime
+// follows the wall clock instead. Every message the firmware publishes is
+// listed as "<topic> <payload>" (escaped as in captures) and can be written
+// out or compared with a golden file. Diagnostics carry loop timings, so they
+// are left out unless --all-topics.
+//
+// --bench N then runs the capture's received bytes N times through each
+// stage of the pipeline on their own and reports ns and heap allocations
+// per frame: framing (TitonFramer), parsing into state (parse_response() +
+// apply_register_updates()), and parsing with a publish_state() per frame.
+// Publishing counts the host MQTT client's copies; on the ESP32 PubSubClient
+// writes into its fixed buffer. It also times a full state snapshot in each
+// encoding, JSON and CBOR, with the payload size, against the state the
+// replay ended in.
+//
+// Build from the repository root, single-threaded so replays are repeatable:
+//   g++ -std=gnu++17 -O2 -DTITON_DUAL_CORE=0 -I. -I<path-to>/ArduinoJson/src -o titon_replay
+//       -x c++ titon.cpp -x none host/titon_hal_host.cpp host/titon_replay_main.cpp
+//
+// Usage:
+//   titon_replay CAPTURE [--realtime] [--step-us N] [--quiet] [--all-topics]
+//                [--out FILE] [--golden FILE] [--bench N]
+// Exit status: 0 ok, 1 output differs from the golden file, 2 bad arguments.
+//
+// host/captures holds captures of the awkward cases (a -99999 reply, stray
+// CR/LF, line noise), each next to the golden output of the firmware that
+// recorded it. After touching framing, decoding or publishing, from the
+// repository root:
+//   for c in host/captures/*.cap; do ./titon_replay $c --quiet --golden ${c%.cap}.golden || echo "$c differs"; done
+// A difference is listed message by message; once it is the intended one,
+// rewrite that golden with --out.
+
+#include "titon_host.h"
+#include "titon_frame.h"
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+void setup();
+void loop();
+struct Unit;
+Unit& gateway_unit(int index);
+void parse_response(Unit& u, int address, int value);
+void apply_register_updates(Unit& u);
+void publish_state(Unit& u, bool full);
+void publish_state_json(Unit& u, uint64_t fields, bool full);
+void publish_state_cbor(Unit& u, uint64_t fields, bool full);
+
+// ========== ALLOCATION COUNTING ==========
+namespace {
+uint64_t allocations = 0;
+}
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+namespace {
+
+const uint64_t TAIL_US = 2000000;  // keep running after the last record for late replies
+
+void usage() {
+  fprintf(stderr,
+          "usage: titon_replay CAPTURE [--realtime] [--step-us N] [--quiet] [--all-topics]\n"
+          "                    [--out FILE] [--golden FILE] [--bench N]\n");
+}
+
+bool read_lines(const char* path, std::vector<std::string>& lines) {
+  FILE* f = fopen(path, "r");
+  if (!f) return false;
+  std::string line;
+  for (int c; (c = fgetc(f)) != EOF;) {
+    if (c != '\n') {
+      line += (char)c;
+      continue;
+    }
+    lines.push_back(line);
+    line.clear();
+  }
+  if (!line.empty()) lines.push_back(line);
+  fclose(f);
+  return true;
+}
+
+// Line-by-line, reporting the first few differences
+size_t diff_lines(const std::vector<std::string>& want, const std::vector<std::string>& got) {
+  const size_t SHOW = 10;
+  size_t differences = 0;
+  size_t n = std::max(want.size(), got.size());
+  for (size_t i = 0; i < n; i++) {
+    const char* w = i < want.size() ? want[i].c_str() : "(end)";
+    const char* g = i < got.size() ? got[i].c_str() : "(end)";
+    if (strcmp(w, g) == 0) continue;
+    if (differences++ < SHOW) printf("message %zu:\n  - %s\n  + %s\n", i + 1, w, g);
+  }
+  if (differences > SHOW) printf("... %zu more\n", differences - SHOW);
+  return differences;
+}
+
+// The bytes through a framer in UART-read sized pieces, as bus_loop() feeds it
+template <typename Fn>
+void frame_all(const std::string& rx, Fn on_frame) {
+  const size_t CHUNK = 16;
+  TitonFramer framer;
+  TitonFrame frame{};
+  for (size_t at = 0; at < rx.size(); at += CHUNK) {
+    framer.feed((const uint8_t*)rx.data() + at, std::min(CHUNK, rx.size() - at));
+    for (FrameStatus s; (s = framer.next(frame)) != FRAME_NONE;) on_frame(s, frame);
+  }
+}
+
+struct BenchResult {
+  double ns_per_frame;
+  double allocations_per_frame;
+};
+
+template <typename Fn>
+BenchResult bench(int passes, size_t frames, Fn fn) {
+  uint64_t allocations_before = allocations;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < passes; i++) fn();
+  double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+  double total = (double)passes * (frames ? frames : 1);
+  return BenchResult{ ns / total, (allocations - allocations_before) / total };
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* capture_path = nullptr;
+  const char* out_path = nullptr;
+  const char* golden_path = nullptr;
+  bool realtime = false;
+  bool quiet = false;
+  bool all_topics = false;
+  uint64_t step_us = 1000;
+  int bench_passes = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    bool has_value = i + 1 < argc;
+    if (a == "--realtime") realtime = true;
+    else if (a == "--quiet") quiet = true;
+    else if (a == "--all-topics") all_topics = true;
+    else if (a == "--step-us" && has_value) step_us = strtoull(argv[++i], nullptr, 0);
+    else if (a == "--out" && has_value) out_path = argv[++i];
+    else if (a == "--golden" && has_value) golden_path = argv[++i];
+    else if (a == "--bench" && has_value) bench_passes = atoi(argv[++i]);
+    else if (a[0] != '-' && !capture_path) capture_path = argv[i];
+    else {
+      usage();
+      return 2;
+    }
+  }
+  if (!capture_path || step_us == 0) {
+    usage();
+    return 2;
+  }
+
+  std::vector<CaptureRecord> records;
+  int bad_line = 0;
+  if (!capture_load(capture_path, records, &bad_line)) {
+    if (bad_line) fprintf(stderr, "%s:%d: not a capture record\n", capture_path, bad_line);
+    else perror(capture_path);
+    return 2;
+  }
+  uint64_t capture_us = records.empty() ? 0 : records.back().t_us;
+
+  host_sim_begin(1, 4);  // the gateway's DE/RE pin
+  if (!realtime) host_clock_virtual(0);
+  const CaptureSim& replay = host_replay_begin(records);
+  Serial.quiet = quiet;
+
+  std::vector<std::string> published;
+  HostBroker& broker = host_broker();
+  broker.on_client_publish = [&](const BrokerMessage& m) {
+    if (!all_topics && m.topic.find("/diagnostics") != std::string::npos) return;
+    published.push_back(capture_escape((const uint8_t*)m.topic.data(), m.topic.size(), true) + " " +
+                        capture_escape((const uint8_t*)m.payload.data(), m.payload.size()));
+  };
+
+  // ---- replay ----
+  auto wall_t0 = std::chrono::steady_clock::now();
+  uint64_t start_us = host_clock_us();
+  size_t next_command = 0;
+  uint64_t loops = 0;
+  setup();
+  for (;;) {
+    uint64_t t = host_clock_us() - start_us;
+    if (t >= capture_us + TAIL_US) break;
+    for (; next_command < records.size() && records[next_command].t_us <= t; next_command++) {
+      const CaptureRecord& r = records[next_command];
+      if (r.kind == CAPTURE_MQTT) broker.publish(r.topic, r.data);
+    }
+    loop();
+    loops++;
+    if (!realtime) host_clock_advance(step_us);
+  }
+  double wall_s = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - wall_t0).count() / 1e6;
+
+  // ---- output ----
+  if (out_path) {
+    FILE* f = fopen(out_path, "w");
+    if (!f) {
+      perror(out_path);
+      return 2;
+    }
+    for (const std::string& line : published) fprintf(f, "%s\n", line.c_str());
+    fclose(f);
+  }
+
+  const CaptureSim::Counters& rc = replay.counters();
+  printf("\n===== replay: %.1f s of capture in %.2f s =====\n", (capture_us + TAIL_US) / 1e6, wall_s);
+  printf("loop:       %llu passes\n", (unsigned long long)loops);
+  printf("controller: %u reads, %u answered from the capture, %u unanswered, %u unsolicited bytes\n",
+         rc.requests, rc.answered, rc.unmatched, rc.unsolicited_bytes);
+  printf("mqtt:       %zu messages compared\n", published.size());
+
+  int status = 0;
+  if (golden_path) {
+    std::vector<std::string> golden;
+    if (!read_lines(golden_path, golden)) {
+      perror(golden_path);
+      return 2;
+    }
+    size_t differences = diff_lines(golden, published);
+    printf("golden:     %s\n", differences ? "DIFFERS" : "matches");
+    if (differences) status = 1;
+  }
+
+  // ---- benchmark ----
+  if (bench_passes > 0) {
+    std::string rx;
+    for (const CaptureRecord& r : records) {
+      if (r.kind == CAPTURE_RX) rx += r.data;
+    }
+    std::vector<TitonFrame> frames;
+    size_t frame_count = 0;
+    frame_all(rx, [&](FrameStatus s, const TitonFrame& f) {
+      frame_count++;
+      if (s == FRAME_OK) frames.push_back(f);
+    });
+
+    Unit& unit = gateway_unit(0);  // the capture is the first unit's line
+    Serial.quiet = true;  // time the pipeline, not the console
+    volatile uint32_t sink = 0;  // keeps the framing pass from being optimised out
+    BenchResult framing = bench(bench_passes, frame_count, [&] {
+      frame_all(rx, [&](FrameStatus s, const TitonFrame& f) { sink = sink + s + f.value; });
+    });
+    BenchResult parsing = bench(bench_passes, frames.size(), [&] {
+      for (const TitonFrame& f : frames) {
+        parse_response(unit, f.address, f.value);
+        apply_register_updates(unit);
+      }
+    });
+    // Each frame published as it lands: the cost the broker link sees at worst
+    BenchResult publishing = bench(bench_passes, frames.size(), [&] {
+      for (const TitonFrame& f : frames) {
+        parse_response(unit, f.address, f.value);
+        apply_register_updates(unit);
+        publish_state(unit, false);
+      }
+    });
+    printf("bench:      %zu bytes, %zu frames (%zu valid), %d passes\n", rx.size(), frame_count, frames.size(),
+           bench_passes);
+    printf("  framing        %8.0f ns/frame %6.2f allocs/frame\n", framing.ns_per_frame,
+           framing.allocations_per_frame);
+    printf("  parse          %8.0f ns/frame %6.2f allocs/frame\n", parsing.ns_per_frame,
+           parsing.allocations_per_frame);
+    printf("  parse+publish  %8.0f ns/frame %6.2f allocs/frame\n", publishing.ns_per_frame,
+           publishing.allocations_per_frame);
+    
+    // One full snapshot per pass in each encoding
+    size_t payload = 0;
+    broker.on_client_publish = [&](const BrokerMessage& m) { payload = m.payload.size(); };
+    BenchResult json = bench(bench_passes, 1, [&] { publish_state_json(unit, ~0ULL, true); });
+    size_t json_bytes = payload;
+    BenchResult cbor = bench(bench_passes, 1, [&] { publish_state_cbor(unit, ~0ULL, true); });
+    printf("  state json     %8.0f ns/snapshot %6.2f allocs %5zu bytes\n", json.ns_per_frame,
+           json.allocations_per_frame, json_bytes);
+    printf("  state cbor     %8.0f ns/snapshot %6.2f allocs %5zu bytes\n", cbor.ns_per_frame,
+           cbor.allocations_per_frame, payload);
+  }
+  return status;
+}
@@ -0,0 +1,284 @@
+// Titon MVHR - Simulated controller for host builds
+// Answers the AAAO±VVVVV request protocol the way the real unit does, at real
+// line timing: every character occupies 10 bit times at the configured baud,
+// and a reply starts a turnaround delay after the request's final LF. Reads
+// are answered as AAAA±VVVVV; writes update the register and are not
+// acknowledged (speed writes 1/2/4/8 read back as 1-4). Faults can be
+// injected per register (-99999 replies) or per byte (drops, noise, ignored
+// requests). Requests sent back to back are answered as each arrives, over
+// the rest of the batch (a collision), and like a transceiver with DE and RE
+// on one pin the controller hears nothing while it is replying, so requests
+// that overlap a reply are lost. hold_replies makes it wait for the line to
+// go quiet instead and answer the whole batch. A second bus master (a wall
+// controller polling the unit) can be switched on; its requests and the
+// replies to them reach the gateway too. Randomness comes from a seeded
+// xorshift so runs are repeatable.
+
+#ifndef TITON_SIM_H
+#define TITON_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#define TITON_SIM_ADDRESSES 1000
+
+struct SimFaults {
+  double drop_byte;        // probability each reply byte is lost on the wire
+  double noise_byte;       // probability a random byte is injected before a reply byte
+  double no_reply;         // probability a read request is ignored
+  uint32_t turnaround_us;  // request end -> first reply byte
+  double ignore_write = 0; // probability a write is silently not applied
+  bool hold_replies = false; // answer a batch of reads once it has all arrived
+};
+
+struct SimCounters {
+  uint32_t requests;
+  uint32_t reads;
+  uint32_t writes;
+  uint32_t bad_requests;
+  uint32_t ignored;
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+  uint32_t dropped;
+  uint32_t noise;
+  uint32_t master_requests;  // sent by the simulated wall controller
+  uint32_t collisions;       // gateway and controller sending at once
+  uint32_t unheard;          // requests lost because they overlapped a reply
+};
+
+class TitonSim {
+public:
+  explicit TitonSim(uint32_t baud = 1200, uint32_t seed = 0x7171u)
+    : byte_us_(10u * 1000000u / baud), rng_(seed ? seed : 1) {
+    faults = SimFaults{ 0.0, 0.0, 0.0, 20000 };
+    counters_ = SimCounters();
+    for (int a = 0; a < TITON_SIM_ADDRESSES; a++) {
+      value_[a] = 0;
+      fault_[a] = false;
+    }
+    load_defaults();
+  }
+
+  SimFaults faults;
+  uint32_t master_period_us = 0;  // wall controller read interval, 0 = none
+
+  // Plausible readings for a unit running at speed 2 with healthy sensors
+  void load_defaults() {
+    value_[30] = 215;    // stale air in, 21.5°C
+    value_[31] = 160;
+    value_[32] = 85;
+    value_[36] = 48;     // internal humidity %
+    value_[60] = 12345;  // runtime hours
+    value_[61] = 0x0800; // engine running
+    value_[341] = 2800;  // filter hours remaining
+    value_[380] = 1350;
+    value_[381] = 1420;
+    value_[382] = 195;
+    value_[383] = 205;
+    value_[384] = 2;
+    value_[385] = 0;
+  }
+
+  void set_register(int address, int32_t value) {
+    if (valid(address)) value_[address] = value;
+  }
+  int32_t register_value(int address) const { return valid(address) ? value_[address] : 0; }
+  void set_sensor_fault(int address, bool fault) {
+    if (valid(address)) fault_[address] = fault;
+  }
+
+  // Gateway -> controller. now_us is when the first byte is handed to the
+  // UART; bytes queue behind anything still being shifted out.
+  void receive(const uint8_t* data, size_t len, uint64_t now_us) {
+    if (!out_.empty() && out_.back().at_us > now_us) counters_.collisions++;
+    if (line_free_us_ < now_us) line_free_us_ = now_us;
+    size_t queued = out_.size();
+    for (size_t i = 0; i < len; i++) {
+      line_free_us_ += byte_us_;
+      counters_.bytes_in++;
+      char c = (char)data[i];
+      // A request whose end is lost is gone; the next one starts afresh
+      if (replying(line_free_us_)) {
+        if (c == '\n') {
+          counters_.unheard++;
+          line_len_ = 0;
+          line_lost_ = false;
+        } else {
+          line_lost_ = true;
+        }
+        continue;
+      }
+      if (c == '\r') continue;
+      if (c == '\n') {
+        line_[line_len_] = '\0';
+        if (line_lost_) counters_.unheard++;
+        else handle_request(line_free_us_);
+        line_len_ = 0;
+        line_lost_ = false;
+        continue;
+      }
+      if (line_len_ < sizeof(line_) - 1) line_[line_len_++] = c;
+    }
+    // Answered a request while the gateway was still sending the next
+    if (out_.size() > queued && out_[queued].at_us < line_free_us_) counters_.collisions++;
+    for (int address : held_) reply(address, line_free_us_);
+    held_.clear();
+  }
+
+  // Controller -> gateway: copy out the bytes whose stop bit has arrived by now_us
+  size_t transmit(uint8_t* out, size_t len, uint64_t now_us) {
+    service_master(now_us);
+    size_t n = 0;
+    while (n < len && !out_.empty() && out_.front().at_us <= now_us) {
+      out[n++] = out_.front().byte;
+      out_.pop_front();
+    }
+    return n;
+  }
+
+  bool idle() const { return out_.empty(); }
+  const SimCounters& counters() const { return counters_; }
+  uint32_t byte_us() const { return byte_us_; }
+
+private:
+  struct TimedByte {
+    uint64_t at_us;
+    uint8_t byte;
+  };
+
+  static bool valid(int address) { return address >= 0 && address < TITON_SIM_ADDRESSES; }
+
+  // The byte ending at end_us overlapped one of our replies
+  bool replying(uint64_t end_us) const {
+    return !faults.hold_replies && end_us > reply_from_us_ && end_us - byte_us_ < reply_until_us_;
+  }
+
+  // What a wall controller shows: temperatures, humidity, status and speed
+  static constexpr int MASTER_REGISTERS[] = { 61, 384, 30, 31, 32, 36, 382, 383 };
+
+  // The wall controller waits for a quiet line, then reads its next register
+  void service_master(uint64_t now_us) {
+    if (!master_period_us || now_us < master_next_us_) return;
+    if (!out_.empty() || line_free_us_ > now_us) return;
+    master_next_us_ = now_us + master_period_us;
+    int address = MASTER_REGISTERS[master_index_++ % (sizeof(MASTER_REGISTERS) / sizeof(MASTER_REGISTERS[0]))];
+    char text[16];
+    int n = snprintf(text, sizeof(text), "%03d1+00000\r\n", address);
+    uint64_t t = now_us;
+    for (int i = 0; i < n; i++) {
+      t += byte_us_;
+      out_.push_back(TimedByte{ t, (uint8_t)text[i] });
+    }
+    line_free_us_ = t;
+    counters_.master_requests++;
+    reply(address, t);
+  }
+
+  static bool digits(const char* s, int n) {
+    for (int i = 0; i < n; i++) {
+      if (s[i] < '0' || s[i] > '9') return false;
+    }
+    return true;
+  }
+
+  void handle_request(uint64_t end_us) {
+    counters_.requests++;
+    // AAA O ± VVVVV
+    if (line_len_ != 10 || !digits(line_, 4) || (line_[4] != '+' && line_[4] != '-') || !digits(line_ + 5, 5)) {
+      counters_.bad_requests++;
+      return;
+    }
+    int address = (line_[0] - '0') * 100 + (line_[1] - '0') * 10 + (line_[2] - '0');
+    int opcode = line_[3] - '0';
+    int32_t value = 0;
+    for (int i = 5; i < 10; i++) value = value * 10 + (line_[i] - '0');
+    if (line_[4] == '-') value = -value;
+
+    if (opcode == 0) {
+      counters_.writes++;
+      if (chance(faults.ignore_write)) {
+        counters_.ignored++;
+        return;
+      }
+      // Speed is written as a bit per speed and reads back as 1-4
+      if (address == 384) {
+        if (value == 1 || value == 2) value_[address] = value;
+        else if (value == 4) value_[address] = 3;
+        else if (value == 8) value_[address] = 4;
+        return;
+      }
+      value_[address] = value;
+      return;
+    }
+    if (opcode != 1) {
+      counters_.bad_requests++;
+      return;
+    }
+
+    counters_.reads++;
+    if (faults.hold_replies) held_.push_back(address);
+    else reply(address, end_us);
+  }
+
+  void reply(int address, uint64_t end_us) {
+    if (chance(faults.no_reply)) {
+      counters_.ignored++;
+      return;
+    }
+    int32_t value = fault_[address] ? -99999 : value_[address];
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%04d%c%05ld\r\n", address, value < 0 ? '-' : '+',
+                     (long)(value < 0 ? -value : value));
+
+    uint64_t t = end_us + faults.turnaround_us;
+    if (!out_.empty() && out_.back().at_us > t) t = out_.back().at_us;
+    reply_from_us_ = t;
+    for (int i = 0; i < n; i++) {
+      if (chance(faults.noise_byte)) {
+        t += byte_us_;
+        out_.push_back(TimedByte{ t, (uint8_t)(next_random() & 0xFF) });
+        counters_.noise++;
+      }
+      t += byte_us_;
+      if (chance(faults.drop_byte)) {
+        counters_.dropped++;
+        continue;
+      }
+      out_.push_back(TimedByte{ t, (uint8_t)text[i] });
+      counters_.bytes_out++;
+    }
+    reply_until_us_ = t;
+  }
+
+  uint32_t next_random() {
+    rng_ ^= rng_ << 13;
+    rng_ ^= rng_ >> 17;
+    rng_ ^= rng_ << 5;
+    return rng_;
+  }
+
+  bool chance(double p) {
+    return p > 0.0 && (next_random() / 4294967296.0) < p;
+  }
+
+  uint32_t byte_us_;
+  uint32_t rng_;
+  int32_t value_[TITON_SIM_ADDRESSES];
+  bool fault_[TITON_SIM_ADDRESSES];
+  char line_[32];
+  size_t line_len_ = 0;
+  bool line_lost_ = false;   // part of the request arrived during a reply
+  uint64_t line_free_us_ = 0;
+  uint64_t reply_from_us_ = 0;  // the latest reply's first byte starts
+  uint64_t reply_until_us_ = 0; // and its last byte ends
+  uint64_t master_next_us_ = 0;
+  std::vector<int> held_;
+  unsigned master_index_ = 0;
+  std::deque<TimedByte> out_;
+  SimCounters counters_;
+};
+
+#endif  // TITON_SIM_H
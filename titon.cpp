@@ -3,9 +3,48 @@
 // RS485: MAX485 module with DE/RE control
 // Version 2.0 - Updated with Ross Cullen's ESPHome discoveries
 
-#include <WiFi.h>
-#include <PubSubClient.h>
+// Loop latency profiling (stage histograms on TOPIC_LATENCY). Set to 0 to
+// compile it out entirely.
+#ifndef TITON_PROFILE
+#define TITON_PROFILE 1
+#endif
+
+// Run the RS485 side as its own task pinned to the other core (see BUS /
+// NETWORK HANDOFF). Set to 0 to run both sides from loop().
+#ifndef TITON_DUAL_CORE
+#define TITON_DUAL_CORE 1
+#endif
+
+// Decode other masters' traffic (a wall controller on the same line), count
+// their reads as our polls and keep off the line mid-exchange (see BUS
+// SNIFFER). Set to 0 if the gateway is alone on the bus.
+#ifndef TITON_BUS_SNIFF
+#define TITON_BUS_SNIFF 1
+#endif
+
+// Send several queued reads in one transmit window when the controller
+// answers them all (see RS485 TRANSACTION ENGINE). Set to 0 to always send
+// one request per window.
+#ifndef TITON_BUS_BURST
+#define TITON_BUS_BURST 1
+#endif
+
+#include "titon_hal.h"
 #include <ArduinoJson.h>
+#include "titon_frame.h"
+#include "titon_registers.h"
+#include "titon_bus.h"
+#include "titon_spsc.h"
+#include "titon_filter.h"
+#include "titon_history.h"
+#include "titon_outbox.h"
+#include "titon_cbor.h"
+#if TITON_BUS_SNIFF
+#include "titon_sniff.h"
+#endif
+#if TITON_PROFILE
+#include "titon_profile.h"
+#endif
 
 // ========== CONFIGURATION ==========
 const char* WIFI_SSID = "YourWiFiName";
@@ -15,73 +54,60 @@ const int MQTT_PORT = 1883;
 const char* MQTT_USER = "mqtt_user";
 const char* MQTT_PASSWORD = "mqtt_pass";
 const char* MQTT_CLIENT_ID = "titon_mvhr";
+const uint16_t MQTT_SOCKET_TIMEOUT_S = 2;  // bounds the CONNACK wait inside mqtt.connect()
 
-// RS485 Settings with MAX485 Module
-const int RS485_RX = 16;      // Connect to RO (Receiver Output) on MAX485
-const int RS485_TX = 17;      // Connect to DI (Driver Input) on MAX485
-const int RS485_DE = 4;       // Connect to DE (Driver Enable) on MAX485
-const int RS485_RE = 4;       // Connect to RE (Receiver Enable) on MAX485 (same pin as DE)
-const int RS485_BAUD = 1200;
+// The Arduino loop() (network side) runs on core 1; Wi-Fi shares core 0
+// with the bus task, which only needs a few ms of CPU per second
+const int BUS_TASK_CORE = 0;
 
-// Relay Control Pins (connected to 3-channel relay module)
-const int RELAY_SW1 = 25;  // SW1: SUMMERboost Disable
-const int RELAY_SW2 = 26;  // SW2: Wet Room Boost
-const int RELAY_SW3 = 27;  // SW3: Speed 1 Setback / Kitchen Boost
+// MVHR units, one row each. Every unit has its own MAX485 module:
+//   rx -> RO (Receiver Output), tx -> DI (Driver Input),
+//   de -> DE (Driver Enable), re -> RE (Receiver Enable; may be DE's pin)
+// on UART 0-2 (Serial, Serial1, Serial2; Serial is the console). Units can
+// share a UART only with DE and RE on separate pins (see TitonBusUnits in
+// titon_bus.h). sw1-3 drive the unit's SW1-3 inputs through a 3-channel
+// relay module; humidity is a 0-10V sensor through a voltage divider on an
+// ADC1 pin. -1 = not fitted. Each unit costs ~40 KB of RAM, most of it
+// history.
+struct UnitConfig {
+  int uart;
+  int rx;
+  int tx;
+  int de;
+  int re;
+  int sw1;                     // SUMMERboost Disable
+  int sw2;                     // Wet Room Boost
+  int sw3;                     // Speed 1 Setback / Kitchen Boost
+  int humidity;
+};
 
-// Humidity Sensor (0-10V via voltage divider)
-const int HUMIDITY_PIN = 34;  // GPIO34 (ADC1_CH6)
+constexpr UnitConfig UNIT_CONFIG[] = {
+  { HAL_UART_BUS, 16, 17, 4, 4, 25, 26, 27, 34 },
+  // { 1, 32, 33, 13, 13, 18, 19, 21, -1 },  // a second unit on Serial1
+};
+constexpr int UNIT_COUNT = sizeof(UNIT_CONFIG) / sizeof(UNIT_CONFIG[0]);
+static_assert(UNIT_COUNT >= 1 && UNIT_COUNT <= 9, "node ids carry a one-digit unit number");
 
 // MQTT Topics
-const char* TOPIC_STATE = "homeassistant/climate/titon_mvhr/state";
-const char* TOPIC_COMMAND = "homeassistant/climate/titon_mvhr/command";
-const char* TOPIC_AVAILABILITY = "homeassistant/climate/titon_mvhr/availability";
-const char* DISCOVERY_PREFIX = "homeassistant";
-
-// ========== STATUS WORD BIT DEFINITIONS ==========
-#define STATUS_SUPPLY_FAN_ERROR     0x0001  // Bit 0
-#define STATUS_THERMISTOR_ERROR     0x0002  // Bit 1 (general)
-#define STATUS_EXTRACT_FAN_ERROR    0x0004  // Bit 2
-#define STATUS_EEPROM_ERROR         0x0008  // Bit 3
-#define STATUS_SWITCH1_ACTIVE       0x0010  // Bit 4
-#define STATUS_SWITCH2_ACTIVE       0x0020  // Bit 5
-#define STATUS_SWITCH3_ACTIVE       0x0040  // Bit 6
-#define STATUS_LS1_ACTIVE           0x0080  // Bit 7
-#define STATUS_LS2_ACTIVE           0x0100  // Bit 8
-#define STATUS_ENGINE_ERROR         0x0200  // Bit 9
-#define STATUS_SWITCH_ERROR         0x0400  // Bit 10
-#define STATUS_ENGINE_RUNNING       0x0800  // Bit 11 (2048 decimal)
-#define STATUS_THERM1_ERROR         0x1000  // Bit 12
-#define STATUS_THERM2_ERROR         0x2000  // Bit 13
-#define STATUS_THERM3_ERROR         0x4000  // Bit 14
-#define STATUS_HUMIDITY_ERROR       0x8000  // Bit 15
+// Unit n (from 1) is Home Assistant node NODE_ID_PREFIX "_<n>": its topics
+// live under homeassistant/climate/<node> (see UnitTopics) and its entities'
+// unique ids start with <node>_. One MQTT connection has one will, so
+// availability, like the loop latency report, is the gateway's.
+constexpr const char* NODE_ID_PREFIX = "titon_mvhr";
+constexpr const char* DISCOVERY_PREFIX = "homeassistant";
+constexpr const char* TOPIC_AVAILABILITY = "homeassistant/climate/titon_mvhr/availability";
+const char* TOPIC_LATENCY = "homeassistant/climate/titon_mvhr/diagnostics/latency";
+const char* TOPIC_HA_STATUS = "homeassistant/status";  // HA birth/will messages
 
 // ========== GLOBALS ==========
-WiFiClient espClient;
-PubSubClient mqtt(espClient);
-
-// Sensor Data - Original
-float supply_temp = NAN;
-float extract_temp = NAN;
-float supply_rpm = NAN;
-float extract_rpm = NAN;
-float current_humidity = NAN;  // External humidity sensor
-int current_speed = 2;
-bool summer_bypass = false;
-bool summerboost_active = false;
-
-// Sensor Data - NEW from Ross Cullen's discoveries
-float stale_air_in_temp = NAN;   // Address 030 - Thermistor 1
-float stale_air_out_temp = NAN;  // Address 031 - Thermistor 2
-float fresh_air_in_temp = NAN;   // Address 032 - Thermistor 3
-int internal_humidity = -1;      // Address 036 - Internal RH sensor
-int runtime_hours = 0;           // Address 060 - Total runtime
-int status_word = 0;             // Address 061 - Status bitmap
-int filter_remaining = 0;        // Address 341 - Filter hours left
-
-// Relay States (for Home Assistant feedback)
-bool relay_sw1_active = false;
-bool relay_sw2_active = false;
-bool relay_sw3_active = false;
+MqttClient& mqtt = hal_mqtt();
+
+// Register values, indexed by RegisterId (see titon_registers.h). Owned by
+// the network side; the bus side feeds them through bus_updates.
+struct RegisterValue {
+  int32_t raw;
+  bool valid;
+};
 
 // Configurable Settings
 struct Settings {
@@ -99,34 +125,341 @@ struct Settings {
   int bypass_extract_threshold = 22;
   int bypass_supply_threshold = 15;
   bool summerboost_enabled = true;
-} settings;
+  int humidity_boost = 0;      // 0 = off, 1 = hold SW2, 2-4 = fan speed (see HUMIDITY BOOST)
+};
+
+// Settings exposed over MQTT. Entries with a name also get an HA number entity.
+struct SettingDesc {
+  const char* key;
+  const char* name;
+  int min_value;
+  int max_value;
+  int Settings::* value;       // integer settings
+  bool Settings::* flag;       // boolean settings
+  int8_t reg;                  // controller register it is synced to (RegisterId), -1 = gateway only
+  bool inverted;               // register holds the negated flag
+};
+
+constexpr SettingDesc SETTINGS_TABLE[] = {
+  { "speed1_supply",            "Speed 1 Supply %",    14, 100, &Settings::speed1_supply,            nullptr, -1, false },
+  { "speed1_extract",           "Speed 1 Extract %",   14, 100, &Settings::speed1_extract,           nullptr, -1, false },
+  { "speed2_supply",            "Speed 2 Supply %",    14, 100, &Settings::speed2_supply,            nullptr, -1, false },
+  { "speed2_extract",           "Speed 2 Extract %",   14, 100, &Settings::speed2_extract,           nullptr, -1, false },
+  { "speed3_supply",            "Speed 3 Supply %",    14, 100, &Settings::speed3_supply,            nullptr, -1, false },
+  { "speed3_extract",           "Speed 3 Extract %",   14, 100, &Settings::speed3_extract,           nullptr, -1, false },
+  { "speed4_supply",            "Speed 4 Supply %",    14, 100, &Settings::speed4_supply,            nullptr, -1, false },
+  { "speed4_extract",           "Speed 4 Extract %",   14, 100, &Settings::speed4_extract,           nullptr, -1, false },
+  { "humidity_setpoint",        "Humidity Setpoint",   30, 100, &Settings::humidity_setpoint,        nullptr, -1, false },
+  { "kitchen_overrun",          "Kitchen Timer (min)", 0,  60,  &Settings::kitchen_overrun,          nullptr, -1, false },
+  { "wetroom_overrun",          "Wet Room Timer (min)", 0, 60,  &Settings::wetroom_overrun,          nullptr, -1, false },
+  { "bypass_extract_threshold", "Bypass Extract °C",   17, 35,  &Settings::bypass_extract_threshold, nullptr, -1, false },
+  { "bypass_supply_threshold",  "Bypass Supply °C",    10, 20,  &Settings::bypass_supply_threshold,  nullptr, -1, false },
+  { "summerboost_enabled",      nullptr,               0,  1,   nullptr, &Settings::summerboost_enabled, REG_SUMMERBOOST_DISABLE, true },
+  { "humidity_boost",           "Humidity Boost (0 off, 1 SW2, 2-4 speed)", 0, 4, &Settings::humidity_boost, nullptr, -1, false },
+};
+const int SETTING_COUNT = sizeof(SETTINGS_TABLE) / sizeof(SETTINGS_TABLE[0]);
+static_assert(SETTING_COUNT <= 32, "settings persistence keeps 32-bit masks");
+
+constexpr int setting_index(bool Settings::* flag) {
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    if (SETTINGS_TABLE[i].flag == flag) return i;
+  }
+  return -1;
+}
+constexpr int SETTING_SUMMERBOOST = setting_index(&Settings::summerboost_enabled);
+static_assert(SETTING_SUMMERBOOST >= 0, "summerboost_enabled missing from SETTINGS_TABLE");
+
+// ========== STATE CHANGE TRACKING ==========
+// One dirty bit per published field. Bits 0..REGISTER_COUNT-1 are the
+// register slots (the status word and bypass flag slots also cover the
+// flags decoded from them).
+enum StateField {
+  FIELD_HUMIDITY = REGISTER_COUNT,
+  FIELD_SW1,
+  FIELD_SW2,
+  FIELD_SW3,
+  FIELD_SETTINGS,              // first of SETTING_COUNT consecutive fields
+};
+const int FIELD_COUNT = FIELD_SETTINGS + SETTING_COUNT;
+static_assert(FIELD_COUNT <= 64, "state_dirty is a 64-bit mask");
+
+const float HUMIDITY_DEADBAND = 1.0;     // %
+const unsigned long HUMIDITY_FALLBACK_MS = 10;
+const unsigned long HUMIDITY_RECORD_INTERVAL = 10000;
+
+// State encodings, selectable at runtime. JSON is what Home Assistant reads;
+// CBOR is the compact form for collectors (see publish_state_cbor).
+enum StateEncoding : uint8_t { STATE_JSON = 1, STATE_CBOR = 2 };
 
-String rx_buffer = "";
-unsigned long last_mqtt_publish = 0;
 unsigned long last_heartbeat = 0;
-unsigned long last_humidity_read = 0;
-unsigned long last_sensor_poll = 0;
-int poll_index = 0;
 const unsigned long PUBLISH_INTERVAL = 5000;
-const unsigned long HUMIDITY_READ_INTERVAL = 5000;
-const unsigned long SENSOR_POLL_INTERVAL = 2000;  // Poll one sensor every 2 seconds
+const unsigned long DELTA_MIN_INTERVAL = 250;       // batch changes arriving together
+const unsigned long FULL_SNAPSHOT_INTERVAL = 60000; // for late subscribers
+const unsigned long DIAGNOSTICS_INTERVAL = 60000;
+unsigned long last_diagnostics_publish = 0;
+
+// ========== UNITS ==========
+// Everything that belongs to one MVHR unit lives in its Unit: bus, state,
+// settings, history, outbox and topics. The bus side (poll scheduler,
+// transaction engine, framer, decoding) and the network side (Wi-Fi, MQTT,
+// JSON, relays, timers) share no mutable state:
+// - decoded register values flow bus -> net through bus_updates
+// - register writes and one-off reads flow net -> bus through bus_commands
+// - write outcomes flow bus -> net through bus_results
+// - the counters diagnostics report are published through bus_status
+// With TITON_DUAL_CORE each side runs on its own core; otherwise loop() runs
+// bus_loop() then net_loop(). The units' lines are scheduled together by
+// TitonBusUnits (titon_bus.h).
+struct RegisterUpdate {
+  uint8_t slot;
+  int32_t value;
+};
+
+enum BusOp : uint8_t { BUS_OP_WRITE, BUS_OP_READ };
+
+struct BusCommand {
+  uint8_t op;
+  uint8_t reg;
+  int32_t value;               // writes only
+};
+
+struct BusStatus {
+  FrameCounters frames;
+  WriteCounters writes;
+  RegisterStats stats[REGISTER_COUNT];
+  uint32_t last_ok[REGISTER_COUNT];
+  uint32_t queue_depth;
+  uint32_t unsolicited;
+  uint32_t update_drops;
+  LineCounters line;
+#if TITON_BUS_SNIFF
+  SniffCounters sniff;
+#endif
+};
+
+const uint16_t OUTBOX_RAM_RECORDS = 64;
+
+struct OutboxCounters {
+  uint32_t queued;
+  uint32_t spilled;
+  uint32_t dropped;
+  uint32_t delivered;
+};
+
+struct SettingsCounters {
+  uint32_t restored;           // found in NVS at boot
+  uint32_t commits;            // batches that wrote anything
+  uint32_t nvs_writes;         // entries written, i.e. flash wear
+  uint32_t nvs_skipped;        // changed, then back to the stored value
+  uint32_t nvs_errors;
+  uint32_t synced;             // controller writes queued
+  uint32_t adopted;            // taken from the controller's boot readback
+};
+
+enum HumidityBoostState { HB_IDLE, HB_BOOST, HB_OVERRUN };
+
+const int HUMIDITY_RISE_SAMPLES = 7;             // every 10 s: a 60 s window
+
+struct HumidityBoost {
+  HumidityBoostState state;
+  int mode;                    // settings.humidity_boost when it started
+  bool owns_output;            // we switched it, so we switch it back
+  int restore_speed;           // fan speed before a speed boost
+  float off_below;
+  bool lockout;                // no new boost until humidity < off_below or timed out
+  int last_reason;
+  unsigned long started;
+  unsigned long since;         // entered the current state
+  unsigned long last_tick;
+  float rise_samples[HUMIDITY_RISE_SAMPLES];
+  int rise_count;
+  unsigned long last_rise_sample;
+  uint32_t boosts;
+};
+
+// History series: one per published register, then the external sensor
+struct HistoryMap {
+  int8_t series[REGISTER_COUNT];  // -1 = no history
+  int8_t reg[REGISTER_COUNT];
+  int count;
+};
+
+constexpr HistoryMap make_history_map() {
+  HistoryMap m{};
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    m.series[i] = -1;
+    if (TITON_REGISTERS[i].json_key) {
+      m.reg[m.count] = (int8_t)i;
+      m.series[i] = (int8_t)m.count++;
+    }
+  }
+  return m;
+}
+
+constexpr HistoryMap HISTORY_MAP = make_history_map();
+constexpr int HISTORY_HUMIDITY = HISTORY_MAP.count;  // external sensor, 0.1 %
+constexpr int HISTORY_SERIES_COUNT = HISTORY_MAP.count + 1;
+
+// A unit's topics, built from its node id by unit_begin()
+struct UnitTopics {
+  char base[48];               // homeassistant/climate/<node>
+  char state[64];
+  char state_cbor[64];
+  char state_schema[64];
+  char command[64];
+  char write_result[64];
+  char diagnostics[64];
+  char history[64];
+  char history_request[64];
+  char backlog[64];
+  char events[64];
+};
+
+struct Unit;
+void bus_receive(Unit& u);
+long bus_urgency(Unit& u);
+void bus_schedule(Unit& u);
+bool rs485_line_quiet(Unit& u);
+
+struct Unit {
+  int index;
+  const UnitConfig* config;
+  char node_id[24];            // NODE_ID_PREFIX "_<n>"
+  UnitTopics topics;
+
+  // --- bus side ---
+  TitonLine rs485;
+  TitonFramer rx_framer;
+  unsigned long rs485_rx_at = 0;               // hal_millis() when a byte was last heard
+#if TITON_BUS_SNIFF
+  // Our reads pair with a late reply until a reply timeout past the deadline
+  // of the longest burst: its requests, the timeout and the other replies
+  BusSniffer bus_sniffer{ TITON_REPLY_TIMEOUT_MS,
+                          (2 * TitonLine::BURST_MAX - 1) * TITON_FRAME_MS + 2 * TITON_REPLY_TIMEOUT_MS };
+#endif
+  unsigned long poll_next_due[REGISTER_COUNT] = {};
+  unsigned long poll_last_ok[REGISTER_COUNT] = {};  // hal_millis() of last good read, 0 = never
+  unsigned long poll_started = 0;              // first poll queued, for the first sweep time
+  bool poll_sweep_started = false;
+  TitonWrites bus_writes;
+  uint8_t write_burst = 0;
+  bool read_pending[REGISTER_COUNT] = {};      // one-off reads of unpolled registers
+  uint32_t bus_update_drops = 0;
+  unsigned long bus_status_published = 0;
+
+  // --- handoff ---
+  SpscQueue<RegisterUpdate, 32> bus_updates;
+  SpscQueue<BusCommand, 16> bus_commands;
+  SpscQueue<WriteResult, 16> bus_results;
+  Seqlock<BusStatus> bus_status;
+
+  // --- network side ---
+  RegisterValue reg_values[REGISTER_COUNT] = {};
+  Settings settings;
+  TitonRelays relays;
+  bool relay_sw1_active = false;               // for Home Assistant feedback
+  bool relay_sw2_active = false;
+  bool relay_sw3_active = false;
+
+  uint64_t state_dirty = 0;
+  int32_t reg_published[REGISTER_COUNT] = {};  // raw value last sent, for deadbands
+  bool reg_published_valid[REGISTER_COUNT] = {};
+  bool state_delta_mode = true;                // false = full JSON every PUBLISH_INTERVAL
+  bool full_snapshot_pending = true;
+  uint8_t state_encoding = STATE_JSON;
+  bool state_schema_pending = true;
+  unsigned long last_mqtt_publish = 0;
+  unsigned long last_full_publish = 0;
+
+  float current_humidity = NAN;                // external humidity sensor, filtered
+  float humidity_published = NAN;
+  MedianIirFilter humidity_filter{ 5 };        // ~0.3 s time constant at 100 Hz
+  bool humidity_streaming = false;             // ADC DMA running; else single conversions
+  unsigned long last_humidity_sample = 0;
+  unsigned long last_humidity_record = 0;      // history / outbox, every HUMIDITY_RECORD_INTERVAL
+  bool humidity_recorded = false;
+  HumidityBoost humidity_boost = { HB_IDLE, 0, false, 0, 0, false, -1, 0, 0, 0, {}, 0, 0, 0 };
+
+  uint32_t settings_unsaved = 0;
+  uint32_t settings_unsynced = 0;
+  uint32_t settings_awaiting_readback = 0;
+  int32_t settings_stored[SETTING_COUNT] = {}; // value in NVS, or the default if none
+  unsigned long settings_changed_at = 0;
+  unsigned long settings_unsaved_since = 0;
+  unsigned long settings_readback_requested = 0;
+  SettingsCounters settings_counters = {};
+
+  OutboxRing<OUTBOX_RAM_RECORDS, REGISTER_COUNT + 1> outbox;
+  OutboxCounters outbox_counters = {};
+  char outbox_log_path[24];                    // /outbox<n>.log
+  size_t outbox_log_size = 0;                  // bytes appended
+  size_t outbox_log_read = 0;                  // bytes delivered
+  size_t outbox_log_previous_boot = 0;         // records below this offset predate this boot
+  uint32_t outbox_rate = 10;                   // messages/s while draining
+  unsigned long outbox_last_sent = 0;
+
+  TimeSeries history[HISTORY_SERIES_COUNT];
+  int factory_reset_timer = 0;
+
+  // For TitonBusUnits
+  TitonLine& line() { return rs485; }
+  void receive() { bus_receive(*this); }
+  void service_line() { rs485.service(rs485_line_quiet(*this)); }
+  long urgency() { return bus_urgency(*this); }
+  void schedule() { bus_schedule(*this); }
+  void debug(const char* message) { Serial.printf("%s: %s\n", node_id, message); }
+};
+
+static_assert(UNIT_COUNT <= TitonBusUnits<Unit>::MAX_UNITS, "more units than TitonBusUnits holds");
+
+Unit units[UNIT_COUNT];
+TitonBusUnits<Unit> bus_units;  // bus side
+
+void mark_dirty(Unit& u, int field) {
+  u.state_dirty |= (1ULL << field);
+}
 
 // ========== FORWARD DECLARATIONS ==========
-void setup_wifi();
-void reconnect_mqtt();
-void mqtt_callback(char* topic, byte* payload, unsigned int length);
-void publish_discovery();
-void publish_state();
-void parse_response(String response);
+void net_service();
+bool reconnect_mqtt();
+void mqtt_callback(char* topic, uint8_t* payload, unsigned int length);
+void discovery_restart(bool forget_published);
+void discovery_service();
+void publish_state(Unit& u, bool full);
+void publish_state_json(Unit& u, uint64_t fields, bool full);
+void publish_state_cbor(Unit& u, uint64_t fields, bool full);
+void parse_response(Unit& u, int address, int value);
+void handle_rs485_frame(Unit& u, FrameStatus status, const TitonFrame& frame);
 void decode_status_word(int status);
-void set_fan_speed(int speed);
-void trigger_boost(int switch_num, unsigned long duration_ms);
-void set_relay(int relay_pin, bool state);
-float read_humidity();
-void rs485_begin_transmit();
-void rs485_begin_receive();
-void send_rs485_command(const char* cmd);
-void poll_mvhr_sensors();
+int reg_int(const Unit& u, RegisterId id, int fallback);
+void set_fan_speed(Unit& u, int speed);
+void trigger_boost(Unit& u, int switch_num, unsigned long duration_ms);
+void set_relay(Unit& u, int switch_num, bool state);
+void service_humidity(Unit& u);
+void service_humidity_boost(Unit& u);
+void service_relays(Unit& u);
+void humidity_boost_override(Unit& u);
+const char* humidity_boost_reason_name(int reason);
+void add_humidity_boost(JsonObject out, const Unit& u);
+void unit_begin(Unit& u, int index);
+void rs485_begin(Unit& u);
+bool bus_write(Unit& u, RegisterId id, int value);
+bool bus_read(Unit& u, RegisterId id);
+void poll_mvhr_sensors(Unit& u);
+void publish_diagnostics(Unit& u);
+void history_record(Unit& u, int slot, int32_t value);
+void history_record_humidity(Unit& u, int32_t tenths);
+void handle_history_request(Unit& u, const uint8_t* payload, unsigned int length);
+uint32_t uptime_seconds();
+void outbox_begin();
+void outbox_delta(Unit& u, int key, int32_t value);
+void outbox_event(Unit& u, int event, int32_t value);
+void outbox_service(Unit& u);
+void settings_begin();
+void settings_update(Unit& u, int index, int value);
+void settings_readback(Unit& u, int slot, int32_t value);
+void settings_service(Unit& u);
+void bus_loop();
 
 // ========== SETUP ==========
 void setup() {
@@ -137,86 +470,713 @@ void setup() {
   Serial.println("Updated with Ross Cullen's discoveries");
   Serial.println("========================================");
   
-  // Initialize RS485 with MAX485 control
-  Serial2.begin(RS485_BAUD, SERIAL_8N1, RS485_RX, RS485_TX);
-  pinMode(RS485_DE, OUTPUT);
-  pinMode(RS485_RE, OUTPUT);
-  rs485_begin_receive();  // Start in receive mode
-  Serial.println("RS485 initialized at 1200 baud with MAX485");
-  
-  // Initialize relay pins
-  pinMode(RELAY_SW1, OUTPUT);
-  pinMode(RELAY_SW2, OUTPUT);
-  pinMode(RELAY_SW3, OUTPUT);
-  digitalWrite(RELAY_SW1, LOW);
-  digitalWrite(RELAY_SW2, LOW);
-  digitalWrite(RELAY_SW3, LOW);
-  Serial.println("Relay outputs initialized");
-  
-  // Initialize humidity sensor ADC
-  pinMode(HUMIDITY_PIN, INPUT);
-  analogSetAttenuation(ADC_11db);  // 0-3.3V range
-  Serial.println("Humidity sensor ADC initialized");
-  
-  setup_wifi();
+  // Each unit's RS485 line in receive mode, its relays and humidity sensor
+  for (int i = 0; i < UNIT_COUNT; i++) {
+    unit_begin(units[i], i);
+  }
+  Serial.printf("%d unit(s) initialized, RS485 at 1200 baud with MAX485\n", UNIT_COUNT);
+  
+  // Settings from NVS, before anything is published (see settings_service)
+  settings_begin();
+  
+  // Store-and-forward log on flash (see outbox_service)
+  outbox_begin();
+  
+  // Network comes up in the background (see net_service)
+  hal_wifi_init();
+  hal_random_seed(hal_entropy());
   
   mqtt.setServer(MQTT_SERVER, MQTT_PORT);
   mqtt.setCallback(mqtt_callback);
   mqtt.setBufferSize(2048);  // Increased for larger state messages
+  mqtt.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
   
-  delay(1000);
-  publish_discovery();
+#if TITON_DUAL_CORE
+  hal_task_start("titon_bus", bus_loop, BUS_TASK_CORE);
+  Serial.printf("RS485 task started on core %d\n", BUS_TASK_CORE);
+#endif
   
   Serial.println("Setup complete!");
   Serial.println("========================================");
 }
 
-// ========== MAX485 CONTROL FUNCTIONS ==========
-void rs485_begin_transmit() {
-  digitalWrite(RS485_DE, HIGH);  // Enable driver
-  digitalWrite(RS485_RE, HIGH);  // Disable receiver
-  delayMicroseconds(10);         // Small delay for switching
+// The ADC streams one pin: the first unit with a humidity sensor gets it,
+// any others take single conversions
+bool humidity_stream_taken = false;
+
+void unit_begin(Unit& u, int index) {
+  u.index = index;
+  u.config = &UNIT_CONFIG[index];
+  snprintf(u.node_id, sizeof(u.node_id), "%s_%d", NODE_ID_PREFIX, index + 1);
+  
+  UnitTopics& t = u.topics;
+  snprintf(t.base, sizeof(t.base), "%s/climate/%s", DISCOVERY_PREFIX, u.node_id);
+  snprintf(t.state, sizeof(t.state), "%s/state", t.base);
+  snprintf(t.state_cbor, sizeof(t.state_cbor), "%s/state/cbor", t.base);
+  snprintf(t.state_schema, sizeof(t.state_schema), "%s/state/schema", t.base);
+  snprintf(t.command, sizeof(t.command), "%s/command", t.base);
+  snprintf(t.write_result, sizeof(t.write_result), "%s/command/result", t.base);
+  snprintf(t.diagnostics, sizeof(t.diagnostics), "%s/diagnostics", t.base);
+  snprintf(t.history, sizeof(t.history), "%s/history", t.base);
+  snprintf(t.history_request, sizeof(t.history_request), "%s/history/get", t.base);
+  snprintf(t.backlog, sizeof(t.backlog), "%s/backlog", t.base);
+  snprintf(t.events, sizeof(t.events), "%s/events", t.base);
+  snprintf(u.outbox_log_path, sizeof(u.outbox_log_path), "/outbox%d.log", index + 1);
+  
+  // RS485 with MAX485 control, in receive mode
+  rs485_begin(u);
+  if (!bus_units.add(u)) Serial.printf("⚠️  %s left off the bus\n", u.node_id);
+  
+  const UnitConfig& c = *u.config;
+  u.relays.begin(c.sw1, c.sw2, c.sw3);
+  
+  // Humidity sensor ADC: continuous background sampling, or single
+  // conversions if continuous mode can't be started
+  if (c.humidity < 0) return;
+  hal_adc_begin(c.humidity);
+  if (!humidity_stream_taken) {
+    humidity_stream_taken = true;
+    u.humidity_streaming = hal_adc_stream_begin(c.humidity);
+  }
+  Serial.printf("%s: humidity sensor ADC %s\n", u.node_id,
+                u.humidity_streaming ? "sampling continuously" : "polling");
+}
+
+// ========== SOFTWARE TIMERS ==========
+// Deferred actions serviced from loop(): delayed RS485 writes and
+// cancellable countdowns. A handful of fixed slots is plenty here
+// and keeps the service pass to one short scan.
+const int TIMER_SLOTS = 8;
+
+typedef void (*TimerCallback)(int arg, int value);
+
+struct SoftTimer {
+  unsigned long due;
+  TimerCallback fn;
+  int arg;
+  int value;
+  int id;                      // 0 = slot free
+};
+
+SoftTimer soft_timers[TIMER_SLOTS];
+int timer_last_id = 0;
+
+// Returns a handle for timer_cancel(), or 0 if every slot is busy.
+int timer_schedule(unsigned long delay_ms, TimerCallback fn, int arg, int value) {
+  for (int i = 0; i < TIMER_SLOTS; i++) {
+    SoftTimer& t = soft_timers[i];
+    if (t.id) continue;
+    if (++timer_last_id <= 0) timer_last_id = 1;
+    t.due = hal_millis() + delay_ms;
+    t.fn = fn;
+    t.arg = arg;
+    t.value = value;
+    t.id = timer_last_id;
+    return t.id;
+  }
+  Serial.println("⚠️  No free timer slot");
+  return 0;
+}
+
+bool timer_cancel(int id) {
+  if (!id) return false;
+  for (int i = 0; i < TIMER_SLOTS; i++) {
+    if (soft_timers[i].id == id) {
+      soft_timers[i].id = 0;
+      return true;
+    }
+  }
+  return false;
+}
+
+void timer_service() {
+  unsigned long now = hal_millis();
+  for (int i = 0; i < TIMER_SLOTS; i++) {
+    SoftTimer& t = soft_timers[i];
+    if (!t.id || (long)(now - t.due) < 0) continue;
+    t.id = 0;  // free first so the callback can reschedule
+    t.fn(t.arg, t.value);
+  }
+}
+
+// ========== RS485 TRANSACTION ENGINE ==========
+// Each unit's TitonLine (titon_bus.h) queues every command as a transaction
+// and drives it from bus_loop(); nothing here waits on a UART. With
+// TITON_BUS_BURST, reads queued back to back share a transmit window once
+// the controller is seen to answer them all. Bus side only.
+#if TITON_BUS_SNIFF
+// Gap after the last byte heard before we start transmitting, ~2 characters
+const unsigned long RS485_IDLE_GAP_MS = 20;
+#endif
+
+// Nobody else is mid-exchange on the unit's line
+bool rs485_line_quiet(Unit& u) {
+#if TITON_BUS_SNIFF
+  unsigned long now = hal_millis();
+  return now - u.rs485_rx_at >= RS485_IDLE_GAP_MS && !u.bus_sniffer.awaiting_reply(now);
+#else
+  return true;
+#endif
+}
+
+void rs485_on_transmit(void* ctx, const Rs485Txn& txn) {
+#if TITON_BUS_SNIFF
+  Unit& u = *(Unit*)ctx;
+  if (txn.expect_address >= 0) u.bus_sniffer.own_request(txn.expect_address, txn.sent_at);
+#endif
+  Serial.printf("RS485 TX: %s", txn.cmd);
+}
+
+void rs485_log(void*, const char* message) {
+  Serial.println(message);
+}
+
+bool verify_result(void* ctx, const WriteResult& r);
+
+void rs485_begin(Unit& u) {
+  const UnitConfig& c = *u.config;
+  u.rs485.set_callbacks(&u, rs485_on_transmit, rs485_log);
+  u.rs485.set_burst(TITON_BUS_BURST);
+  u.bus_writes.set_callback(&u, verify_result);
+  u.rs485.begin(c.rx, c.tx, c.de, c.re, c.uart);
+}
+
+// Replies and other masters' traffic on the unit's UART
+void bus_receive(Unit& u) {
+  uint8_t rx_chunk[16];
+  size_t rx_len;
+  while ((rx_len = hal_uart_read(rx_chunk, sizeof(rx_chunk), u.rs485.uart())) > 0) {
+    u.rs485_rx_at = hal_millis();
+    u.rx_framer.feed(rx_chunk, rx_len);
+    TitonFrame frame;
+    FrameStatus status;
+    while ((status = u.rx_framer.next(frame)) != FRAME_NONE) {
+      handle_rs485_frame(u, status, frame);
+    }
+  }
+}
+
+// ========== SENSOR POLL SCHEDULER ==========
+// Each register has its own refresh period and priority (poll_period_ms /
+// poll_priority in TITON_REGISTERS). Whenever a unit's bus is idle its most
+// urgent due register is read immediately, so reads go out back-to-back
+// instead of one per fixed tick. While bursts work, up to a burst's worth of
+// due registers are queued at once to share a transmit window.
+
+// Logs how long it took to read every polled register once after boot
+void poll_check_sweep(Unit& u) {
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (TITON_REGISTERS[i].poll_period_ms && !u.poll_last_ok[i]) return;
+  }
+  u.rs485.set_sweep_ms(hal_millis() - u.poll_started);
+  Serial.printf("%s: all polled registers read in %lu ms\n", u.node_id,
+                (unsigned long)(hal_millis() - u.poll_started));
+}
+
+void poll_complete(void* ctx, const Rs485Txn& txn, TxnResult result, int) {
+  if (result != TXN_OK) return;
+  Unit& u = *(Unit*)ctx;
+  int slot = register_slot(txn.expect_address);
+  if (slot >= 0) u.poll_last_ok[slot] = hal_millis();
+  if (!u.rs485.counters().sweep_ms) poll_check_sweep(u);
+}
+
+// Most urgent register whose poll is due, or -1
+int poll_due_register(const Unit& u) {
+  unsigned long now = hal_millis();
+  int best = -1;
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    const RegisterDesc& reg = TITON_REGISTERS[i];
+    if (reg.poll_period_ms == 0 || (long)(now - u.poll_next_due[i]) < 0) continue;
+    if (best < 0 ||
+        reg.poll_priority < TITON_REGISTERS[best].poll_priority ||
+        (reg.poll_priority == TITON_REGISTERS[best].poll_priority && (long)(u.poll_next_due[i] - u.poll_next_due[best]) < 0)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void poll_mvhr_sensors(Unit& u) {
+  // Writes and retries already queued take the bus first
+  if (!u.rs485.idle()) return;
+  
+  for (int queued = 0, limit = u.rs485.burst_limit(); queued < limit; queued++) {
+    int best = poll_due_register(u);
+    if (best < 0) return;
+    if (!u.rs485.read(TITON_REGISTERS[best].read_cmd, poll_complete)) return;
+    
+    unsigned long now = hal_millis();
+    if (!u.poll_sweep_started) {
+      u.poll_sweep_started = true;
+      u.poll_started = now;
+    }
+    
+    // Keep the cadence anchored to the schedule, but don't try to catch up on
+    // missed slots after a long stall
+    unsigned long period = TITON_REGISTERS[best].poll_period_ms;
+    u.poll_next_due[best] += period;
+    if ((long)(now - u.poll_next_due[best]) >= 0) u.poll_next_due[best] = now + period;
+  }
 }
 
-void rs485_begin_receive() {
-  delayMicroseconds(10);         // Wait for transmission to complete
-  digitalWrite(RS485_DE, LOW);   // Disable driver
-  digitalWrite(RS485_RE, LOW);   // Enable receiver
+// ========== BUS / NETWORK HANDOFF ==========
+// Each unit's queues and status seqlock (see UNITS). The bus side publishes
+// its status every BUS_STATUS_INTERVAL.
+const unsigned long BUS_STATUS_INTERVAL = 250;
+
+// Register writes wait in TitonWrites' one slot per register, so a burst
+// of commands collapses to the latest value per register, and every write
+// is read back and retried (titon_bus.h). Outcomes go to the network side
+// through bus_results. Bus side only.
+const uint8_t WRITE_BURST = 2;  // writes in a row before a due poll gets a turn
+
+// Anything queued ahead of polls goes first (see TitonBusUnits::grant)
+const long COMMAND_URGENCY = 0x40000000L;
+
+// --- bus side ---
+void bus_push_update(Unit& u, int slot, int32_t value) {
+  if (!u.bus_updates.push(RegisterUpdate{ (uint8_t)slot, value })) u.bus_update_drops++;
+}
+
+void bus_service_commands(Unit& u) {
+  BusCommand c;
+  while (u.bus_commands.pop(c)) {
+    if (c.op == BUS_OP_READ) u.read_pending[c.reg] = true;
+    else u.bus_writes.stage(c.reg, c.value);
+  }
+}
+
+// Queues the first requested one-off read; true if it took the bus
+bool read_service(Unit& u) {
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (!u.read_pending[i]) continue;
+    if (!u.rs485.read(TITON_REGISTERS[i].read_cmd, poll_complete)) return false;
+    u.read_pending[i] = false;
+    return true;
+  }
+  return false;
+}
+
+bool verify_result(void* ctx, const WriteResult& r) {
+  return ((Unit*)ctx)->bus_results.push(r);
+}
+
+void verify_complete(void* ctx, const Rs485Txn& txn, TxnResult result, int value) {
+  ((Unit*)ctx)->bus_writes.readback(register_slot(txn.expect_address), result, value);
+}
+
+// Queues the first due readback; true if it took the bus
+bool verify_service(Unit& u) {
+  int reg = u.bus_writes.readback_due();
+  if (reg < 0 || !u.rs485.read(TITON_REGISTERS[reg].read_cmd, verify_complete)) return false;
+  u.bus_writes.readback_started(reg);
+  return true;
 }
 
-void send_rs485_command(const char* cmd) {
-  rs485_begin_transmit();
-  Serial2.print(cmd);
-  Serial2.flush();  // Wait for transmission to complete
-  rs485_begin_receive();
-  Serial.printf("RS485 TX: %s", cmd);
+// How long the unit's most urgent job has been waiting: readbacks, reads and
+// writes beat any poll; negative if nothing is due
+long bus_urgency(Unit& u) {
+  if (u.bus_writes.readback_due() >= 0 || u.bus_writes.next() >= 0) return COMMAND_URGENCY;
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (u.read_pending[i]) return COMMAND_URGENCY;
+  }
+  int due = poll_due_register(u);
+  return due < 0 ? -1 : (long)(hal_millis() - u.poll_next_due[due]);
 }
 
-// ========== WIFI ==========
-void setup_wifi() {
-  Serial.print("Connecting to WiFi: ");
-  Serial.println(WIFI_SSID);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+// Called when the unit's bus is free: due readbacks and requested reads
+// first, then a pending write, unless WRITE_BURST writes just went out and a
+// poll is due.
+void bus_schedule(Unit& u) {
+  if (!u.rs485.idle()) return;
+  if (verify_service(u)) return;
+  if (read_service(u)) return;
+  
+  int w = u.bus_writes.next();
+  if (w >= 0 && (u.write_burst < WRITE_BURST || poll_due_register(u) < 0)) {
+    if (!u.rs485.write((RegisterId)w, u.bus_writes.value(w))) return;
+    u.bus_writes.sent(w);
+    u.write_burst++;
+    return;
+  }
   
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 30) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
+  u.write_burst = 0;
+  poll_mvhr_sensors(u);
+}
+
+void bus_publish_status(Unit& u) {
+  if (hal_millis() - u.bus_status_published < BUS_STATUS_INTERVAL) return;
+  u.bus_status_published = hal_millis();
+  
+  // Static: the bus task's stack is 4 KB and BusStatus is ~650 bytes
+  static BusStatus st;
+  st.frames = u.rx_framer.counters();
+  st.writes = u.bus_writes.counters();
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    st.stats[i] = u.rs485.stats(i);
+    st.last_ok[i] = u.poll_last_ok[i];
+  }
+  st.queue_depth = u.rs485.queued();
+  st.unsolicited = u.rs485.unsolicited();
+  st.update_drops = u.bus_update_drops;
+  st.line = u.rs485.counters();
+#if TITON_BUS_SNIFF
+  st.sniff = u.bus_sniffer.counters();
+#endif
+  u.bus_status.write(st);
+}
+
+// --- network side ---
+bool bus_write(Unit& u, RegisterId id, int value) {
+  if (!TITON_REGISTERS[id].write_cmd) return false;
+  if (u.bus_commands.push(BusCommand{ BUS_OP_WRITE, (uint8_t)id, value })) return true;
+  Serial.printf("%s: RS485 command queue full, dropped write to %03d\n", u.node_id, TITON_REGISTERS[id].address);
+  return false;
+}
+
+// Reads a register once, outside the poll schedule; the value arrives
+// through apply_register_updates like any other
+bool bus_read(Unit& u, RegisterId id) {
+  if (u.bus_commands.push(BusCommand{ BUS_OP_READ, (uint8_t)id, 0 })) return true;
+  Serial.printf("%s: RS485 command queue full, dropped read of %03d\n", u.node_id, TITON_REGISTERS[id].address);
+  return false;
+}
+
+// One message per verified write: {"reg":384,"key":"current_speed",
+// "value":8,"readback":4,"result":"ok","attempts":1}. Results that arrive
+// while MQTT is down are only logged.
+void publish_write_results(Unit& u) {
+  WriteResult r;
+  while (u.bus_results.peek(r)) {
+    const RegisterDesc& reg = TITON_REGISTERS[r.reg];
+    const char* outcome = WRITE_OUTCOME_NAMES[r.outcome];
+    if (mqtt.connected()) {
+      char buffer[160];
+      snprintf(buffer, sizeof(buffer),
+               "{\"reg\":%d,\"key\":%s%s%s,\"value\":%ld,\"readback\":%ld,\"result\":\"%s\",\"attempts\":%u}",
+               reg.address, reg.json_key ? "\"" : "", reg.json_key ? reg.json_key : "null", reg.json_key ? "\"" : "",
+               (long)r.value, (long)r.readback, outcome, (unsigned)r.attempts);
+      if (!mqtt.publish(u.topics.write_result, buffer)) return;  // retry next pass
+    }
+    if (r.outcome != WRITE_OK) {
+      Serial.printf("⚠️  %s: write %03d=%ld %s (readback %ld after %u attempts)\n", u.node_id,
+                    reg.address, (long)r.value, outcome, (long)r.readback, (unsigned)r.attempts);
+    }
+    u.bus_results.pop();
+  }
+}
+
+void apply_register_updates(Unit& u) {
+  RegisterUpdate update;
+  while (u.bus_updates.pop(update)) {
+    int slot = update.slot;
+    const RegisterDesc& reg = TITON_REGISTERS[slot];
+    u.reg_values[slot].raw = update.value;
+    u.reg_values[slot].valid = true;
+    history_record(u, slot, update.value);
+    outbox_delta(u, slot, update.value);
+    settings_readback(u, slot, update.value);
+    if (!u.reg_published_valid[slot] || register_moved(reg, u.reg_published[slot], update.value)) {
+      mark_dirty(u, slot);
+    }
+  }
+}
+
+// ========== CONNECTION MANAGER ==========
+// Wi-Fi and MQTT are brought up by a state machine stepped once per loop()
+// pass; nothing waits for the network, so bus polling and local control keep
+// running through outages. Failed attempts back off exponentially with
+// jitter so several gateways don't hammer the AP/broker in lockstep.
+enum NetState { NET_DISCONNECTED, NET_WIFI_CONNECTING, NET_WIFI_CONNECTED, NET_MQTT_CONNECTED };
+
+const unsigned long WIFI_CONNECT_TIMEOUT_MS = 15000;
+const unsigned long NET_BACKOFF_MIN_MS = 1000;
+const unsigned long NET_BACKOFF_MAX_MS = 60000;
+
+NetState net_state = NET_DISCONNECTED;
+unsigned long net_state_since = 0;
+unsigned long net_next_attempt = 0;
+unsigned long wifi_backoff_ms = NET_BACKOFF_MIN_MS;
+unsigned long mqtt_backoff_ms = NET_BACKOFF_MIN_MS;
+
+struct NetCounters {
+  uint32_t wifi_attempts;
+  uint32_t wifi_connects;
+  uint32_t mqtt_attempts;
+  uint32_t mqtt_connects;
+  unsigned long wifi_down_since;       // 0 = up
+  unsigned long mqtt_down_since;
+  unsigned long wifi_last_outage_ms;   // time to reconnect after the last drop
+  unsigned long mqtt_last_outage_ms;
+  unsigned long mqtt_max_outage_ms;
+} net_counters;
+
+unsigned long next_backoff(unsigned long& backoff) {
+  unsigned long delay_ms = backoff + hal_random(0, backoff / 2 + 1);
+  backoff = min(backoff * 2, NET_BACKOFF_MAX_MS);
+  return delay_ms;
+}
+
+void net_set_state(NetState state) {
+  net_state = state;
+  net_state_since = hal_millis();
+}
+
+void net_wifi_lost() {
+  Serial.println("WiFi connection lost");
+  net_counters.wifi_down_since = hal_millis();
+  if (!net_counters.mqtt_down_since) net_counters.mqtt_down_since = hal_millis();
+  net_next_attempt = hal_millis();
+  net_set_state(NET_DISCONNECTED);
+}
+
+void net_service() {
+  unsigned long now = hal_millis();
+  
+  switch (net_state) {
+    case NET_DISCONNECTED:
+      if ((long)(now - net_next_attempt) < 0) return;
+      Serial.print("Connecting to WiFi: ");
+      Serial.println(WIFI_SSID);
+      hal_wifi_connect(WIFI_SSID, WIFI_PASSWORD);
+      net_counters.wifi_attempts++;
+      net_set_state(NET_WIFI_CONNECTING);
+      break;
+      
+    case NET_WIFI_CONNECTING:
+      if (hal_wifi_connected()) {
+        char ip[16];
+        hal_wifi_ip(ip, sizeof(ip));
+        Serial.printf("WiFi connected, IP address: %s\n", ip);
+        net_counters.wifi_connects++;
+        if (net_counters.wifi_down_since) {
+          net_counters.wifi_last_outage_ms = now - net_counters.wifi_down_since;
+          net_counters.wifi_down_since = 0;
+        }
+        wifi_backoff_ms = NET_BACKOFF_MIN_MS;
+        net_next_attempt = now;
+        net_set_state(NET_WIFI_CONNECTED);
+      } else if (now - net_state_since > WIFI_CONNECT_TIMEOUT_MS) {
+        net_next_attempt = now + next_backoff(wifi_backoff_ms);
+        Serial.printf("WiFi connect FAILED, retrying in %lu ms\n", net_next_attempt - now);
+        if (!net_counters.wifi_down_since) net_counters.wifi_down_since = net_state_since;
+        net_set_state(NET_DISCONNECTED);
+      }
+      break;
+      
+    case NET_WIFI_CONNECTED:
+      if (!hal_wifi_connected()) {
+        net_wifi_lost();
+        return;
+      }
+      if ((long)(now - net_next_attempt) < 0) return;
+      net_counters.mqtt_attempts++;
+      if (reconnect_mqtt()) {
+        net_counters.mqtt_connects++;
+        if (net_counters.mqtt_down_since) {
+          net_counters.mqtt_last_outage_ms = hal_millis() - net_counters.mqtt_down_since;
+          if (net_counters.mqtt_last_outage_ms > net_counters.mqtt_max_outage_ms) {
+            net_counters.mqtt_max_outage_ms = net_counters.mqtt_last_outage_ms;
+          }
+          net_counters.mqtt_down_since = 0;
+        }
+        mqtt_backoff_ms = NET_BACKOFF_MIN_MS;
+        net_set_state(NET_MQTT_CONNECTED);
+      } else {
+        net_next_attempt = hal_millis() + next_backoff(mqtt_backoff_ms);
+        if (!net_counters.mqtt_down_since) net_counters.mqtt_down_since = now;
+      }
+      break;
+      
+    case NET_MQTT_CONNECTED:
+      if (!hal_wifi_connected()) {
+        net_wifi_lost();
+        return;
+      }
+      if (!mqtt.connected()) {
+        Serial.println("MQTT connection lost");
+        net_counters.mqtt_down_since = now;
+        net_next_attempt = now;
+        net_set_state(NET_WIFI_CONNECTED);
+        return;
+      }
+      mqtt.loop();
+      break;
+  }
+}
+
+// ========== STORE AND FORWARD ==========
+// What the gateway sees while the broker is unreachable is kept, not dropped:
+// - register and humidity updates made while MQTT is down are queued as
+//   deltas that coalesce per field (latest, min, max, count; OutboxRing)
+// - command acknowledgements are always queued as events, so they stay in
+//   order with the backlog
+// When the RAM ring fills, its oldest records are appended to a LittleFS log
+// in batches; the log is capped and deleted once drained, never rewritten.
+// After reconnecting the log, then the ring, is published at outbox_rate
+// messages/s:
+//   backlog  {"key":"supply_temp","t":812,"t0":640,"age":95,"v":215,
+//             "min":209,"max":221,"n":9,"scale":0.1}
+//   events   {"event":"sw2","t":1200,"age":0,"v":1}
+//            {"event":"humidity_boost","t":1500,"age":0,"v":1,"reason":"rise"}
+// t/t0 are uptime seconds. "age" (seconds before publishing) is left out for
+// records logged before a reboot; those are delivered at least once.
+enum OutboxEvent : uint8_t {
+  EVENT_SW1,
+  EVENT_SW2,
+  EVENT_SW3,
+  EVENT_WETROOM_BOOST,
+  EVENT_KITCHEN_BOOST,
+  EVENT_FAN_SPEED,
+  EVENT_BOOST_INHIBIT,
+  EVENT_SUMMER_BYPASS,
+  EVENT_SUMMERBOOST,
+  EVENT_FACTORY_RESET,
+  EVENT_HUMIDITY_BOOST,        // value: reason << 1 | on (see HUMIDITY BOOST)
+  EVENT_COUNT
+};
+
+const char* const EVENT_NAMES[EVENT_COUNT] = {
+  "sw1", "sw2", "sw3", "wetroom_boost", "kitchen_boost", "fan_speed",
+  "boost_inhibit", "summer_bypass", "summerboost", "factory_reset", "humidity_boost",
+};
+
+const int OUTBOX_KEY_HUMIDITY = REGISTER_COUNT;  // delta keys: register slots, then humidity
+const uint16_t OUTBOX_SPILL_BATCH = 16;          // records per flash append (384 bytes)
+const size_t OUTBOX_LOG_MAX = 16384;             // ~680 records per unit
+
+bool outbox_fs_ok = false;
+
+void outbox_begin() {
+  outbox_fs_ok = hal_fs_begin();
+  if (!outbox_fs_ok) {
+    Serial.println("Outbox: flash unavailable, RAM only");
+    return;
+  }
+  for (Unit& u : units) {
+    u.outbox_log_size = hal_fs_size(u.outbox_log_path) / sizeof(OutboxRecord) * sizeof(OutboxRecord);
+    u.outbox_log_previous_boot = u.outbox_log_size;
+    if (u.outbox_log_size) {
+      Serial.printf("Outbox: %s has %u records left from before reboot\n", u.node_id,
+                    (unsigned)(u.outbox_log_size / sizeof(OutboxRecord)));
+    }
+  }
+}
+
+void outbox_log_clear(Unit& u) {
+  hal_fs_remove(u.outbox_log_path);
+  u.outbox_log_size = 0;
+  u.outbox_log_read = 0;
+  u.outbox_log_previous_boot = 0;
+}
+
+// Moves the oldest RAM records to flash in one append
+void outbox_spill(Unit& u) {
+  OutboxRecord batch[OUTBOX_SPILL_BATCH];
+  uint16_t n = 0;
+  while (n < OUTBOX_SPILL_BATCH && u.outbox.size()) {
+    batch[n++] = u.outbox.front();
+    u.outbox.pop();
+  }
+  size_t bytes = n * sizeof(OutboxRecord);
+  if (!outbox_fs_ok || u.outbox_log_size + bytes > OUTBOX_LOG_MAX ||
+      !hal_fs_append(u.outbox_log_path, batch, bytes)) {
+    u.outbox_counters.dropped += n;
+    return;
+  }
+  u.outbox_log_size += bytes;
+  u.outbox_counters.spilled += n;
+}
+
+// Online, the state topic carries the update
+void outbox_delta(Unit& u, int key, int32_t value) {
+  if (key < REGISTER_COUNT && !TITON_REGISTERS[key].json_key) return;
+  if (mqtt.connected()) return;
+  uint32_t t = uptime_seconds();
+  uint32_t before = u.outbox.size();
+  if (!u.outbox.delta((uint8_t)key, t, value)) {
+    outbox_spill(u);
+    before = u.outbox.size();
+    if (!u.outbox.delta((uint8_t)key, t, value)) {
+      u.outbox_counters.dropped++;
+      return;
+    }
+  }
+  if (u.outbox.size() > before) u.outbox_counters.queued++;  // else folded into a queued delta
+}
+
+void outbox_event(Unit& u, int event, int32_t value) {
+  uint32_t t = uptime_seconds();
+  if (u.outbox.full()) outbox_spill(u);
+  if (u.outbox.event((uint8_t)event, t, value)) u.outbox_counters.queued++;
+  else u.outbox_counters.dropped++;
+}
+
+bool outbox_publish(Unit& u, const OutboxRecord& r, bool previous_boot) {
+  char age[24] = "";
+  if (!previous_boot) snprintf(age, sizeof(age), ",\"age\":%lu", (unsigned long)(uptime_seconds() - r.last_s));
+  
+  char buffer[224];
+  if (r.kind == OUTBOX_EVENT) {
+    if (r.key >= EVENT_COUNT) return true;  // not ours: skip
+    if (r.key == EVENT_HUMIDITY_BOOST) {
+      snprintf(buffer, sizeof(buffer), "{\"event\":\"%s\",\"t\":%lu%s,\"v\":%ld,\"reason\":\"%s\"}",
+               EVENT_NAMES[r.key], (unsigned long)r.last_s, age, (long)(r.value & 1),
+               humidity_boost_reason_name(r.value >> 1));
+    } else {
+      snprintf(buffer, sizeof(buffer), "{\"event\":\"%s\",\"t\":%lu%s,\"v\":%ld}",
+               EVENT_NAMES[r.key], (unsigned long)r.last_s, age, (long)r.value);
+    }
+    return mqtt.publish(u.topics.events, buffer);
   }
   
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println(" connected!");
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
+  if (r.key > OUTBOX_KEY_HUMIDITY) return true;
+  bool humidity = r.key == OUTBOX_KEY_HUMIDITY;
+  const RegisterDesc& reg = TITON_REGISTERS[humidity ? 0 : r.key];
+  if (!humidity && !reg.json_key) return true;
+  snprintf(buffer, sizeof(buffer),
+           "{\"key\":\"%s\",\"t\":%lu,\"t0\":%lu%s,\"v\":%ld,\"min\":%ld,\"max\":%ld,\"n\":%u%s}",
+           humidity ? "humidity" : reg.json_key, (unsigned long)r.last_s, (unsigned long)r.first_s, age,
+           (long)r.value, (long)r.min, (long)r.max, (unsigned)r.count,
+           humidity || reg.decode == DECODE_TENTHS ? ",\"scale\":0.1" : "");
+  return mqtt.publish(u.topics.backlog, buffer);
+}
+
+// One record per call, oldest first, paced by the unit's outbox_rate
+void outbox_service(Unit& u) {
+  if (u.outbox_log_read >= u.outbox_log_size && !u.outbox.size()) return;
+  if (hal_millis() - u.outbox_last_sent < 1000 / u.outbox_rate || !mqtt.connected()) return;
+  
+  OutboxRecord r;
+  bool from_log = u.outbox_log_read < u.outbox_log_size;
+  if (from_log) {
+    if (hal_fs_read(u.outbox_log_path, u.outbox_log_read, &r, sizeof(r)) != sizeof(r)) {
+      Serial.printf("Outbox: %s log unreadable, discarded\n", u.node_id);
+      u.outbox_counters.dropped += (u.outbox_log_size - u.outbox_log_read) / sizeof(OutboxRecord);
+      outbox_log_clear(u);
+      return;
+    }
   } else {
-    Serial.println(" FAILED!");
+    r = u.outbox.front();
+  }
+  
+  // On failure leave it queued and retry on a later pass
+  if (!outbox_publish(u, r, from_log && u.outbox_log_read < u.outbox_log_previous_boot)) return;
+  u.outbox_last_sent = hal_millis();
+  u.outbox_counters.delivered++;
+  
+  if (!from_log) {
+    u.outbox.pop();
+  } else if ((u.outbox_log_read += sizeof(r)) >= u.outbox_log_size) {
+    outbox_log_clear(u);
   }
 }
 
 // ========== MQTT RECONNECT ==========
-void reconnect_mqtt() {
-  if (mqtt.connected()) return;
+// One connection attempt; the connection manager decides when to call it.
+bool reconnect_mqtt() {
+  if (mqtt.connected()) return true;
   
   Serial.print("Connecting to MQTT...");
   
@@ -224,553 +1184,1570 @@ void reconnect_mqtt() {
                    TOPIC_AVAILABILITY, 0, true, "offline")) {
     Serial.println(" connected!");
     mqtt.publish(TOPIC_AVAILABILITY, "online", true);
-    mqtt.subscribe(TOPIC_COMMAND);
-  } else {
-    Serial.print(" failed, rc=");
-    Serial.println(mqtt.state());
+    mqtt.subscribe(TOPIC_HA_STATUS);
+    for (Unit& u : units) {
+      mqtt.subscribe(u.topics.command);
+      mqtt.subscribe(u.topics.history_request);
+      u.full_snapshot_pending = true;
+      u.state_schema_pending = true;
+    }
+    discovery_restart(true);
+    return true;
   }
+  
+  Serial.print(" failed, rc=");
+  Serial.println(mqtt.state());
+  return false;
 }
 
 // ========== MQTT CALLBACK ==========
-void mqtt_callback(char* topic, byte* payload, unsigned int length) {
-  String message = "";
-  for (unsigned int i = 0; i < length; i++) {
-    message += (char)payload[i];
+const unsigned long FACTORY_RESET_DELAY_MS = 5000;
+
+void factory_reset_fire(int unit, int value) {
+  Unit& u = units[unit];
+  u.factory_reset_timer = 0;
+  bus_write(u, REG_FACTORY_RESET, value);
+  outbox_event(u, EVENT_FACTORY_RESET, 1);
+  Serial.printf("%s: factory reset command sent!\n", u.node_id);
+}
+
+void cancel_factory_reset(Unit& u) {
+  if (timer_cancel(u.factory_reset_timer)) {
+    Serial.printf("%s: factory reset aborted\n", u.node_id);
+  }
+  u.factory_reset_timer = 0;
+}
+
+void handle_command(Unit& u, const uint8_t* payload, unsigned int length);
+
+void mqtt_callback(char* topic, uint8_t* payload, unsigned int length) {
+  // HA restarted and may have lost its entities: publish every config again
+  if (strcmp(topic, TOPIC_HA_STATUS) == 0) {
+    if (length == 6 && memcmp(payload, "online", 6) == 0) discovery_restart(true);
+    return;
   }
   
-  Serial.print("MQTT RX: ");
-  Serial.println(message);
+  for (Unit& u : units) {
+    if (strcmp(topic, u.topics.history_request) == 0) {
+      handle_history_request(u, payload, length);
+      return;
+    }
+    if (strcmp(topic, u.topics.command) == 0) {
+      handle_command(u, payload, length);
+      return;
+    }
+  }
+}
+
+void handle_command(Unit& u, const uint8_t* payload, unsigned int length) {
+  Serial.printf("MQTT RX %s: %.*s\n", u.node_id, (int)length, (const char*)payload);
   
   StaticJsonDocument<512> doc;
-  if (deserializeJson(doc, message)) {
+  if (deserializeJson(doc, (const char*)payload, length)) {
     Serial.println("JSON parse failed");
     return;
   }
   
   // Fan speed control (via RS485)
   if (doc.containsKey("fan_speed")) {
-    set_fan_speed(doc["fan_speed"]);
+    int speed = doc["fan_speed"];
+    humidity_boost_override(u);
+    set_fan_speed(u, speed);
+    outbox_event(u, EVENT_FAN_SPEED, speed);
   }
   
   // Relay switch control
   if (doc.containsKey("sw1")) {
     bool state = doc["sw1"];
-    set_relay(RELAY_SW1, state);
-    relay_sw1_active = state;
+    set_relay(u, 1, state);
+    if (u.relay_sw1_active != state) mark_dirty(u, FIELD_SW1);
+    u.relay_sw1_active = state;
+    outbox_event(u, EVENT_SW1, state);
     Serial.printf("SW1 (SUMMERboost Disable): %s\n", state ? "ON" : "OFF");
   }
   
   if (doc.containsKey("sw2")) {
     bool state = doc["sw2"];
-    set_relay(RELAY_SW2, state);
-    relay_sw2_active = state;
+    humidity_boost_override(u);
+    set_relay(u, 2, state);
+    if (u.relay_sw2_active != state) mark_dirty(u, FIELD_SW2);
+    u.relay_sw2_active = state;
+    outbox_event(u, EVENT_SW2, state);
     Serial.printf("SW2 (Wet Room Boost): %s\n", state ? "ON" : "OFF");
   }
   
   if (doc.containsKey("sw3")) {
     bool state = doc["sw3"];
-    set_relay(RELAY_SW3, state);
-    relay_sw3_active = state;
+    set_relay(u, 3, state);
+    if (u.relay_sw3_active != state) mark_dirty(u, FIELD_SW3);
+    u.relay_sw3_active = state;
+    outbox_event(u, EVENT_SW3, state);
     Serial.printf("SW3 (Setback/Kitchen): %s\n", state ? "ON" : "OFF");
   }
   
   // Momentary boost triggers (pulse relay for 2 seconds)
   if (doc.containsKey("trigger_wetroom_boost")) {
     Serial.println("Triggering wet room boost (momentary)");
-    trigger_boost(2, 2000);  // SW2 for 2 seconds
+    humidity_boost_override(u);
+    trigger_boost(u, 2, TitonRelays::BOOST_PULSE_MS);
+    outbox_event(u, EVENT_WETROOM_BOOST, 1);
   }
   
   if (doc.containsKey("trigger_kitchen_boost")) {
     Serial.println("Triggering kitchen boost (momentary)");
-    trigger_boost(3, 2000);  // SW3 for 2 seconds
+    trigger_boost(u, 3, TitonRelays::BOOST_PULSE_MS);
+    outbox_event(u, EVENT_KITCHEN_BOOST, 1);
   }
   
   // NEW: Direct RS485 control commands
   if (doc.containsKey("boost_inhibit")) {
     bool enabled = doc["boost_inhibit"];
-    char cmd[16];
-    snprintf(cmd, sizeof(cmd), "3260+%05d\r\n", enabled ? 1 : 0);
-    send_rs485_command(cmd);
+    bus_write(u, REG_BOOST_INHIBIT, enabled ? 1 : 0);
+    outbox_event(u, EVENT_BOOST_INHIBIT, enabled);
     Serial.printf("Boost Inhibit (Night Mode): %s\n", enabled ? "ENABLED" : "DISABLED");
   }
   
   if (doc.containsKey("summer_bypass_enable")) {
     bool enabled = doc["summer_bypass_enable"];
-    char cmd[16];
-    snprintf(cmd, sizeof(cmd), "2300+%05d\r\n", enabled ? 1 : 0);
-    send_rs485_command(cmd);
+    bus_write(u, REG_SUMMER_BYPASS_ENABLE, enabled ? 1 : 0);
+    outbox_event(u, EVENT_SUMMER_BYPASS, enabled);
     Serial.printf("Summer Bypass: %s\n", enabled ? "ENABLED" : "DISABLED");
   }
   
   // CRITICAL FIX: SUMMERboost uses INVERTED logic!
   if (doc.containsKey("summerboost_enable")) {
     bool enabled = doc["summerboost_enable"];
-    char cmd[16];
-    snprintf(cmd, sizeof(cmd), "2900+%05d\r\n", enabled ? 0 : 1);  // INVERTED!
-    send_rs485_command(cmd);
+    settings_update(u, SETTING_SUMMERBOOST, enabled);  // synced to REG_SUMMERBOOST_DISABLE, INVERTED!
+    outbox_event(u, EVENT_SUMMERBOOST, enabled);
     Serial.printf("SUMMERboost: %s (wrote %d - inverted logic)\n", 
                   enabled ? "ENABLED" : "DISABLED", 
                   enabled ? 0 : 1);
   }
   
-  // Factory reset with safety confirmation
+  // Factory reset with a 5 second window to abort
+  // ({"factory_reset": false} or {"factory_reset_cancel": true})
   if (doc.containsKey("factory_reset")) {
     bool confirm = doc["factory_reset"];
-    if (confirm) {
+    if (confirm && !u.factory_reset_timer) {
       Serial.println("⚠️⚠️⚠️  FACTORY RESET REQUESTED!");
       Serial.println("Sending reset command in 5 seconds...");
-      delay(5000);
-      send_rs485_command("0680+21930\r\n");
-      Serial.println("Factory reset command sent!");
+      u.factory_reset_timer = timer_schedule(FACTORY_RESET_DELAY_MS, factory_reset_fire, u.index, 21930);
+    } else if (!confirm) {
+      cancel_factory_reset(u);
     }
   }
+  if (doc.containsKey("factory_reset_cancel")) {
+    cancel_factory_reset(u);
+  }
   
-  // Settings updates (stored in memory)
-  if (doc.containsKey("speed1_supply")) settings.speed1_supply = doc["speed1_supply"];
-  if (doc.containsKey("speed1_extract")) settings.speed1_extract = doc["speed1_extract"];
-  if (doc.containsKey("speed2_supply")) settings.speed2_supply = doc["speed2_supply"];
-  if (doc.containsKey("speed2_extract")) settings.speed2_extract = doc["speed2_extract"];
-  if (doc.containsKey("speed3_supply")) settings.speed3_supply = doc["speed3_supply"];
-  if (doc.containsKey("speed3_extract")) settings.speed3_extract = doc["speed3_extract"];
-  if (doc.containsKey("speed4_supply")) settings.speed4_supply = doc["speed4_supply"];
-  if (doc.containsKey("speed4_extract")) settings.speed4_extract = doc["speed4_extract"];
-  if (doc.containsKey("humidity_setpoint")) settings.humidity_setpoint = doc["humidity_setpoint"];
-  if (doc.containsKey("kitchen_overrun")) settings.kitchen_overrun = doc["kitchen_overrun"];
-  if (doc.containsKey("wetroom_overrun")) settings.wetroom_overrun = doc["wetroom_overrun"];
-  if (doc.containsKey("bypass_extract_threshold")) settings.bypass_extract_threshold = doc["bypass_extract_threshold"];
-  if (doc.containsKey("bypass_supply_threshold")) settings.bypass_supply_threshold = doc["bypass_supply_threshold"];
-  if (doc.containsKey("summerboost_enabled")) settings.summerboost_enabled = doc["summerboost_enabled"];
-}
-
-// ========== HOME ASSISTANT DISCOVERY ==========
-void publish_discovery() {
-  Serial.println("Publishing Home Assistant discovery...");
-  
-  // Climate entity
-  {
-    char topic[128];
-    snprintf(topic, sizeof(topic), "%s/climate/titon_mvhr/config", DISCOVERY_PREFIX);
-    
-    StaticJsonDocument<768> doc;
-    doc["name"] = "Titon MVHR";
-    doc["unique_id"] = "titon_mvhr_climate";
-    doc["mode_command_topic"] = TOPIC_COMMAND;
-    doc["mode_state_topic"] = TOPIC_STATE;
-    doc["mode_state_template"] = "{{ value_json.mode }}";
-    doc["modes"][0] = "off";
-    doc["modes"][1] = "fan_only";
-    
-    doc["fan_mode_command_topic"] = TOPIC_COMMAND;
-    doc["fan_mode_state_topic"] = TOPIC_STATE;
-    doc["fan_mode_state_template"] = "{{ value_json.fan_mode }}";
-    doc["fan_modes"][0] = "low";
-    doc["fan_modes"][1] = "medium";
-    doc["fan_modes"][2] = "high";
-    doc["fan_modes"][3] = "auto";
-    
-    doc["current_temperature_topic"] = TOPIC_STATE;
-    doc["current_temperature_template"] = "{{ value_json.supply_temp }}";
-    doc["temperature_unit"] = "C";
-    doc["availability_topic"] = TOPIC_AVAILABILITY;
-    
-    JsonObject dev = doc.createNestedObject("device");
-    dev["identifiers"][0] = "titon_mvhr";
-    dev["name"] = "Titon MVHR";
-    dev["model"] = "HRV1.6 Q Plus HMB";
-    dev["manufacturer"] = "Titon";
-    dev["sw_version"] = "v2.0";
-    
-    char buffer[768];
-    serializeJson(doc, buffer);
-    mqtt.publish(topic, buffer, true);
-    delay(100);
-  }
-  
-  // Sensors macro
-  #define PUBLISH_SENSOR(id, name, unit, dev_class) { \
-    char topic[128]; \
-    snprintf(topic, sizeof(topic), "%s/sensor/titon_mvhr/%s/config", DISCOVERY_PREFIX, id); \
-    StaticJsonDocument<384> doc; \
-    doc["name"] = name; \
-    doc["unique_id"] = String("titon_mvhr_") + id; \
-    doc["state_topic"] = TOPIC_STATE; \
-    doc["value_template"] = String("{{ value_json.") + id + " }}"; \
-    doc["availability_topic"] = TOPIC_AVAILABILITY; \
-    if (strlen(unit) > 0) doc["unit_of_measurement"] = unit; \
-    if (strlen(dev_class) > 0) doc["device_class"] = dev_class; \
-    JsonObject dev = doc.createNestedObject("device"); \
-    dev["identifiers"][0] = "titon_mvhr"; \
-    char buffer[384]; \
-    serializeJson(doc, buffer); \
-    mqtt.publish(topic, buffer, true); \
-    delay(50); \
-  }
-  
-  // Original sensors
-  PUBLISH_SENSOR("supply_temp", "Supply Temperature", "°C", "temperature");
-  PUBLISH_SENSOR("extract_temp", "Extract Temperature", "°C", "temperature");
-  PUBLISH_SENSOR("supply_rpm", "Supply Fan RPM", "RPM", "");
-  PUBLISH_SENSOR("extract_rpm", "Extract Fan RPM", "RPM", "");
-  PUBLISH_SENSOR("current_speed", "Current Speed", "", "");
-  PUBLISH_SENSOR("humidity", "External Humidity", "%", "humidity");
-  
-  // NEW: Three thermistors from Ross's discoveries
-  PUBLISH_SENSOR("stale_air_in_temp", "Stale Air In Temperature", "°C", "temperature");
-  PUBLISH_SENSOR("stale_air_out_temp", "Stale Air Out Temperature", "°C", "temperature");
-  PUBLISH_SENSOR("fresh_air_in_temp", "Fresh Air In Temperature", "°C", "temperature");
-  
-  // NEW: Additional sensors
-  PUBLISH_SENSOR("internal_humidity", "Internal Humidity", "%", "humidity");
-  PUBLISH_SENSOR("runtime_hours", "Runtime Hours", "h", "duration");
-  PUBLISH_SENSOR("filter_remaining", "Filter Remaining", "h", "duration");
-  PUBLISH_SENSOR("status_word", "Status Word (Raw)", "", "");
-  
-  // Binary sensors macro
-  #define PUBLISH_BINARY(id, name, dev_class) { \
-    char topic[128]; \
-    snprintf(topic, sizeof(topic), "%s/binary_sensor/titon_mvhr/%s/config", DISCOVERY_PREFIX, id); \
-    StaticJsonDocument<384> doc; \
-    doc["name"] = name; \
-    doc["unique_id"] = String("titon_mvhr_") + id; \
-    doc["state_topic"] = TOPIC_STATE; \
-    doc["value_template"] = String("{{ value_json.") + id + " }}"; \
-    doc["payload_on"] = "true"; \
-    doc["payload_off"] = "false"; \
-    doc["availability_topic"] = TOPIC_AVAILABILITY; \
-    if (strlen(dev_class) > 0) doc["device_class"] = dev_class; \
-    JsonObject dev = doc.createNestedObject("device"); \
-    dev["identifiers"][0] = "titon_mvhr"; \
-    char buffer[384]; \
-    serializeJson(doc, buffer); \
-    mqtt.publish(topic, buffer, true); \
-    delay(50); \
-  }
-  
-  // Original binary sensors
-  PUBLISH_BINARY("summer_bypass", "Summer Bypass Active", "");
-  PUBLISH_BINARY("summerboost", "SUMMERboost Active", "");
-  
-  // NEW: Status word decoded sensors
-  PUBLISH_BINARY("engine_running", "Engine Running", "running");
-  PUBLISH_BINARY("supply_fan_error", "Supply Fan Error", "problem");
-  PUBLISH_BINARY("extract_fan_error", "Extract Fan Error", "problem");
-  PUBLISH_BINARY("thermistor_error", "Thermistor Error (General)", "problem");
-  PUBLISH_BINARY("therm1_error", "Thermistor 1 Error", "problem");
-  PUBLISH_BINARY("therm2_error", "Thermistor 2 Error", "problem");
-  PUBLISH_BINARY("therm3_error", "Thermistor 3 Error", "problem");
-  PUBLISH_BINARY("humidity_sensor_error", "Humidity Sensor Error", "problem");
-  PUBLISH_BINARY("eeprom_error", "EEPROM Error", "problem");
-  PUBLISH_BINARY("engine_error", "Engine Error", "problem");
-  PUBLISH_BINARY("switch_error", "Switch Error", "problem");
-  
-  // Switch entities
-  #define PUBLISH_SWITCH(id, name) { \
-    char topic[128]; \
-    snprintf(topic, sizeof(topic), "%s/switch/titon_mvhr/%s/config", DISCOVERY_PREFIX, id); \
-    StaticJsonDocument<384> doc; \
-    doc["name"] = name; \
-    doc["unique_id"] = String("titon_mvhr_") + id; \
-    doc["state_topic"] = TOPIC_STATE; \
-    doc["command_topic"] = TOPIC_COMMAND; \
-    doc["value_template"] = String("{{ value_json.") + id + " }}"; \
-    doc["payload_on"] = String("{\"") + id + "\": true}"; \
-    doc["payload_off"] = String("{\"") + id + "\": false}"; \
-    doc["state_on"] = "true"; \
-    doc["state_off"] = "false"; \
-    doc["availability_topic"] = TOPIC_AVAILABILITY; \
-    JsonObject dev = doc.createNestedObject("device"); \
-    dev["identifiers"][0] = "titon_mvhr"; \
-    char buffer[384]; \
-    serializeJson(doc, buffer); \
-    mqtt.publish(topic, buffer, true); \
-    delay(50); \
-  }
-  
-  PUBLISH_SWITCH("sw1", "SUMMERboost Disable (SW1)");
-  PUBLISH_SWITCH("sw2", "Wet Room Boost (SW2)");
-  PUBLISH_SWITCH("sw3", "Setback/Kitchen (SW3)");
-  
-  // NEW: Direct RS485 control switches
-  PUBLISH_SWITCH("boost_inhibit", "Boost Inhibit (Night Mode)");
-  PUBLISH_SWITCH("summer_bypass_enable", "Summer Bypass Enable");
-  PUBLISH_SWITCH("summerboost_enable", "SUMMERboost Enable");
-  
-  // Button entities
-  #define PUBLISH_BUTTON(id, name, cmd_key) { \
-    char topic[128]; \
-    snprintf(topic, sizeof(topic), "%s/button/titon_mvhr/%s/config", DISCOVERY_PREFIX, id); \
-    StaticJsonDocument<384> doc; \
-    doc["name"] = name; \
-    doc["unique_id"] = String("titon_mvhr_") + id; \
-    doc["command_topic"] = TOPIC_COMMAND; \
-    doc["payload_press"] = String("{\"") + cmd_key + "\": true}"; \
-    doc["availability_topic"] = TOPIC_AVAILABILITY; \
-    JsonObject dev = doc.createNestedObject("device"); \
-    dev["identifiers"][0] = "titon_mvhr"; \
-    char buffer[384]; \
-    serializeJson(doc, buffer); \
-    mqtt.publish(topic, buffer, true); \
-    delay(50); \
-  }
-  
-  PUBLISH_BUTTON("trigger_wetroom", "Trigger Wet Room Boost", "trigger_wetroom_boost");
-  PUBLISH_BUTTON("trigger_kitchen", "Trigger Kitchen Boost", "trigger_kitchen_boost");
-  PUBLISH_BUTTON("factory_reset_btn", "Factory Reset MVHR", "factory_reset");
-  
-  // Number entities
-  #define PUBLISH_NUMBER(id, name, min_v, max_v) { \
-    char topic[128]; \
-    snprintf(topic, sizeof(topic), "%s/number/titon_mvhr/%s/config", DISCOVERY_PREFIX, id); \
-    StaticJsonDocument<384> doc; \
-    doc["name"] = name; \
-    doc["unique_id"] = String("titon_mvhr_") + id; \
-    doc["state_topic"] = TOPIC_STATE; \
-    doc["command_topic"] = TOPIC_COMMAND; \
-    doc["value_template"] = String("{{ value_json.") + id + " }}"; \
-    doc["command_template"] = String("{\"") + id + "\": {{ value }}}"; \
-    doc["min"] = min_v; \
-    doc["max"] = max_v; \
-    doc["step"] = 1; \
-    doc["mode"] = "slider"; \
-    doc["availability_topic"] = TOPIC_AVAILABILITY; \
-    JsonObject dev = doc.createNestedObject("device"); \
-    dev["identifiers"][0] = "titon_mvhr"; \
-    char buffer[384]; \
-    serializeJson(doc, buffer); \
-    mqtt.publish(topic, buffer, true); \
-    delay(50); \
-  }
-  
-  PUBLISH_NUMBER("speed1_supply", "Speed 1 Supply %", 14, 100);
-  PUBLISH_NUMBER("speed1_extract", "Speed 1 Extract %", 14, 100);
-  PUBLISH_NUMBER("speed2_supply", "Speed 2 Supply %", 14, 100);
-  PUBLISH_NUMBER("speed2_extract", "Speed 2 Extract %", 14, 100);
-  PUBLISH_NUMBER("speed3_supply", "Speed 3 Supply %", 14, 100);
-  PUBLISH_NUMBER("speed3_extract", "Speed 3 Extract %", 14, 100);
-  PUBLISH_NUMBER("speed4_supply", "Speed 4 Supply %", 14, 100);
-  PUBLISH_NUMBER("speed4_extract", "Speed 4 Extract %", 14, 100);
-  PUBLISH_NUMBER("humidity_setpoint", "Humidity Setpoint", 30, 100);
-  PUBLISH_NUMBER("kitchen_overrun", "Kitchen Timer (min)", 0, 60);
-  PUBLISH_NUMBER("wetroom_overrun", "Wet Room Timer (min)", 0, 60);
-  PUBLISH_NUMBER("bypass_extract_threshold", "Bypass Extract °C", 17, 35);
-  PUBLISH_NUMBER("bypass_supply_threshold", "Bypass Supply °C", 10, 20);
-  
-  Serial.println("Discovery complete!");
-}
-
-// ========== PUBLISH STATE ==========
-void publish_state() {
-  if (!mqtt.connected()) return;
-  
-  StaticJsonDocument<2048> doc;  // Increased for all new sensors
-  
-  // Original temperature sensors
-  doc["supply_temp"] = supply_temp;
-  doc["extract_temp"] = extract_temp;
-  
-  // NEW: Three thermistors
-  doc["stale_air_in_temp"] = stale_air_in_temp;
-  doc["stale_air_out_temp"] = stale_air_out_temp;
-  doc["fresh_air_in_temp"] = fresh_air_in_temp;
-  
-  // RPM and speed
-  doc["supply_rpm"] = supply_rpm;
-  doc["extract_rpm"] = extract_rpm;
-  doc["current_speed"] = current_speed;
-  
-  // Humidity sensors
-  doc["humidity"] = current_humidity;          // External sensor
-  doc["internal_humidity"] = internal_humidity; // NEW: Internal sensor
-  
-  // NEW: Runtime and filter
-  doc["runtime_hours"] = runtime_hours;
-  doc["filter_remaining"] = filter_remaining;
-  doc["status_word"] = status_word;
-  
-  // Status flags (decoded from status word)
-  doc["engine_running"] = (status_word & STATUS_ENGINE_RUNNING) != 0;
-  doc["supply_fan_error"] = (status_word & STATUS_SUPPLY_FAN_ERROR) != 0;
-  doc["extract_fan_error"] = (status_word & STATUS_EXTRACT_FAN_ERROR) != 0;
-  doc["thermistor_error"] = (status_word & STATUS_THERMISTOR_ERROR) != 0;
-  doc["therm1_error"] = (status_word & STATUS_THERM1_ERROR) != 0;
-  doc["therm2_error"] = (status_word & STATUS_THERM2_ERROR) != 0;
-  doc["therm3_error"] = (status_word & STATUS_THERM3_ERROR) != 0;
-  doc["humidity_sensor_error"] = (status_word & STATUS_HUMIDITY_ERROR) != 0;
-  doc["eeprom_error"] = (status_word & STATUS_EEPROM_ERROR) != 0;
-  doc["engine_error"] = (status_word & STATUS_ENGINE_ERROR) != 0;
-  doc["switch_error"] = (status_word & STATUS_SWITCH_ERROR) != 0;
-  
-  // System state
-  doc["summer_bypass"] = summer_bypass;
-  doc["summerboost"] = summerboost_active;
-  
-  // Relay states
-  doc["sw1"] = relay_sw1_active;
-  doc["sw2"] = relay_sw2_active;
-  doc["sw3"] = relay_sw3_active;
-  
-  // Climate entity
-  doc["mode"] = (current_speed > 0) ? "fan_only" : "off";
-  String fan_mode = "medium";
-  if (current_speed == 1) fan_mode = "low";
-  else if (current_speed == 3) fan_mode = "high";
-  else if (current_speed == 4) fan_mode = "auto";
-  doc["fan_mode"] = fan_mode;
-  
-  // Settings
-  doc["speed1_supply"] = settings.speed1_supply;
-  doc["speed1_extract"] = settings.speed1_extract;
-  doc["speed2_supply"] = settings.speed2_supply;
-  doc["speed2_extract"] = settings.speed2_extract;
-  doc["speed3_supply"] = settings.speed3_supply;
-  doc["speed3_extract"] = settings.speed3_extract;
-  doc["speed4_supply"] = settings.speed4_supply;
-  doc["speed4_extract"] = settings.speed4_extract;
-  doc["humidity_setpoint"] = settings.humidity_setpoint;
-  doc["kitchen_overrun"] = settings.kitchen_overrun;
-  doc["wetroom_overrun"] = settings.wetroom_overrun;
-  doc["bypass_extract_threshold"] = settings.bypass_extract_threshold;
-  doc["bypass_supply_threshold"] = settings.bypass_supply_threshold;
-  doc["summerboost_enabled"] = settings.summerboost_enabled;
-  
-  char buffer[2048];
-  serializeJson(doc, buffer);
-  mqtt.publish(TOPIC_STATE, buffer);
-}
-
-// ========== RS485 PARSING ==========
-void parse_response(String response) {
-  int sign_pos = -1;
-  for (unsigned int i = 0; i < response.length(); i++) {
-    if (response[i] == '+' || response[i] == '-') {
-      sign_pos = i;
-      break;
+  // Settings updates (persisted and synced by settings_service)
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    const SettingDesc& d = SETTINGS_TABLE[i];
+    if (!doc.containsKey(d.key)) continue;
+    if (d.flag) {
+      bool v = doc[d.key];
+      settings_update(u, i, v);
+    } else {
+      int v = doc[d.key];
+      settings_update(u, i, v);
     }
   }
   
-  if (sign_pos == -1) return;
-  
-  int address = response.substring(0, sign_pos).toInt();
-  int value = response.substring(sign_pos).toInt();
+  // Store-and-forward drain rate, messages/s
+  if (doc.containsKey("outbox_rate")) {
+    int rate = doc["outbox_rate"];
+    u.outbox_rate = (uint32_t)max(1, min(rate, 100));
+    Serial.printf("Outbox drain rate: %u msg/s\n", (unsigned)u.outbox_rate);
+  }
   
-  // Check for error response (faulty sensor returns -99999)
-  if (value == -99999) {
-    Serial.printf("⚠️  Address %d returned error (-99999) - FAULTY SENSOR!\n", address);
-    return;  // Don't update the value
+  // State encoding: "json" (default, needed by Home Assistant), "cbor" or "both"
+  if (doc.containsKey("state_encoding")) {
+    const char* encoding = doc["state_encoding"] | "json";
+    if (strcmp(encoding, "cbor") == 0) u.state_encoding = STATE_CBOR;
+    else if (strcmp(encoding, "both") == 0) u.state_encoding = STATE_JSON | STATE_CBOR;
+    else u.state_encoding = STATE_JSON;
+    u.state_schema_pending = true;
+    u.full_snapshot_pending = true;
+    Serial.printf("State encoding: %s%s\n", encoding,
+                  (u.state_encoding & STATE_JSON) ? "" : " (Home Assistant gets no state)");
   }
   
-  switch (address) {
-    // NEW: Three thermistors (0.1°C resolution)
-    case 30:
-      stale_air_in_temp = value / 10.0;
-      Serial.printf("Stale In Temp: %.1f°C\n", stale_air_in_temp);
-      break;
-    case 31:
-      stale_air_out_temp = value / 10.0;
-      Serial.printf("Stale Out Temp: %.1f°C\n", stale_air_out_temp);
-      break;
-    case 32:
-      fresh_air_in_temp = value / 10.0;
-      Serial.printf("Fresh In Temp: %.1f°C\n", fresh_air_in_temp);
-      break;
-      
-    // NEW: Internal humidity (1% resolution)
-    case 36:
-      internal_humidity = value;
-      Serial.printf("Internal Humidity: %d%%\n", internal_humidity);
+  // State publishing mode: "delta" (changed fields only) or "full"
+  if (doc.containsKey("state_mode")) {
+    u.state_delta_mode = strcmp(doc["state_mode"] | "delta", "full") != 0;
+    u.full_snapshot_pending = true;
+    Serial.printf("State publishing: %s\n", u.state_delta_mode ? "delta" : "full");
+  }
+}
+
+// ========== HOME ASSISTANT DISCOVERY ==========
+// Every discovery topic and JSON body is fully known at build time, so they
+// are generated by constexpr code from the unit table and the register,
+// status bit and settings tables into one flash-resident blob per unit. At runtime a config is streamed
+// straight from flash with beginPublish()/write(): no JSON documents, no
+// Strings, no stack buffers. Bodies use HA's abbreviated keys and the "~"
+// base topic to stay small.
+//
+// Publishing runs as a background job: each loop() pass emits entities until
+// it has spent DISCOVERY_BYTES_PER_PASS bytes or DISCOVERY_US_PER_PASS, then
+// yields. Entities whose hash matches the last successful publish in this
+// MQTT session are skipped. Unique ids and device ids carry the unit's node
+// id, so every unit is its own Home Assistant device.
+enum EntityKind { ENTITY_NONE, ENTITY_CLIMATE, ENTITY_SENSOR, ENTITY_BINARY, ENTITY_SWITCH, ENTITY_BUTTON, ENTITY_NUMBER };
+
+struct DiscoveryEntity {
+  EntityKind kind;
+  const char* id;
+  const char* name;
+  const char* unit;            // sensors
+  const char* device_class;    // sensors, binary sensors
+  const char* cmd_key;         // buttons
+  int min_value;               // numbers
+  int max_value;
+};
+
+constexpr DiscoveryEntity EXTRA_SENSORS[] = {
+  { ENTITY_SENSOR, "humidity", "External Humidity", "%", "humidity", nullptr, 0, 0 },
+};
+constexpr DiscoveryEntity EXTRA_BINARY[] = {
+  { ENTITY_BINARY, "summer_bypass", "Summer Bypass Active", "", "", nullptr, 0, 0 },
+  { ENTITY_BINARY, "summerboost",   "SUMMERboost Active",   "", "", nullptr, 0, 0 },
+};
+constexpr DiscoveryEntity CONTROL_ENTITIES[] = {
+  { ENTITY_SWITCH, "sw1", "SUMMERboost Disable (SW1)", "", "", nullptr, 0, 0 },
+  { ENTITY_SWITCH, "sw2", "Wet Room Boost (SW2)",      "", "", nullptr, 0, 0 },
+  { ENTITY_SWITCH, "sw3", "Setback/Kitchen (SW3)",     "", "", nullptr, 0, 0 },
+  { ENTITY_SWITCH, "boost_inhibit",        "Boost Inhibit (Night Mode)", "", "", nullptr, 0, 0 },
+  { ENTITY_SWITCH, "summer_bypass_enable", "Summer Bypass Enable",       "", "", nullptr, 0, 0 },
+  { ENTITY_SWITCH, "summerboost_enable",   "SUMMERboost Enable",         "", "", nullptr, 0, 0 },
+  { ENTITY_BUTTON, "trigger_wetroom",          "Trigger Wet Room Boost", "", "", "trigger_wetroom_boost", 0, 0 },
+  { ENTITY_BUTTON, "trigger_kitchen",          "Trigger Kitchen Boost",  "", "", "trigger_kitchen_boost", 0, 0 },
+  { ENTITY_BUTTON, "factory_reset_btn",        "Factory Reset MVHR",     "", "", "factory_reset", 0, 0 },
+  { ENTITY_BUTTON, "factory_reset_cancel_btn", "Cancel Factory Reset",   "", "", "factory_reset_cancel", 0, 0 },
+};
+constexpr int EXTRA_SENSOR_COUNT = sizeof(EXTRA_SENSORS) / sizeof(EXTRA_SENSORS[0]);
+constexpr int EXTRA_BINARY_COUNT = sizeof(EXTRA_BINARY) / sizeof(EXTRA_BINARY[0]);
+constexpr int CONTROL_ENTITY_COUNT = sizeof(CONTROL_ENTITIES) / sizeof(CONTROL_ENTITIES[0]);
+
+// Entity ordinals walk: climate, register sensors, extra sensors, extra
+// binary sensors, status bits, controls, settings numbers.
+constexpr int DISCOVERY_ENTITY_COUNT = 1 + REGISTER_COUNT + EXTRA_SENSOR_COUNT + EXTRA_BINARY_COUNT +
+                                       STATUS_BIT_COUNT + CONTROL_ENTITY_COUNT + SETTING_COUNT;
+
+// Table rows that aren't HA entities, and sensors the unit doesn't have,
+// come back as ENTITY_NONE.
+constexpr DiscoveryEntity discovery_entity(int unit, int n) {
+  DiscoveryEntity e = { ENTITY_NONE, nullptr, nullptr, "", "", nullptr, 0, 0 };
+  if (n == 0) {
+    e.kind = ENTITY_CLIMATE;
+    return e;
+  }
+  n -= 1;
+  if (n < REGISTER_COUNT) {
+    const RegisterDesc& reg = TITON_REGISTERS[n];
+    if (reg.json_key && reg.name) {
+      e = { ENTITY_SENSOR, reg.json_key, reg.name, reg.unit, reg.device_class, nullptr, 0, 0 };
+    }
+    return e;
+  }
+  n -= REGISTER_COUNT;
+  if (n < EXTRA_SENSOR_COUNT) return UNIT_CONFIG[unit].humidity >= 0 ? EXTRA_SENSORS[n] : e;
+  n -= EXTRA_SENSOR_COUNT;
+  if (n < EXTRA_BINARY_COUNT) return EXTRA_BINARY[n];
+  n -= EXTRA_BINARY_COUNT;
+  if (n < STATUS_BIT_COUNT) {
+    const StatusBitDesc& bit = TITON_STATUS_BITS[n];
+    if (bit.json_key) {
+      e = { ENTITY_BINARY, bit.json_key, bit.name, "", bit.device_class, nullptr, 0, 0 };
+    }
+    return e;
+  }
+  n -= STATUS_BIT_COUNT;
+  if (n < CONTROL_ENTITY_COUNT) return CONTROL_ENTITIES[n];
+  n -= CONTROL_ENTITY_COUNT;
+  if (n < SETTING_COUNT) {
+    const SettingDesc& d = SETTINGS_TABLE[n];
+    if (d.name) {
+      e = { ENTITY_NUMBER, d.key, d.name, "", "", nullptr, d.min_value, d.max_value };
+    }
+  }
+  return e;
+}
+
+// Appends text to a buffer, or just counts it when out is null (sizing pass).
+struct TextSink {
+  char* out;
+  size_t len;
+  
+  constexpr void raw(const char* s) {
+    for (; *s; s++) put(*s);
+  }
+  constexpr void put(char c) {
+    if (out) out[len] = c;
+    len++;
+  }
+  constexpr void number(int v) {
+    if (v < 0) { put('-'); v = -v; }
+    char digits[12] = {};
+    int n = 0;
+    do { digits[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    while (n) put(digits[--n]);
+  }
+  // ,"key":"value" with JSON escaping of quotes
+  constexpr void field(const char* key, const char* value) {
+    raw(",\"");
+    raw(key);
+    raw("\":\"");
+    for (; *value; value++) {
+      if (*value == '"' || *value == '\\') put('\\');
+      put(*value);
+    }
+    put('"');
+  }
+  // ,"key":"<a><b><c>" for values built from pieces
+  constexpr void field3(const char* key, const char* a, const char* b, const char* c) {
+    raw(",\"");
+    raw(key);
+    raw("\":\"");
+    for (const char* part : { a, b, c }) {
+      for (; *part; part++) {
+        if (*part == '"' || *part == '\\') put('\\');
+        put(*part);
+      }
+    }
+    put('"');
+  }
+};
+
+constexpr const char* entity_component(EntityKind kind) {
+  switch (kind) {
+    case ENTITY_CLIMATE: return "climate";
+    case ENTITY_BINARY: return "binary_sensor";
+    case ENTITY_SWITCH: return "switch";
+    case ENTITY_BUTTON: return "button";
+    case ENTITY_NUMBER: return "number";
+    default: return "sensor";
+  }
+}
+
+// NODE_ID_PREFIX "_<n>", as unit_begin() names the unit at runtime
+constexpr void emit_node_id(TextSink& t, int unit) {
+  t.raw(NODE_ID_PREFIX);
+  t.put('_');
+  t.number(unit + 1);
+}
+
+// "Titon MVHR", numbered when there are several
+constexpr void emit_unit_name(TextSink& t, int unit) {
+  t.raw("Titon MVHR");
+  if (UNIT_COUNT == 1) return;
+  t.put(' ');
+  t.number(unit + 1);
+}
+
+constexpr void emit_discovery_topic(TextSink& t, int unit, const DiscoveryEntity& e) {
+  t.raw(DISCOVERY_PREFIX);
+  t.put('/');
+  t.raw(entity_component(e.kind));
+  t.put('/');
+  emit_node_id(t, unit);
+  t.put('/');
+  if (e.kind != ENTITY_CLIMATE) {
+    t.raw(e.id);
+    t.put('/');
+  }
+  t.raw("config");
+}
+
+// State messages may carry only the fields that changed, so value templates
+// render nothing (which HA ignores) when their key is absent.
+constexpr void emit_state_template(TextSink& t, const char* key) {
+  t.raw(",\"val_tpl\":\"{% if '");
+  t.raw(key);
+  t.raw("' in value_json %}{{ value_json.");
+  t.raw(key);
+  t.raw(" }}{% endif %}\"");
+}
+
+constexpr void emit_discovery_payload(TextSink& t, int unit, const DiscoveryEntity& e) {
+  t.raw("{\"~\":\"");
+  t.raw(DISCOVERY_PREFIX);
+  t.raw("/climate/");
+  emit_node_id(t, unit);
+  t.raw("\",\"avty_t\":\"");
+  t.raw(TOPIC_AVAILABILITY);
+  t.put('"');
+  
+  if (e.kind == ENTITY_CLIMATE) {
+    t.raw(",\"name\":\"");
+    emit_unit_name(t, unit);
+    t.raw("\",\"uniq_id\":\"");
+    emit_node_id(t, unit);
+    t.raw("_climate\"");
+    t.raw(",\"mode_cmd_t\":\"~/command\",\"mode_stat_t\":\"~/state\"");
+    t.raw(",\"mode_stat_tpl\":\"{{ value_json.mode }}\",\"modes\":[\"off\",\"fan_only\"]");
+    t.raw(",\"fan_mode_cmd_t\":\"~/command\",\"fan_mode_stat_t\":\"~/state\"");
+    t.raw(",\"fan_mode_stat_tpl\":\"{{ value_json.fan_mode }}\"");
+    t.raw(",\"fan_modes\":[\"low\",\"medium\",\"high\",\"auto\"]");
+    t.raw(",\"curr_temp_t\":\"~/state\",\"curr_temp_tpl\":\"{{ value_json.supply_temp }}\"");
+    t.raw(",\"temp_unit\":\"C\"");
+    t.raw(",\"dev\":{\"ids\":[\"");
+    emit_node_id(t, unit);
+    t.raw("\"],\"name\":\"");
+    emit_unit_name(t, unit);
+    t.raw("\",\"mdl\":\"HRV1.6 Q Plus HMB\"");
+    t.raw(",\"mf\":\"Titon\",\"sw\":\"v2.0\"}}");
+    return;
+  }
+  
+  t.field("name", e.name);
+  t.raw(",\"uniq_id\":\"");
+  emit_node_id(t, unit);
+  t.put('_');
+  t.raw(e.id);
+  t.put('"');
+  if (e.kind != ENTITY_BUTTON) {
+    t.raw(",\"stat_t\":\"~/state\"");
+    emit_state_template(t, e.id);
+  }
+  
+  switch (e.kind) {
+    case ENTITY_SENSOR:
+      if (e.unit[0]) t.field("unit_of_meas", e.unit);
+      if (e.device_class[0]) t.field("dev_cla", e.device_class);
       break;
-      
-    // NEW: Runtime hours
-    case 60:
-      runtime_hours = value;
-      Serial.printf("Runtime Hours: %d\n", runtime_hours);
+    case ENTITY_BINARY:
+      t.raw(",\"pl_on\":\"true\",\"pl_off\":\"false\"");
+      if (e.device_class[0]) t.field("dev_cla", e.device_class);
       break;
-      
-    // NEW: Status word (decode bits)
-    case 61:
-      status_word = value;
-      decode_status_word(value);
+    case ENTITY_SWITCH:
+      t.raw(",\"cmd_t\":\"~/command\"");
+      t.field3("pl_on", "{\"", e.id, "\": true}");
+      t.field3("pl_off", "{\"", e.id, "\": false}");
+      t.raw(",\"stat_on\":\"true\",\"stat_off\":\"false\"");
       break;
-      
-    // NEW: Filter remaining
-    case 341:
-      filter_remaining = value;
-      Serial.printf("Filter Remaining: %d hours\n", filter_remaining);
+    case ENTITY_BUTTON:
+      t.raw(",\"cmd_t\":\"~/command\"");
+      t.field3("pl_prs", "{\"", e.cmd_key, "\": true}");
       break;
-      
-    // Original sensors
-    case 380:
-      supply_rpm = value;
+    case ENTITY_NUMBER:
+      t.raw(",\"cmd_t\":\"~/command\"");
+      t.field3("cmd_tpl", "{\"", e.id, "\": {{ value }}}");
+      t.raw(",\"min\":");
+      t.number(e.min_value);
+      t.raw(",\"max\":");
+      t.number(e.max_value);
+      t.raw(",\"step\":1,\"mode\":\"slider\"");
       break;
-    case 381:
-      extract_rpm = value;
+    default:
       break;
-    case 382:
-      supply_temp = value / 10.0;
+  }
+  
+  t.raw(",\"dev\":{\"ids\":[\"");
+  emit_node_id(t, unit);
+  t.raw("\"]}}");
+}
+
+constexpr uint32_t fnv1a(const char* data, size_t len, uint32_t h = 2166136261u) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+constexpr size_t discovery_blob_size(int unit) {
+  size_t total = 0;
+  for (int n = 0; n < DISCOVERY_ENTITY_COUNT; n++) {
+    DiscoveryEntity e = discovery_entity(unit, n);
+    if (e.kind == ENTITY_NONE) continue;
+    TextSink t = { nullptr, 0 };
+    emit_discovery_topic(t, unit, e);
+    t.put('\0');
+    emit_discovery_payload(t, unit, e);
+    total += t.len;
+  }
+  return total;
+}
+
+constexpr size_t discovery_blob_max() {
+  size_t size = 0;
+  for (int unit = 0; unit < UNIT_COUNT; unit++) {
+    if (discovery_blob_size(unit) > size) size = discovery_blob_size(unit);
+  }
+  return size;
+}
+
+constexpr size_t DISCOVERY_BLOB_SIZE = discovery_blob_max();
+
+// For entity n: topic (NUL-terminated) at topic[n], body at payload[n] with
+// length length[n]. length 0 = not an entity.
+struct DiscoveryBlob {
+  char text[DISCOVERY_BLOB_SIZE];
+  uint16_t topic[DISCOVERY_ENTITY_COUNT];
+  uint16_t payload[DISCOVERY_ENTITY_COUNT];
+  uint16_t length[DISCOVERY_ENTITY_COUNT];
+  uint32_t hash[DISCOVERY_ENTITY_COUNT];
+};
+
+struct DiscoveryBlobs {
+  DiscoveryBlob unit[UNIT_COUNT];
+};
+
+constexpr DiscoveryBlobs make_discovery_blobs() {
+  DiscoveryBlobs blobs = {};
+  for (int unit = 0; unit < UNIT_COUNT; unit++) {
+    DiscoveryBlob& b = blobs.unit[unit];
+    TextSink t = { b.text, 0 };
+    for (int n = 0; n < DISCOVERY_ENTITY_COUNT; n++) {
+      DiscoveryEntity e = discovery_entity(unit, n);
+      if (e.kind == ENTITY_NONE) continue;
+      b.topic[n] = (uint16_t)t.len;
+      emit_discovery_topic(t, unit, e);
+      t.put('\0');
+      b.payload[n] = (uint16_t)t.len;
+      emit_discovery_payload(t, unit, e);
+      b.length[n] = (uint16_t)(t.len - b.payload[n]);
+      b.hash[n] = fnv1a(b.text + b.topic[n], t.len - b.topic[n]);
+    }
+  }
+  return blobs;
+}
+
+static_assert(DISCOVERY_BLOB_SIZE < 65536, "discovery offsets are 16-bit");
+static constexpr DiscoveryBlobs DISCOVERY PROGMEM = make_discovery_blobs();
+
+const size_t DISCOVERY_BYTES_PER_PASS = 1024;
+const unsigned long DISCOVERY_US_PER_PASS = 5000;
+
+// The job walks every unit's entities in turn: cursor = unit * count + entity
+constexpr int DISCOVERY_JOB_SIZE = UNIT_COUNT * DISCOVERY_ENTITY_COUNT;
+int discovery_cursor = DISCOVERY_JOB_SIZE;  // == size: idle
+uint32_t discovery_hash[UNIT_COUNT][DISCOVERY_ENTITY_COUNT];
+uint32_t discovery_published = 0;
+uint32_t discovery_skipped = 0;
+
+// forget_published: the broker may not hold our retained configs any more
+// (new session), so republish everything rather than trusting the hashes.
+void discovery_restart(bool forget_published) {
+  if (forget_published) memset(discovery_hash, 0, sizeof(discovery_hash));
+  discovery_cursor = 0;
+  Serial.println("Publishing Home Assistant discovery...");
+}
+
+void discovery_service() {
+  if (discovery_cursor >= DISCOVERY_JOB_SIZE || !mqtt.connected()) return;
+  
+  unsigned long start = hal_micros();
+  size_t spent = 0;
+  while (discovery_cursor < DISCOVERY_JOB_SIZE &&
+         spent < DISCOVERY_BYTES_PER_PASS &&
+         hal_micros() - start < DISCOVERY_US_PER_PASS) {
+    int unit = discovery_cursor / DISCOVERY_ENTITY_COUNT;
+    int n = discovery_cursor % DISCOVERY_ENTITY_COUNT;
+    const DiscoveryBlob& b = DISCOVERY.unit[unit];
+    size_t len = b.length[n];
+    if (len == 0 || b.hash[n] == discovery_hash[unit][n]) {
+      if (len) discovery_skipped++;
+      discovery_cursor++;
+      continue;
+    }
+    
+    // On failure leave the cursor here and retry on the next pass
+    if (!mqtt.beginPublish(b.text + b.topic[n], len, true)) return;
+    mqtt.write((const uint8_t*)b.text + b.payload[n], len);
+    if (!mqtt.endPublish()) return;
+    
+    discovery_hash[unit][n] = b.hash[n];
+    discovery_published++;
+    discovery_cursor++;
+    spent += len;
+  }
+  
+  if (discovery_cursor >= DISCOVERY_JOB_SIZE) {
+    Serial.println("Discovery complete!");
+  }
+}
+
+// ========== SETTINGS PERSISTENCE ==========
+// Settings are kept in NVS, one integer entry per unit and setting, and
+// restored in setup() before the network is up. Changes are tracked per
+// setting:
+// - settings_unsaved: committed SETTINGS_COMMIT_DELAY_MS after the last
+//   change (at most SETTINGS_COMMIT_MAX_MS after the first), so a slider drag
+//   costs one NVS write per setting, none if it ends where it started
+// - settings_unsynced: written to the controller register the setting maps
+//   to (SettingDesc::reg) on the next pass; bus_write coalesces and verifies
+// Controller-backed settings are read once at boot. The controller keeps them
+// in its own EEPROM and they can be changed from its panel, so its value wins
+// over NVS unless a new one has been set here in the meantime.
+const char* const SETTINGS_NVS_NAMESPACE = "titon";
+const unsigned long SETTINGS_COMMIT_DELAY_MS = 5000;
+const unsigned long SETTINGS_COMMIT_MAX_MS = 60000;
+const unsigned long SETTINGS_READBACK_RETRY_MS = 30000;
+
+bool settings_nvs_ok = false;
+
+// NVS keys are limited to 15 characters, so entries are keyed by the unit
+// and a hash of the setting name: stable across table reordering
+constexpr uint32_t setting_nvs_hash(int i) {
+  size_t len = 0;
+  while (SETTINGS_TABLE[i].key[len]) len++;
+  return fnv1a(SETTINGS_TABLE[i].key, len);
+}
+
+constexpr bool setting_nvs_keys_unique() {
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    for (int j = i + 1; j < SETTING_COUNT; j++) {
+      if (setting_nvs_hash(i) == setting_nvs_hash(j)) return false;
+    }
+  }
+  return true;
+}
+static_assert(setting_nvs_keys_unique(), "NVS key collision in SETTINGS_TABLE");
+
+void setting_nvs_key(const Unit& u, int i, char* key, size_t size) {
+  snprintf(key, size, "u%ds%08lx", u.index + 1, (unsigned long)setting_nvs_hash(i));
+}
+
+int setting_get(const Unit& u, int i) {
+  const SettingDesc& d = SETTINGS_TABLE[i];
+  return d.flag ? (int)(u.settings.*d.flag) : u.settings.*d.value;
+}
+
+// Clamped to the table range; true if the setting changed
+bool setting_set(Unit& u, int i, int value) {
+  const SettingDesc& d = SETTINGS_TABLE[i];
+  value = max(d.min_value, min(value, d.max_value));
+  if (value == setting_get(u, i)) return false;
+  if (d.flag) u.settings.*d.flag = value != 0;
+  else u.settings.*d.value = value;
+  mark_dirty(u, FIELD_SETTINGS + i);
+  return true;
+}
+
+void settings_mark_unsaved(Unit& u, int i) {
+  if (!u.settings_unsaved) u.settings_unsaved_since = hal_millis();
+  u.settings_unsaved |= 1UL << i;
+  u.settings_changed_at = hal_millis();
+}
+
+void settings_request_readback(Unit& u) {
+  u.settings_readback_requested = hal_millis();
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    if (u.settings_awaiting_readback & (1UL << i)) bus_read(u, (RegisterId)SETTINGS_TABLE[i].reg);
+  }
+}
+
+void settings_begin() {
+  settings_nvs_ok = hal_nvs_begin(SETTINGS_NVS_NAMESPACE);
+  if (!settings_nvs_ok) Serial.println("⚠️  NVS unavailable, settings will not survive a reboot");
+  
+  for (Unit& u : units) {
+    for (int i = 0; i < SETTING_COUNT; i++) {
+      char key[16];
+      int32_t v;
+      setting_nvs_key(u, i, key, sizeof(key));
+      u.settings_stored[i] = setting_get(u, i);  // a default needs no entry
+      if (settings_nvs_ok && hal_nvs_get(key, &v)) {
+        setting_set(u, i, (int)v);
+        u.settings_stored[i] = v;
+        if (setting_get(u, i) != v) settings_mark_unsaved(u, i);  // out of range, store the clamped value
+        u.settings_counters.restored++;
+      }
+      if (SETTINGS_TABLE[i].reg >= 0) u.settings_awaiting_readback |= 1UL << i;
+    }
+    Serial.printf("Settings: %u of %d restored from NVS for %s\n",
+                  (unsigned)u.settings_counters.restored, SETTING_COUNT, u.node_id);
+    
+    settings_request_readback(u);
+  }
+}
+
+// From MQTT. A controller-backed setting is written even if unchanged here,
+// in case the controller disagrees (redundant writes are dropped on the bus side).
+void settings_update(Unit& u, int index, int value) {
+  if (SETTINGS_TABLE[index].reg >= 0) {
+    u.settings_unsynced |= 1UL << index;
+    u.settings_awaiting_readback &= ~(1UL << index);  // the new value wins
+  }
+  if (setting_set(u, index, value)) settings_mark_unsaved(u, index);
+}
+
+// Every register update; only the boot readback is taken into the settings
+void settings_readback(Unit& u, int slot, int32_t value) {
+  if (!u.settings_awaiting_readback) return;
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    const SettingDesc& d = SETTINGS_TABLE[i];
+    if (d.reg != slot || !(u.settings_awaiting_readback & (1UL << i))) continue;
+    u.settings_awaiting_readback &= ~(1UL << i);
+    int v = d.inverted ? value == 0 : (int)value;
+    if (!setting_set(u, i, v)) continue;
+    settings_mark_unsaved(u, i);
+    u.settings_counters.adopted++;
+    Serial.printf("%s: setting %s = %d, from the controller\n", u.node_id, d.key, setting_get(u, i));
+  }
+}
+
+void settings_commit(Unit& u) {
+  uint32_t failed = 0;
+  int written = 0;
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    if (!(u.settings_unsaved & (1UL << i))) continue;
+    int v = setting_get(u, i);
+    if (u.settings_stored[i] == v) {
+      u.settings_counters.nvs_skipped++;
+      continue;
+    }
+    char key[16];
+    setting_nvs_key(u, i, key, sizeof(key));
+    if (!hal_nvs_put(key, v)) {
+      failed |= 1UL << i;
+      continue;
+    }
+    u.settings_stored[i] = v;
+    u.settings_counters.nvs_writes++;
+    written++;
+  }
+  if (written) {
+    u.settings_counters.commits++;
+    Serial.printf("Settings: %d written to NVS for %s\n", written, u.node_id);
+  }
+  u.settings_unsaved = 0;
+  if (failed) {  // try again after another quiet period
+    u.settings_counters.nvs_errors++;
+    u.settings_unsaved = failed;
+    u.settings_unsaved_since = u.settings_changed_at = hal_millis();
+    Serial.println("⚠️  NVS write failed, will retry");
+  }
+}
+
+void settings_service(Unit& u) {
+  // Controller-backed settings changed since the last pass
+  for (int i = 0; u.settings_unsynced && i < SETTING_COUNT; i++) {
+    if (!(u.settings_unsynced & (1UL << i))) continue;
+    const SettingDesc& d = SETTINGS_TABLE[i];
+    int v = setting_get(u, i);
+    if (!bus_write(u, (RegisterId)d.reg, d.inverted ? !v : v)) break;  // queue full, next pass
+    u.settings_unsynced &= ~(1UL << i);
+    u.settings_counters.synced++;
+  }
+  
+  // Boot readback that got no answer (controller still starting, bus errors)
+  if (u.settings_awaiting_readback && hal_millis() - u.settings_readback_requested > SETTINGS_READBACK_RETRY_MS) {
+    settings_request_readback(u);
+  }
+  
+  if (!u.settings_unsaved) return;
+  if (!settings_nvs_ok) {
+    u.settings_unsaved = 0;
+    return;
+  }
+  unsigned long now = hal_millis();
+  if (now - u.settings_changed_at < SETTINGS_COMMIT_DELAY_MS &&
+      now - u.settings_unsaved_since < SETTINGS_COMMIT_MAX_MS) return;
+  settings_commit(u);
+}
+
+// ========== PUBLISH STATE ==========
+// full = every field (periodic snapshot); otherwise only fields whose dirty
+// bit is set. Each enabled encoding gets the same set of fields.
+void publish_state(Unit& u, bool full) {
+  if (!mqtt.connected()) return;
+  
+  uint64_t fields = full ? ~0ULL : u.state_dirty;
+  if (u.state_encoding & STATE_JSON) {
+    publish_state_json(u, fields, full);
+    fields |= 1ULL << REG_SUPPLY_TEMP;  // always in the JSON message
+  }
+  if (u.state_encoding & STATE_CBOR) publish_state_cbor(u, fields, full);
+  
+  // Deadband references: what subscribers have now seen
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (!(fields & (1ULL << i))) continue;
+    u.reg_published[i] = u.reg_values[i].raw;
+    u.reg_published_valid[i] = u.reg_values[i].valid;
+  }
+  if (fields & (1ULL << FIELD_HUMIDITY)) u.humidity_published = u.current_humidity;
+  
+  u.state_dirty = 0;
+  u.last_mqtt_publish = hal_millis();
+  if (full) u.last_full_publish = u.last_mqtt_publish;
+}
+
+// The climate entity's fields (mode, fan_mode, supply_temp) are always
+// included so its templates never see a partial message.
+void publish_state_json(Unit& u, uint64_t fields, bool full) {
+  StaticJsonDocument<2048> doc;  // Increased for all new sensors
+  
+  // Register-backed values, straight from the descriptor table
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    const RegisterDesc& reg = TITON_REGISTERS[i];
+    if (!(fields & (1ULL << i)) && i != REG_SUPPLY_TEMP) continue;
+    if (!reg.json_key) continue;
+    if (!u.reg_values[i].valid) doc[reg.json_key] = nullptr;
+    else if (reg.decode == DECODE_TENTHS) doc[reg.json_key] = u.reg_values[i].raw / 10.0;
+    else doc[reg.json_key] = u.reg_values[i].raw;
+  }
+  
+  if (fields & (1ULL << FIELD_HUMIDITY)) {
+    doc["humidity"] = u.current_humidity;  // External sensor
+  }
+  
+  // Status flags (decoded from status word)
+  if ((fields & (1ULL << REG_STATUS_WORD)) && u.reg_values[REG_STATUS_WORD].valid) {
+    int status_word = u.reg_values[REG_STATUS_WORD].raw;
+    for (int i = 0; i < STATUS_BIT_COUNT; i++) {
+      const StatusBitDesc& bit = TITON_STATUS_BITS[i];
+      if (bit.json_key) doc[bit.json_key] = (status_word & bit.mask) != 0;
+    }
+  }
+  
+  // System state
+  if (fields & (1ULL << REG_BYPASS_FLAGS)) {
+    int bypass_flags = reg_int(u, REG_BYPASS_FLAGS, 0);
+    doc["summer_bypass"] = (bypass_flags & 0x01) != 0;
+    doc["summerboost"] = (bypass_flags & 0x02) != 0;
+  }
+  
+  // Relay states
+  if (fields & (1ULL << FIELD_SW1)) doc["sw1"] = u.relay_sw1_active;
+  if (fields & (1ULL << FIELD_SW2)) doc["sw2"] = u.relay_sw2_active;
+  if (fields & (1ULL << FIELD_SW3)) doc["sw3"] = u.relay_sw3_active;
+  
+  // Climate entity
+  int current_speed = reg_int(u, REG_CURRENT_SPEED, 2);
+  doc["mode"] = (current_speed > 0) ? "fan_only" : "off";
+  const char* fan_mode = "medium";
+  if (current_speed == 1) fan_mode = "low";
+  else if (current_speed == 3) fan_mode = "high";
+  else if (current_speed == 4) fan_mode = "auto";
+  doc["fan_mode"] = fan_mode;
+  
+  // Settings
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    if (!(fields & (1ULL << (FIELD_SETTINGS + i)))) continue;
+    const SettingDesc& d = SETTINGS_TABLE[i];
+    if (d.flag) doc[d.key] = u.settings.*d.flag;
+    else doc[d.key] = u.settings.*d.value;
+  }
+  
+  char buffer[2048];
+  size_t len = serializeJson(doc, buffer);
+  // Full snapshots are retained so late subscribers start from a complete state
+  mqtt.publish(u.topics.state, (const uint8_t*)buffer, len, full && u.state_delta_mode);
+}
+
+// Compact state for collectors: a CBOR map keyed by field id (the dirty bit
+// numbers) with raw integer values: ~110 bytes for a full snapshot against
+// ~1.5 KB of JSON, and no JSON document to build (titon_replay --bench
+// times both). Keys -1
+// and -2 carry the schema id and uptime. The id -> name/scale table is
+// generated at compile time and published retained on each unit's
+// state/schema topic:
+//   {"encoding":"cbor","meta":{"-1":"schema","-2":"uptime_s"},
+//    "fields":[{"id":0,"key":"stale_air_in_temp","scale":0.1},...],"schema":123}
+// A collector seeing an unknown schema id re-reads the schema topic.
+constexpr void emit_schema_field(TextSink& t, int id, const char* key, bool tenths, bool flag) {
+  if (id) t.put(',');
+  t.raw("{\"id\":");
+  t.number(id);
+  t.field("key", key);
+  if (tenths) t.raw(",\"scale\":0.1");
+  if (flag) t.raw(",\"type\":\"bool\"");
+  t.put('}');
+}
+
+constexpr void emit_state_schema(TextSink& t) {
+  t.raw("{\"encoding\":\"cbor\",\"meta\":{\"-1\":\"schema\",\"-2\":\"uptime_s\"},\"fields\":[");
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    const RegisterDesc& reg = TITON_REGISTERS[i];
+    const char* key = i == REG_BYPASS_FLAGS ? "bypass_flags" : reg.json_key;
+    if (key) emit_schema_field(t, i, key, reg.decode == DECODE_TENTHS, false);
+  }
+  emit_schema_field(t, FIELD_HUMIDITY, "humidity", true, false);
+  emit_schema_field(t, FIELD_SW1, "sw1", false, true);
+  emit_schema_field(t, FIELD_SW2, "sw2", false, true);
+  emit_schema_field(t, FIELD_SW3, "sw3", false, true);
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    emit_schema_field(t, FIELD_SETTINGS + i, SETTINGS_TABLE[i].key, false, SETTINGS_TABLE[i].flag != nullptr);
+  }
+  t.put(']');
+}
+
+constexpr size_t state_schema_size() {
+  TextSink t = { nullptr, 0 };
+  emit_state_schema(t);
+  return t.len + 24;  // + ,"schema":<id>}
+}
+
+struct StateSchema {
+  char text[state_schema_size()];
+  uint16_t length;
+  int32_t id;
+};
+
+constexpr StateSchema make_state_schema() {
+  StateSchema s = {};
+  TextSink t = { s.text, 0 };
+  emit_state_schema(t);
+  s.id = (int32_t)(fnv1a(s.text, t.len) & 0x7fffffff);
+  t.raw(",\"schema\":");
+  t.number(s.id);
+  t.put('}');
+  s.length = (uint16_t)t.len;
+  return s;
+}
+
+static constexpr StateSchema STATE_SCHEMA PROGMEM = make_state_schema();
+
+void publish_state_cbor(Unit& u, uint64_t fields, bool full) {
+  if (u.state_schema_pending) {
+    if (!mqtt.beginPublish(u.topics.state_schema, STATE_SCHEMA.length, true)) return;
+    mqtt.write((const uint8_t*)STATE_SCHEMA.text, STATE_SCHEMA.length);
+    if (!mqtt.endPublish()) return;
+    u.state_schema_pending = false;
+  }
+  
+  uint8_t buffer[256];
+  CborWriter w(buffer, sizeof(buffer));
+  w.begin_map();
+  w.integer(-1);
+  w.integer(STATE_SCHEMA.id);
+  w.integer(-2);
+  w.integer((int32_t)uptime_seconds());
+  
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (!(fields & (1ULL << i))) continue;
+    if (!TITON_REGISTERS[i].json_key && i != REG_BYPASS_FLAGS) continue;
+    w.integer(i);
+    if (u.reg_values[i].valid) w.integer(u.reg_values[i].raw);
+    else w.null();
+  }
+  if (fields & (1ULL << FIELD_HUMIDITY)) {
+    w.integer(FIELD_HUMIDITY);
+    if (isnan(u.current_humidity)) w.null();
+    else w.integer((int32_t)lroundf(u.current_humidity * 10));
+  }
+  const bool relays[3] = { u.relay_sw1_active, u.relay_sw2_active, u.relay_sw3_active };
+  for (int n = 0; n < 3; n++) {
+    if (!(fields & (1ULL << (FIELD_SW1 + n)))) continue;
+    w.integer(FIELD_SW1 + n);
+    w.boolean(relays[n]);
+  }
+  for (int i = 0; i < SETTING_COUNT; i++) {
+    if (!(fields & (1ULL << (FIELD_SETTINGS + i)))) continue;
+    const SettingDesc& d = SETTINGS_TABLE[i];
+    w.integer(FIELD_SETTINGS + i);
+    if (d.flag) w.boolean(u.settings.*d.flag);
+    else w.integer(u.settings.*d.value);
+  }
+  w.end_map();
+  
+  if (w.overflowed()) {
+    Serial.println("CBOR state too large, not sent");
+    return;
+  }
+  mqtt.publish(u.topics.state_cbor, buffer, w.length(), full && u.state_delta_mode);
+}
+
+// ========== PUBLISH DIAGNOSTICS ==========
+void publish_diagnostics(Unit& u) {
+  if (!mqtt.connected()) return;
+  
+  static BusStatus bus;  // next to the 4 KB document on the loop task's stack
+  u.bus_status.read(bus);
+  
+  StaticJsonDocument<4096> doc;
+  doc["uptime_s"] = hal_millis() / 1000;
+  doc["rs485_queue"] = bus.queue_depth;
+  doc["rs485_unsolicited"] = bus.unsolicited;
+  doc["rs485_update_drops"] = bus.update_drops;
+  
+  JsonObject writes = doc.createNestedObject("writes");
+  writes["sent"] = bus.writes.sent;
+  writes["coalesced"] = bus.writes.coalesced;
+  writes["suppressed"] = bus.writes.suppressed;
+  writes["retries"] = bus.writes.retries;
+  writes["failed"] = bus.writes.failed;
+  
+  // Frames per second while we had traffic queued, against the line rate
+  const LineCounters& lc = bus.line;
+  JsonObject line = doc.createNestedObject("line");
+  line["frames_per_s"] = lc.busy_ms ? lc.frames * 1000.0f / lc.busy_ms : 0.0f;
+  line["line_frames_per_s"] = TITON_LINE_FRAMES_PER_S;
+#if TITON_BUS_BURST
+  line["burst"] = BURST_MODE_NAMES[lc.burst_mode];
+#else
+  line["burst"] = "disabled";
+#endif
+  line["bursts"] = lc.bursts;
+  line["burst_failures"] = lc.burst_failures;
+  line["burst_reprobe_s"] = lc.reprobe_ms / 1000;
+  line["first_sweep_ms"] = lc.sweep_ms;
+  
+#if TITON_BUS_SNIFF
+  JsonObject sniff = doc.createNestedObject("sniff");
+  sniff["requests"] = bus.sniff.requests;
+  sniff["replies"] = bus.sniff.replies;
+  sniff["writes"] = bus.sniff.writes;
+  sniff["unknown"] = bus.sniff.unknown;
+  sniff["deferred"] = bus.sniff.deferred;
+#endif
+  
+  JsonObject net = doc.createNestedObject("net");
+  net["wifi_attempts"] = net_counters.wifi_attempts;
+  net["wifi_connects"] = net_counters.wifi_connects;
+  net["wifi_last_outage_ms"] = net_counters.wifi_last_outage_ms;
+  net["mqtt_attempts"] = net_counters.mqtt_attempts;
+  net["mqtt_connects"] = net_counters.mqtt_connects;
+  net["mqtt_last_outage_ms"] = net_counters.mqtt_last_outage_ms;
+  net["mqtt_max_outage_ms"] = net_counters.mqtt_max_outage_ms;
+  net["discovery_published"] = discovery_published;
+  net["discovery_skipped"] = discovery_skipped;
+  
+  JsonObject box = doc.createNestedObject("outbox");
+  box["ram"] = u.outbox.size();
+  box["log_bytes"] = (uint32_t)(u.outbox_log_size - u.outbox_log_read);
+  box["queued"] = u.outbox_counters.queued;
+  box["spilled"] = u.outbox_counters.spilled;
+  box["dropped"] = u.outbox_counters.dropped;
+  box["delivered"] = u.outbox_counters.delivered;
+  
+  JsonObject stored = doc.createNestedObject("settings");
+  stored["unsaved"] = u.settings_unsaved != 0;
+  stored["restored"] = u.settings_counters.restored;
+  stored["commits"] = u.settings_counters.commits;
+  stored["nvs_writes"] = u.settings_counters.nvs_writes;
+  stored["nvs_skipped"] = u.settings_counters.nvs_skipped;
+  stored["nvs_errors"] = u.settings_counters.nvs_errors;
+  stored["synced"] = u.settings_counters.synced;
+  stored["adopted"] = u.settings_counters.adopted;
+  
+  add_humidity_boost(doc.createNestedObject("humidity_boost"), u);
+  
+  const FrameCounters& fc = bus.frames;
+  JsonObject frames = doc.createNestedObject("frames");
+  frames["ok"] = fc.ok;
+  frames["malformed"] = fc.malformed;
+  frames["overlong"] = fc.overlong;
+  frames["faults"] = fc.faults;
+  frames["noise"] = fc.noise;
+  frames["overruns"] = fc.overruns;
+  
+  JsonObject age = doc.createNestedObject("age_s");
+  JsonObject regs = doc.createNestedObject("registers");
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    const RegisterStats& s = bus.stats[i];
+    char key[8];
+    snprintf(key, sizeof(key), "%03d", TITON_REGISTERS[i].address);
+    if (bus.last_ok[i]) age[key] = (hal_millis() - bus.last_ok[i]) / 1000;
+    if (s.ok + s.timeouts + s.faults == 0) continue;
+    JsonObject r = regs.createNestedObject(key);
+    r["ok"] = s.ok;
+    r["timeouts"] = s.timeouts;
+    r["retries"] = s.retries;
+    r["faults"] = s.faults;
+    r["latency_ms"] = s.last_latency_ms;
+    r["max_latency_ms"] = s.max_latency_ms;
+    r["avg_latency_ms"] = s.ok ? s.total_latency_ms / s.ok : 0;
+  }
+  
+  // Streamed: with every register reporting it no longer fits a fixed buffer
+  if (!mqtt.beginPublish(u.topics.diagnostics, measureJson(doc), false)) return;
+  serializeJson(doc, mqtt);
+  mqtt.endPublish();
+}
+
+// ========== HISTORY / BACKFILL ==========
+// Every published register and the external humidity sensor of each unit
+// keep a TimeSeries (titon_history.h, see HistoryMap), fed on the network
+// side as values arrive, so a collector that missed updates while it or the
+// broker was down can fill the gap with one request instead of watching the
+// state topic:
+//   history/get  {"key":"supply_temp","res":"1m","last":3600,"id":7}
+//                ("from"/"to" in uptime seconds instead of "last")
+//   history      {"key":"supply_temp","id":7,"res":"1m","now":86400,"scale":0.1,
+//                 "step":60,"t0":82800,"min":[...],"max":[...],"avg":[...]}
+// res is "raw", "1m" or "15m". Empty rollup buckets are null; raw answers
+// carry "t0" plus "dt" (seconds since the previous sample) and "v". Values
+// are raw register units (times "scale" if present). Times are uptime
+// seconds; "now" lets the collector convert them to wall-clock time.
+enum HistoryRes : uint8_t { HISTORY_RAW, HISTORY_MINUTE, HISTORY_QUARTER };
+const char* const HISTORY_RES_NAMES[] = { "raw", "1m", "15m" };
+
+const size_t HISTORY_RESPONSE_MAX = 3072;
+
+struct HistoryQuery {
+  int series;
+  HistoryRes res;
+  uint32_t from;
+  uint32_t to;
+  uint32_t now;
+  char id[24];
+  bool id_quoted;
+};
+
+// Seconds since boot, carried across the 49.7-day hal_millis() wrap
+uint32_t uptime_seconds() {
+  static uint32_t last_ms = 0;
+  static uint32_t carry_ms = 0;
+  static uint32_t seconds = 0;
+  uint32_t now = hal_millis();
+  carry_ms += now - last_ms;
+  last_ms = now;
+  seconds += carry_ms / 1000;
+  carry_ms %= 1000;
+  return seconds;
+}
+
+void history_record(Unit& u, int slot, int32_t value) {
+  int series = HISTORY_MAP.series[slot];
+  if (series >= 0) u.history[series].add(uptime_seconds(), value);
+}
+
+void history_record_humidity(Unit& u, int32_t tenths) {
+  u.history[HISTORY_HUMIDITY].add(uptime_seconds(), tenths);
+}
+
+const char* history_key(int series) {
+  if (series == HISTORY_HUMIDITY) return "humidity";
+  return TITON_REGISTERS[HISTORY_MAP.reg[series]].json_key;
+}
+
+int history_series_by_key(const char* key) {
+  for (int i = 0; i < HISTORY_SERIES_COUNT; i++) {
+    if (strcmp(history_key(i), key) == 0) return i;
+  }
+  return -1;
+}
+
+bool history_scaled(int series) {
+  return series == HISTORY_HUMIDITY || TITON_REGISTERS[HISTORY_MAP.reg[series]].decode == DECODE_TENTHS;
+}
+
+void history_encode_raw(TextSink& t, const RawRing<TITON_HISTORY_RAW>& r, uint32_t from, uint32_t to) {
+  uint16_t first = 0;
+  while (first < r.size() && r.time(first) < from) first++;
+  uint16_t end = first;
+  while (end < r.size() && r.time(end) <= to) end++;
+  
+  uint32_t prev = first < end ? r.time(first) : from;
+  t.raw(",\"t0\":");
+  t.number((int)prev);
+  t.raw(",\"dt\":[");
+  for (uint16_t i = first; i < end; i++) {
+    if (i > first) t.put(',');
+    t.number((int)(r.time(i) - prev));
+    prev = r.time(i);
+  }
+  t.raw("],\"v\":[");
+  for (uint16_t i = first; i < end; i++) {
+    if (i > first) t.put(',');
+    t.number(r.value(i));
+  }
+  t.put(']');
+}
+
+template <uint16_t N>
+void history_encode_rollup(TextSink& t, const RollupRing<N>& r, uint32_t from, uint32_t to) {
+  uint32_t period = r.period();
+  uint32_t first = from / period;
+  uint32_t last = to / period;
+  uint32_t buckets = 0;
+  if (!r.empty()) {
+    if (first < r.oldest()) first = r.oldest();
+    if (last > r.newest()) last = r.newest();
+    if (last >= first) buckets = last - first + 1;
+  }
+  
+  t.raw(",\"step\":");
+  t.number((int)period);
+  t.raw(",\"t0\":");
+  t.number((int)(first * period));
+  // One column at a time: min, max, avg
+  for (int column = 0; column < 3; column++) {
+    t.raw(column == 0 ? ",\"min\":[" : column == 1 ? "],\"max\":[" : "],\"avg\":[");
+    for (uint32_t k = 0; k < buckets; k++) {
+      if (k) t.put(',');
+      Rollup bucket;
+      if (!r.bucket(first + k, bucket)) t.raw("null");
+      else t.number(column == 0 ? bucket.min : column == 1 ? bucket.max : bucket.avg);
+    }
+  }
+  t.put(']');
+}
+
+// The request's id echoed back as it came: a string (escaped) or a number
+void history_encode_id(TextSink& t, const HistoryQuery& q) {
+  if (q.id_quoted) {
+    t.field("id", q.id);
+  } else {
+    t.raw(",\"id\":");
+    t.raw(q.id[0] ? q.id : "null");
+  }
+}
+
+void history_encode(TextSink& t, const Unit& u, const HistoryQuery& q) {
+  t.raw("{\"key\":\"");
+  t.raw(history_key(q.series));
+  t.put('"');
+  if (q.id[0]) history_encode_id(t, q);
+  t.field("res", HISTORY_RES_NAMES[q.res]);
+  t.raw(",\"now\":");
+  t.number((int)q.now);
+  if (history_scaled(q.series)) t.raw(",\"scale\":0.1");
+  
+  const TimeSeries& h = u.history[q.series];
+  if (q.res == HISTORY_RAW) history_encode_raw(t, h.raw, q.from, q.to);
+  else if (q.res == HISTORY_MINUTE) history_encode_rollup(t, h.minute, q.from, q.to);
+  else history_encode_rollup(t, h.quarter, q.from, q.to);
+  t.put('}');
+}
+
+void publish_history_error(Unit& u, const HistoryQuery& q, const char* error) {
+  // Room for every id character escaped plus the longest error
+  char buffer[2 * sizeof(q.id) + 48];
+  TextSink t{ buffer, 0 };
+  t.raw("{\"error\":\"");
+  t.raw(error);
+  t.put('"');
+  history_encode_id(t, q);
+  t.put('}');
+  t.put('\0');
+  mqtt.publish(u.topics.history, buffer);
+}
+
+void handle_history_request(Unit& u, const uint8_t* payload, unsigned int length) {
+  StaticJsonDocument<256> req;
+  if (deserializeJson(req, (const char*)payload, length)) {
+    Serial.println("History request: JSON parse failed");
+    return;
+  }
+  
+  HistoryQuery q;
+  q.now = uptime_seconds();
+  q.id[0] = '\0';
+  q.id_quoted = req["id"].is<const char*>();
+  if (q.id_quoted) snprintf(q.id, sizeof(q.id), "%s", req["id"].as<const char*>());
+  else if (req["id"].is<long>()) snprintf(q.id, sizeof(q.id), "%ld", req["id"].as<long>());
+  
+  q.series = history_series_by_key(req["key"] | "");
+  if (q.series < 0) {
+    publish_history_error(u, q, "unknown key");
+    return;
+  }
+  
+  const char* res = req["res"] | "raw";
+  if (strcmp(res, "1m") == 0) q.res = HISTORY_MINUTE;
+  else if (strcmp(res, "15m") == 0) q.res = HISTORY_QUARTER;
+  else if (strcmp(res, "raw") == 0) q.res = HISTORY_RAW;
+  else {
+    publish_history_error(u, q, "unknown res");
+    return;
+  }
+  
+  q.from = req["from"] | 0UL;
+  q.to = req["to"] | (unsigned long)q.now;
+  if (req.containsKey("last")) {
+    uint32_t last = req["last"];
+    q.from = last < q.now ? q.now - last : 0;
+  }
+  
+  // Size it first; the answer is streamed past the MQTT packet buffer
+  TextSink size{ nullptr, 0 };
+  history_encode(size, u, q);
+  if (size.len > HISTORY_RESPONSE_MAX) {
+    publish_history_error(u, q, "range too large");
+    return;
+  }
+  static char buffer[HISTORY_RESPONSE_MAX];
+  TextSink out{ buffer, 0 };
+  history_encode(out, u, q);
+  if (!mqtt.beginPublish(u.topics.history, out.len, false)) return;
+  mqtt.write((const uint8_t*)buffer, out.len);
+  mqtt.endPublish();
+}
+
+// ========== LOOP PROFILING ==========
+// Each stage of bus_loop() and net_loop() is timed with the CPU cycle counter
+// into a fixed-size histogram (see titon_profile.h). Stages are timed lap by
+// lap, so the cost is one counter read and one bucket increment per stage.
+// Each task only touches its own histograms: at the end of a window the
+// network side asks the bus task for a summary, which comes back through a
+// seqlock, and publishes both once it arrives.
+#if TITON_PROFILE
+enum LoopStage {
+  // bus task
+  STAGE_POLL, STAGE_RX, STAGE_RS485, BUS_STAGE_COUNT,
+  // network task
+  STAGE_NET = BUS_STAGE_COUNT, STAGE_UPDATES, STAGE_HEARTBEAT, STAGE_TIMERS,
+  STAGE_HUMIDITY, STAGE_PUBLISH, STAGE_DISCOVERY, STAGE_DIAGNOSTICS, STAGE_COUNT
+};
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+  "poll", "rx", "rs485",
+  "net", "updates", "heartbeat", "timers", "humidity", "publish", "discovery", "diagnostics"
+};
+
+struct LoopProfile {
+  uint8_t first_stage;
+  uint8_t end_stage;
+  LatencyHistogram loop;
+  uint32_t stall_cycles;        // worst iteration in the window...
+  int stall_stage;              // ...and the stage that took longest in it
+  unsigned long stall_at;
+  unsigned long window_start;
+};
+
+struct LatencySummary {
+  uint32_t n, p50, p99, max, avg;  // cycles
+};
+
+struct ProfileReport {
+  LatencySummary loop;
+  LatencySummary stages[STAGE_COUNT];  // only the task's own stages are filled
+  uint32_t stall_cycles;
+  int32_t stall_stage;
+  uint32_t stall_age_ms;
+  uint32_t window_ms;
+};
+
+LatencyHistogram stage_hist[STAGE_COUNT];
+uint32_t stage_cycles[STAGE_COUNT];    // current iteration, for stall attribution
+LoopProfile bus_profile = { 0, BUS_STAGE_COUNT, LatencyHistogram(), 0, -1, 0, 0 };
+LoopProfile net_profile = { BUS_STAGE_COUNT, STAGE_COUNT, LatencyHistogram(), 0, -1, 0, 0 };
+
+std::atomic<bool> bus_report_requested(false);
+Seqlock<ProfileReport> bus_report;
+uint32_t bus_report_seen = 0;          // network side
+bool latency_pending = false;
+
+#define PROFILE_LOOP_BEGIN() uint32_t profile_t0 = hal_cycles(); const uint32_t profile_loop_t0 = profile_t0
+#define PROFILE_LAP(stage) profile_t0 = profile_lap(stage, profile_t0)
+#define PROFILE_LOOP_END(profile) profile_loop_end(profile, profile_loop_t0)
+
+inline uint32_t profile_lap(int stage, uint32_t t0) {
+  uint32_t now = hal_cycles();
+  uint32_t elapsed = now - t0;
+  stage_hist[stage].record(elapsed);
+  stage_cycles[stage] = elapsed;
+  return now;
+}
+
+void profile_loop_end(LoopProfile& p, uint32_t loop_t0) {
+  uint32_t total = hal_cycles() - loop_t0;
+  p.loop.record(total);
+  if (total <= p.stall_cycles) return;
+  
+  int worst = p.first_stage;
+  for (int i = p.first_stage + 1; i < p.end_stage; i++) {
+    if (stage_cycles[i] > stage_cycles[worst]) worst = i;
+  }
+  p.stall_cycles = total;
+  p.stall_stage = worst;
+  p.stall_at = hal_millis();
+}
+
+LatencySummary summarize(const LatencyHistogram& h) {
+  return LatencySummary{ h.count(), h.percentile(500), h.percentile(990), h.max(), h.mean() };
+}
+
+// Summarize the window so far and start a new one (owning task only)
+void profile_take(LoopProfile& p, ProfileReport& r) {
+  memset(&r, 0, sizeof(r));
+  r.loop = summarize(p.loop);
+  for (int i = p.first_stage; i < p.end_stage; i++) {
+    r.stages[i] = summarize(stage_hist[i]);
+    stage_hist[i].reset();
+  }
+  r.stall_cycles = p.stall_cycles;
+  r.stall_stage = p.stall_stage;
+  r.stall_age_ms = p.stall_cycles ? hal_millis() - p.stall_at : 0;
+  r.window_ms = hal_millis() - p.window_start;
+  
+  p.loop.reset();
+  p.stall_cycles = 0;
+  p.stall_stage = -1;
+  p.window_start = hal_millis();
+}
+
+// Bus task, end of each pass
+void profile_bus_handoff() {
+  if (!bus_report_requested.load(std::memory_order_acquire)) return;
+  ProfileReport r;
+  profile_take(bus_profile, r);
+  bus_report.write(r);
+  bus_report_requested.store(false, std::memory_order_release);
+}
+
+float cycles_to_us(uint32_t cycles) {
+  return roundf(cycles * 10.0f / hal_cycles_per_us()) / 10.0f;
+}
+
+void add_latency(JsonObject out, const LatencySummary& s) {
+  out["n"] = s.n;
+  out["p50_us"] = cycles_to_us(s.p50);
+  out["p99_us"] = cycles_to_us(s.p99);
+  out["max_us"] = cycles_to_us(s.max);
+  out["avg_us"] = cycles_to_us(s.avg);
+}
+
+void add_profile(JsonObject out, const ProfileReport& r, int first_stage, int end_stage) {
+  out["loop_hz"] = r.window_ms ? roundf(r.loop.n * 1000.0f / r.window_ms) : 0;
+  out["stall_us"] = cycles_to_us(r.stall_cycles);
+  out["stall_cause"] = r.stall_stage >= 0 ? STAGE_NAMES[r.stall_stage] : "none";
+  out["stall_age_s"] = r.stall_age_ms / 1000;
+  add_latency(out.createNestedObject("loop"), r.loop);
+  JsonObject stages = out.createNestedObject("stages");
+  for (int i = first_stage; i < end_stage; i++) {
+    add_latency(stages.createNestedObject(STAGE_NAMES[i]), r.stages[i]);
+  }
+}
+
+// Called every DIAGNOSTICS_INTERVAL: close the bus window; the report goes
+// out from publish_latency() once the bus task has answered
+void request_latency() {
+  if (!mqtt.connected() || latency_pending) return;
+  bus_report_seen = bus_report.sequence();
+  bus_report_requested.store(true, std::memory_order_release);
+  latency_pending = true;
+}
+
+void publish_latency() {
+  if (!latency_pending || bus_report.sequence() == bus_report_seen) return;
+  latency_pending = false;
+  if (!mqtt.connected()) return;
+  
+  ProfileReport bus, net;
+  bus_report.read(bus);
+  profile_take(net_profile, net);
+  
+  StaticJsonDocument<2048> doc;
+  doc["window_s"] = net.window_ms / 1000;
+  add_profile(doc.createNestedObject("bus"), bus, 0, BUS_STAGE_COUNT);
+  add_profile(doc.createNestedObject("net"), net, BUS_STAGE_COUNT, STAGE_COUNT);
+  
+  char buffer[1536];
+  size_t len = serializeJson(doc, buffer, sizeof(buffer));
+  mqtt.publish(TOPIC_LATENCY, (const uint8_t*)buffer, len);
+}
+#else
+#define PROFILE_LOOP_BEGIN() do {} while (0)
+#define PROFILE_LAP(stage) do {} while (0)
+#define PROFILE_LOOP_END(profile) do {} while (0)
+#endif
+
+#if TITON_BUS_SNIFF
+// ========== BUS SNIFFER ==========
+// Frames that didn't answer our outstanding read are other masters' traffic
+// (or a late reply to one of ours); BusSniffer pairs them up. A register
+// another master has just read is as fresh as if we had polled it, so its
+// next poll moves back a full period. A write by another master changes
+// what we last confirmed, so the register is read once to catch up.
+void sniff_frame(Unit& u, const TitonFrame& frame) {
+  unsigned long now = hal_millis();
+  SniffEvent e = u.bus_sniffer.decode(frame, now);
+  int slot = register_slot(e.address);
+  if (slot < 0) return;
+  
+  if (e.kind == SNIFF_REPLY) {
+    parse_response(u, e.address, e.value);
+    if (e.own) return;
+    u.poll_last_ok[slot] = now;
+    if (TITON_REGISTERS[slot].poll_period_ms) {
+      u.poll_next_due[slot] = now + TITON_REGISTERS[slot].poll_period_ms;
+      u.bus_sniffer.count_deferred();
+    }
+  } else if (e.kind == SNIFF_WRITE && TITON_REGISTERS[slot].write_cmd) {
+    Serial.printf("%s: RS485 write by another master: %03d=%ld\n", u.node_id, e.address, (long)e.value);
+    u.bus_writes.forget(slot);
+    u.read_pending[slot] = true;
+  }
+}
+#endif
+
+// ========== RS485 PARSING ==========
+void handle_rs485_frame(Unit& u, FrameStatus status, const TitonFrame& frame) {
+  switch (status) {
+    case FRAME_OK:
+      Serial.printf("RS485 RX: %s\n", u.rx_framer.line());
+#if TITON_BUS_SNIFF
+      if (u.rs485.on_frame(frame.address, frame.value)) parse_response(u, frame.address, frame.value);
+      else sniff_frame(u, frame);
+#else
+      u.rs485.on_frame(frame.address, frame.value);
+      parse_response(u, frame.address, frame.value);
+#endif
+      break;
+    case FRAME_SENSOR_FAULT:
+      // Don't update the value, but it still answers the outstanding read
+      Serial.printf("⚠️  Address %d returned error (-99999) - FAULTY SENSOR!\n", frame.address);
+#if TITON_BUS_SNIFF
+      if (!u.rs485.on_frame(frame.address, frame.value)) u.bus_sniffer.decode(frame, hal_millis());
+#else
+      u.rs485.on_frame(frame.address, frame.value);
+#endif
       break;
-    case 383:
-      extract_temp = value / 10.0;
+    case FRAME_MALFORMED:
+      Serial.printf("RS485 RX malformed: %s\n", u.rx_framer.line());
       break;
-    case 384:
-      current_speed = value;
+    case FRAME_OVERLONG:
+      Serial.printf("RS485 RX overlong: %s...\n", u.rx_framer.line());
       break;
-    case 385:
-      summer_bypass = (value & 0x01) != 0;
-      summerboost_active = (value & 0x02) != 0;
+    case FRAME_NONE:
       break;
   }
 }
 
-// ========== NEW: STATUS WORD DECODER ==========
-void decode_status_word(int status) {
-  Serial.println("=== STATUS WORD DECODING ===");
-  Serial.printf("Raw value: %d (0x%04X)\n", status, status);
+void parse_response(Unit& u, int address, int value) {
+  int slot = register_slot(address);
+  if (slot < 0) return;
   
-  if (status & STATUS_SUPPLY_FAN_ERROR)    Serial.println("⚠️  Supply Fan Error");
-  if (status & STATUS_THERMISTOR_ERROR)    Serial.println("⚠️  Thermistor Error (General)");
-  if (status & STATUS_EXTRACT_FAN_ERROR)   Serial.println("⚠️  Extract Fan Error");
-  if (status & STATUS_EEPROM_ERROR)        Serial.println("⚠️  EEPROM Error");
-  if (status & STATUS_SWITCH1_ACTIVE)      Serial.println("ℹ️  Switch 1 Active");
-  if (status & STATUS_SWITCH2_ACTIVE)      Serial.println("ℹ️  Switch 2 Active");
-  if (status & STATUS_SWITCH3_ACTIVE)      Serial.println("ℹ️  Switch 3 Active");
-  if (status & STATUS_LS1_ACTIVE)          Serial.println("ℹ️  LS1 Active");
-  if (status & STATUS_LS2_ACTIVE)          Serial.println("ℹ️  LS2 Active");
-  if (status & STATUS_ENGINE_ERROR)        Serial.println("⚠️  Engine Error");
-  if (status & STATUS_SWITCH_ERROR)        Serial.println("⚠️  Switch Error");
-  if (status & STATUS_ENGINE_RUNNING)      Serial.println("✅ Engine Running");
-  if (status & STATUS_THERM1_ERROR)        Serial.println("⚠️  Thermistor 1 Error");
-  if (status & STATUS_THERM2_ERROR)        Serial.println("⚠️  Thermistor 2 Error");
-  if (status & STATUS_THERM3_ERROR)        Serial.println("⚠️  Thermistor 3 Error");
-  if (status & STATUS_HUMIDITY_ERROR)      Serial.println("⚠️  Humidity Sensor Error");
+  const RegisterDesc& reg = TITON_REGISTERS[slot];
+  bus_push_update(u, slot, value);
+  u.bus_writes.confirm(slot, value);
   
-  Serial.println("===========================");
+  switch (reg.decode) {
+    case DECODE_TENTHS:
+      Serial.printf("%s: %.1f%s\n", reg.name, value / 10.0, reg.unit);
+      break;
+    case DECODE_INT:
+      if (slot == REG_STATUS_WORD) {
+        decode_status_word(value);
+      } else if (reg.name) {
+        Serial.printf("%s: %d%s\n", reg.name, value, reg.unit);
+      }
+      break;
+    case DECODE_BYPASS_FLAGS:
+      Serial.printf("Summer Bypass: %s SUMMERboost: %s\n",
+                    (value & 0x01) ? "active" : "idle",
+                    (value & 0x02) ? "active" : "idle");
+      break;
+  }
+}
+
+int reg_int(const Unit& u, RegisterId id, int fallback) {
+  return u.reg_values[id].valid ? u.reg_values[id].raw : fallback;
 }
 
-// ========== NEW: ROTATING SENSOR POLL ==========
-void poll_mvhr_sensors() {
-  if (millis() - last_sensor_poll < SENSOR_POLL_INTERVAL) return;
-  last_sensor_poll = millis();
+// ========== NEW: STATUS WORD DECODER ==========
+void decode_status_word(int status) {
+  Serial.println("=== STATUS WORD DECODING ===");
+  Serial.printf("Raw value: %d (0x%04X)\n", status, status);
   
-  // Rotate through sensors to avoid bus saturation
-  // Poll one sensor every 2 seconds = all 10 sensors every 20 seconds
-  switch (poll_index) {
-    case 0: send_rs485_command("0301+00000\r\n"); break;  // Stale In
-    case 1: send_rs485_command("0311+00000\r\n"); break;  // Stale Out
-    case 2: send_rs485_command("0321+00000\r\n"); break;  // Fresh In
-    case 3: send_rs485_command("0361+00000\r\n"); break;  // Internal Humidity
-    case 4: send_rs485_command("0601+00000\r\n"); break;  // Runtime Hours
-    case 5: send_rs485_command("0611+00000\r\n"); break;  // Status Word
-    case 6: send_rs485_command("3411+00000\r\n"); break;  // Filter Remaining
-    case 7: send_rs485_command("3821+00000\r\n"); break;  // Supply Temp
-    case 8: send_rs485_command("3831+00000\r\n"); break;  // Extract Temp
-    case 9: send_rs485_command("3841+00000\r\n"); break;  // Current Speed
+  for (int i = 0; i < STATUS_BIT_COUNT; i++) {
+    const StatusBitDesc& bit = TITON_STATUS_BITS[i];
+    if (!(status & bit.mask)) continue;
+    if (bit.is_fault) Serial.printf("⚠️  %s\n", bit.label);
+    else if (bit.mask == STATUS_ENGINE_RUNNING) Serial.printf("✅ %s\n", bit.label);
+    else Serial.printf("ℹ️  %s\n", bit.label);
   }
   
-  poll_index = (poll_index + 1) % 10;
+  Serial.println("===========================");
 }
 
 // ========== FAN SPEED CONTROL (RS485) ==========
-void set_fan_speed(int speed) {
+void set_fan_speed(Unit& u, int speed) {
   if (speed < 1 || speed > 4) return;
   
   int speed_value = 0;
@@ -781,44 +2758,40 @@ void set_fan_speed(int speed) {
     case 4: speed_value = 8; break;
   }
   
-  char cmd[16];
-  snprintf(cmd, sizeof(cmd), "3840+%05d\r\n", speed_value);
-  send_rs485_command(cmd);
-  Serial.printf("Set speed to %d (value=%d)\n", speed, speed_value);
+  bus_write(u, REG_CURRENT_SPEED, speed_value);
+  Serial.printf("%s: set speed to %d (value=%d)\n", u.node_id, speed, speed_value);
 }
 
 // ========== RELAY CONTROL ==========
-void set_relay(int relay_pin, bool state) {
-  digitalWrite(relay_pin, state ? HIGH : LOW);
-  Serial.printf("Relay on pin %d: %s\n", relay_pin, state ? "ON" : "OFF");
+// Switch numbers 1-3; pulses are timed by TitonRelays (titon_bus.h)
+void set_relay(Unit& u, int switch_num, bool state) {
+  u.relays.set(switch_num, state);
+  Serial.printf("%s: relay SW%d: %s\n", u.node_id, switch_num, state ? "ON" : "OFF");
 }
 
-void trigger_boost(int switch_num, unsigned long duration_ms) {
-  int relay_pin;
-  switch (switch_num) {
-    case 1: relay_pin = RELAY_SW1; break;
-    case 2: relay_pin = RELAY_SW2; break;
-    case 3: relay_pin = RELAY_SW3; break;
-    default: return;
+void trigger_boost(Unit& u, int switch_num, unsigned long duration_ms) {
+  if (!u.relays.pulse(switch_num, duration_ms)) return;
+  Serial.printf("%s: pulsing SW%d relay for %lu ms\n", u.node_id, switch_num, duration_ms);
+}
+
+// A pulse leaves the input open, even one the user had switched on
+void service_relays(Unit& u) {
+  int ended = u.relays.service();
+  bool* const active[TitonRelays::COUNT] = { &u.relay_sw1_active, &u.relay_sw2_active, &u.relay_sw3_active };
+  for (int sw = 1; sw <= TitonRelays::COUNT; sw++) {
+    if (!(ended & (1 << sw))) continue;
+    if (*active[sw - 1]) mark_dirty(u, FIELD_SW1 + sw - 1);
+    *active[sw - 1] = false;
+    Serial.printf("%s: SW%d pulse complete - PCB will handle overrun timer\n", u.node_id, sw);
   }
-  
-  Serial.printf("Pulsing SW%d relay for %lu ms\n", switch_num, duration_ms);
-  digitalWrite(relay_pin, HIGH);
-  delay(duration_ms);
-  digitalWrite(relay_pin, LOW);
-  Serial.printf("SW%d pulse complete - PCB will handle overrun timer\n", switch_num);
 }
 
 // ========== HUMIDITY SENSOR ==========
-float read_humidity() {
-  // Read ADC multiple times and average for stability
-  int sum = 0;
-  for (int i = 0; i < 5; i++) {
-    sum += analogRead(HUMIDITY_PIN);
-    delay(10);
-  }
-  int raw = sum / 5;
-  
+// The ADC samples the first unit's sensor in the background at ~100 Hz, and
+// any other unit's every HUMIDITY_FALLBACK_MS; every result goes through the
+// unit's median + IIR filter (titon_filter.h) and its current_humidity
+// always holds the latest filtered value. Nothing here waits on the ADC.
+float humidity_from_adc(int raw) {
   // Convert to voltage (0-3.3V)
   float voltage = (raw / 4095.0) * 3.3;
   
@@ -836,59 +2809,352 @@ float read_humidity() {
   return humidity;
 }
 
-// ========== MAIN LOOP ==========
-void loop() {
-  // WiFi check
-  if (WiFi.status() != WL_CONNECTED) {
-    setup_wifi();
+void service_humidity(Unit& u) {
+  if (u.config->humidity < 0) return;
+  int raw;
+  bool fresh = false;
+  if (u.humidity_streaming) {
+    while (hal_adc_stream_read(&raw)) {
+      u.humidity_filter.add((uint16_t)raw);
+      fresh = true;
+    }
+  } else if (hal_millis() - u.last_humidity_sample >= HUMIDITY_FALLBACK_MS) {
+    u.last_humidity_sample = hal_millis();
+    u.humidity_filter.add((uint16_t)hal_adc_read(u.config->humidity));
+    fresh = true;
   }
-  
-  // MQTT check
-  if (!mqtt.connected()) {
-    reconnect_mqtt();
+  if (!fresh) return;
+  
+  u.current_humidity = humidity_from_adc(u.humidity_filter.value());
+  if (!u.humidity_recorded || hal_millis() - u.last_humidity_record >= HUMIDITY_RECORD_INTERVAL) {
+    u.humidity_recorded = true;
+    u.last_humidity_record = hal_millis();
+    int32_t tenths = (int32_t)lroundf(u.current_humidity * 10);
+    history_record_humidity(u, tenths);
+    outbox_delta(u, OUTBOX_KEY_HUMIDITY, tenths);
+  }
+  if (isnan(u.humidity_published) || fabs(u.current_humidity - u.humidity_published) >= HUMIDITY_DEADBAND) {
+    mark_dirty(u, FIELD_HUMIDITY);
+  }
+}
+
+// ========== HUMIDITY BOOST ==========
+// Local closed loop, so a shower is cleared without a round trip through
+// Home Assistant and still is while the network is down. It watches the
+// wetter of the external sensor and the unit's own extract humidity
+// (register 036) and boosts when humidity reaches humidity_setpoint or rises
+// HUMIDITY_RISE_TRIGGER within a minute (shower detection). A boost lasts at
+// least HUMIDITY_MIN_ON_MS and ends once humidity is back below
+// HUMIDITY_HYSTERESIS under the setpoint, or over the level before the rise
+// if that is lower, so a rise-triggered boost runs until the room is back
+// near where it started rather than stopping the moment it starts.
+//
+// settings.humidity_boost picks the action and is off (0) until set: 1
+// holds SW2 closed (the PCB runs its own wet room overrun after release),
+// 2-4 runs at that fan speed and restores the previous speed wetroom_overrun
+// minutes after humidity clears. Outputs the user already had on are left
+// alone. A manual fan speed, SW2 or wet room boost command ends the boost,
+// as does HUMIDITY_MAX_ON_MS; either holds off new ones until humidity has
+// cleared or for HUMIDITY_LOCKOUT_MS, so a room that never dries out is
+// still boosted again later. Every start and end is an outbox event with its
+// reason, so Home Assistant only observes.
+enum HumidityBoostReason {
+  HB_REASON_SETPOINT,
+  HB_REASON_RISE,
+  HB_REASON_CLEARED,
+  HB_REASON_MAX_ON,
+  HB_REASON_NO_DATA,
+  HB_REASON_MANUAL,
+  HB_REASON_SETTINGS,
+  HB_REASON_COUNT
+};
+
+const char* const HB_REASON_NAMES[HB_REASON_COUNT] = {
+  "setpoint", "rise", "cleared", "max_on", "no_data", "manual", "settings",
+};
+
+const unsigned long HUMIDITY_CONTROL_INTERVAL = 1000;
+const float HUMIDITY_HYSTERESIS = 5.0;           // %RH
+const float HUMIDITY_RISE_TRIGGER = 5.0;         // %RH within the rise window
+const unsigned long HUMIDITY_RISE_SAMPLE_MS = 10000;
+const unsigned long HUMIDITY_MIN_ON_MS = 300000;
+const unsigned long HUMIDITY_MIN_OFF_MS = 60000;
+const unsigned long HUMIDITY_MAX_ON_MS = 7200000;
+const unsigned long HUMIDITY_LOCKOUT_MS = 3600000;
+
+const char* humidity_boost_reason_name(int reason) {
+  return reason >= 0 && reason < HB_REASON_COUNT ? HB_REASON_NAMES[reason] : "unknown";
+}
+
+// Wetter of the two sensors, NAN if neither has a reading
+float humidity_boost_input(const Unit& u) {
+  float h = u.current_humidity;
+  if (u.reg_values[REG_INTERNAL_HUMIDITY].valid) {
+    float internal = u.reg_values[REG_INTERNAL_HUMIDITY].raw;
+    if (isnan(h) || internal > h) h = internal;
+  }
+  return h;
+}
+
+// Rise over the sample window, 0 until it has filled
+float humidity_boost_rise(const Unit& u) {
+  const HumidityBoost& hb = u.humidity_boost;
+  if (hb.rise_count < HUMIDITY_RISE_SAMPLES) return 0;
+  return hb.rise_samples[HUMIDITY_RISE_SAMPLES - 1] - hb.rise_samples[0];
+}
+
+void humidity_boost_event(Unit& u, bool on, int reason) {
+  u.humidity_boost.last_reason = reason;
+  outbox_event(u, EVENT_HUMIDITY_BOOST, reason << 1 | (on ? 1 : 0));
+}
+
+void humidity_boost_start(Unit& u, int reason, float h) {
+  HumidityBoost& hb = u.humidity_boost;
+  float before = hb.rise_count ? hb.rise_samples[0] : h;
+  hb.off_below = min(u.settings.humidity_setpoint - HUMIDITY_HYSTERESIS, before + HUMIDITY_HYSTERESIS);
+  hb.mode = u.settings.humidity_boost;
+  hb.owns_output = false;
+  if (hb.mode == 1) {
+    if (!u.relay_sw2_active) {
+      set_relay(u, 2, true);
+      u.relay_sw2_active = true;
+      mark_dirty(u, FIELD_SW2);
+      hb.owns_output = true;
+    }
+  } else {
+    hb.restore_speed = reg_int(u, REG_CURRENT_SPEED, 0);
+    if (hb.restore_speed < hb.mode) {
+      set_fan_speed(u, hb.mode);
+      hb.owns_output = true;
+    }
+  }
+  hb.state = HB_BOOST;
+  hb.started = hb.since = hal_millis();
+  hb.boosts++;
+  Serial.printf("%s: humidity boost on (%s): %.1f%%, off below %.1f%%\n",
+                u.node_id, HB_REASON_NAMES[reason], h, hb.off_below);
+  humidity_boost_event(u, true, reason);
+}
+
+void humidity_boost_stop(Unit& u, int reason) {
+  HumidityBoost& hb = u.humidity_boost;
+  if (hb.owns_output) {
+    if (hb.mode == 1) {
+      set_relay(u, 2, false);
+      u.relay_sw2_active = false;
+      mark_dirty(u, FIELD_SW2);
+    } else if (hb.restore_speed >= 1) {
+      set_fan_speed(u, hb.restore_speed);
+    }
   }
-  mqtt.loop();
+  hb.owns_output = false;
+  hb.state = HB_IDLE;
+  hb.since = hal_millis();
+  hb.lockout = reason == HB_REASON_MAX_ON || reason == HB_REASON_MANUAL;
+  Serial.printf("%s: humidity boost off (%s)\n", u.node_id, HB_REASON_NAMES[reason]);
+  humidity_boost_event(u, false, reason);
+}
+
+void add_humidity_boost(JsonObject out, const Unit& u) {
+  const HumidityBoost& hb = u.humidity_boost;
+  out["state"] = hb.state == HB_BOOST ? "boost" : hb.state == HB_OVERRUN ? "overrun" : "idle";
+  out["reason"] = humidity_boost_reason_name(hb.last_reason);
+  out["rise"] = humidity_boost_rise(u);
+  out["off_below"] = hb.off_below;
+  out["lockout"] = hb.lockout;
+  out["boosts"] = hb.boosts;
+}
+
+// A manual command wins: hand the outputs over as they are
+void humidity_boost_override(Unit& u) {
+  if (u.humidity_boost.state == HB_IDLE) return;
+  u.humidity_boost.owns_output = false;
+  humidity_boost_stop(u, HB_REASON_MANUAL);
+}
+
+void service_humidity_boost(Unit& u) {
+  HumidityBoost& hb = u.humidity_boost;
+  const Settings& settings = u.settings;
+  unsigned long now = hal_millis();
+  if (now - hb.last_tick < HUMIDITY_CONTROL_INTERVAL) return;
+  hb.last_tick = now;
+  
+  float h = humidity_boost_input(u);
+  if (!isnan(h) && (hb.rise_count == 0 || now - hb.last_rise_sample >= HUMIDITY_RISE_SAMPLE_MS)) {
+    if (hb.rise_count == HUMIDITY_RISE_SAMPLES) {
+      memmove(hb.rise_samples, hb.rise_samples + 1, sizeof(float) * (HUMIDITY_RISE_SAMPLES - 1));
+      hb.rise_count--;
+    }
+    hb.rise_samples[hb.rise_count++] = h;
+    hb.last_rise_sample = now;
+  }
+  bool rising = humidity_boost_rise(u) >= HUMIDITY_RISE_TRIGGER;
   
-  // Heartbeat
-  if (millis() - last_heartbeat > 5000) {
-    Serial.printf("Status - WiFi:%s MQTT:%s ExtRH:%.1f%% IntRH:%d%% Runtime:%dh Filter:%dh\n",
-                  WiFi.status() == WL_CONNECTED ? "OK" : "X",
-                  mqtt.connected() ? "OK" : "X",
-                  current_humidity,
-                  internal_humidity,
-                  runtime_hours,
-                  filter_remaining);
-    last_heartbeat = millis();
+  if (hb.state != HB_IDLE && settings.humidity_boost != hb.mode) {
+    humidity_boost_stop(u, HB_REASON_SETTINGS);
+    return;
+  }
+  if (settings.humidity_boost == 0) return;
+  
+  switch (hb.state) {
+    case HB_IDLE:
+      if (isnan(h)) break;
+      if (hb.lockout && (h < hb.off_below || now - hb.since >= HUMIDITY_LOCKOUT_MS)) hb.lockout = false;
+      if (hb.lockout || now - hb.since < HUMIDITY_MIN_OFF_MS) break;
+      if (rising) humidity_boost_start(u, HB_REASON_RISE, h);
+      else if (h >= settings.humidity_setpoint) humidity_boost_start(u, HB_REASON_SETPOINT, h);
+      break;
+    case HB_BOOST:
+      if (now - hb.started >= HUMIDITY_MAX_ON_MS) {
+        humidity_boost_stop(u, HB_REASON_MAX_ON);
+      } else if (now - hb.started < HUMIDITY_MIN_ON_MS) {
+        break;
+      } else if (isnan(h)) {
+        humidity_boost_stop(u, HB_REASON_NO_DATA);
+      } else if (h < hb.off_below) {
+        if (hb.mode == 1 || settings.wetroom_overrun == 0) {
+          humidity_boost_stop(u, HB_REASON_CLEARED);
+        } else {
+          hb.state = HB_OVERRUN;
+          hb.since = now;
+          Serial.printf("%s: humidity cleared, overrun %d min\n", u.node_id, settings.wetroom_overrun);
+        }
+      }
+      break;
+    case HB_OVERRUN:
+      if (!isnan(h) && (rising || h >= hb.off_below + HUMIDITY_HYSTERESIS)) {
+        hb.state = HB_BOOST;  // wet again: same boost, no new event
+        hb.since = now;
+      } else if (now - hb.since >= (unsigned long)settings.wetroom_overrun * 60000UL) {
+        humidity_boost_stop(u, HB_REASON_CLEARED);
+      }
+      break;
   }
+}
+
+// ========== MAIN LOOP ==========
+// Bus side: RS485 scheduling, framing and decoding for every unit. Runs as
+// its own task with TITON_DUAL_CORE, otherwise from loop().
+void bus_loop() {
+  PROFILE_LOOP_BEGIN();
   
-  // NEW: Rotating sensor poll (one sensor every 2 seconds)
-  poll_mvhr_sensors();
+  // Next write or due read for each free line (see bus_schedule)
+  for (Unit& u : units) bus_service_commands(u);
+  bus_units.schedule();
+  PROFILE_LAP(STAGE_POLL);
   
   // Read RS485 (always in receive mode unless transmitting)
-  while (Serial2.available()) {
-    char c = Serial2.read();
-    
-    if (c == '\n' || c == '\r') {
-      if (rx_buffer.length() > 0) {
-        Serial.printf("RS485 RX: %s\n", rx_buffer.c_str());
-        parse_response(rx_buffer);
-        rx_buffer = "";
-      }
-    } else if (c >= 32 && c <= 126) {
-      rx_buffer += c;
-      if (rx_buffer.length() > 100) rx_buffer = "";
+  bus_units.receive();
+  PROFILE_LAP(STAGE_RX);
+  
+  // Advance the RS485 transaction engines (TX turnaround, timeouts, retries)
+  bus_units.service();
+  for (Unit& u : units) bus_publish_status(u);
+  PROFILE_LAP(STAGE_RS485);
+  
+  PROFILE_LOOP_END(bus_profile);
+#if TITON_PROFILE
+  profile_bus_handoff();
+#endif
+}
+
+// One heartbeat line per unit
+void unit_heartbeat(Unit& u) {
+  Serial.printf("%s - WiFi:%s MQTT:%s ExtRH:%.1f%% IntRH:%d%% Runtime:%dh Filter:%dh\n",
+                u.node_id,
+                hal_wifi_connected() ? "OK" : "X",
+                mqtt.connected() ? "OK" : "X",
+                u.current_humidity,
+                reg_int(u, REG_INTERNAL_HUMIDITY, -1),
+                reg_int(u, REG_RUNTIME_HOURS, 0),
+                reg_int(u, REG_FILTER_REMAINING, 0));
+}
+
+// Changed fields as soon as they arrive plus a periodic full snapshot, or
+// the whole document every PUBLISH_INTERVAL
+void unit_publish(Unit& u) {
+  if (u.state_delta_mode) {
+    if (u.full_snapshot_pending || hal_millis() - u.last_full_publish > FULL_SNAPSHOT_INTERVAL) {
+      publish_state(u, true);
+      u.full_snapshot_pending = !mqtt.connected();
+    } else if (u.state_dirty && hal_millis() - u.last_mqtt_publish > DELTA_MIN_INTERVAL) {
+      publish_state(u, false);
     }
+  } else if (hal_millis() - u.last_mqtt_publish > PUBLISH_INTERVAL) {
+    publish_state(u, true);
   }
+}
+
+// Network side: Wi-Fi, MQTT, JSON, relays and the humidity sensors
+void net_loop() {
+  PROFILE_LOOP_BEGIN();
+  
+  // Wi-Fi / MQTT connection state machine (never blocks on the network)
+  net_service();
+  PROFILE_LAP(STAGE_NET);
+  
+  // Register values decoded by the bus side, and write readback results
+  for (Unit& u : units) {
+    apply_register_updates(u);
+    publish_write_results(u);
+  }
+  PROFILE_LAP(STAGE_UPDATES);
   
-  // Read external humidity sensor
-  if (millis() - last_humidity_read > HUMIDITY_READ_INTERVAL) {
-    current_humidity = read_humidity();
-    last_humidity_read = millis();
+  // Heartbeat
+  if (hal_millis() - last_heartbeat > 5000) {
+    for (Unit& u : units) unit_heartbeat(u);
+    last_heartbeat = hal_millis();
   }
+  PROFILE_LAP(STAGE_HEARTBEAT);
+  
+  // Fire due relay-off edges and deferred commands; settings sync and commits
+  for (Unit& u : units) service_relays(u);
+  timer_service();
+  for (Unit& u : units) settings_service(u);
+  PROFILE_LAP(STAGE_TIMERS);
+  
+  // Fold new external humidity samples into the filters; local boost control
+  for (Unit& u : units) {
+    service_humidity(u);
+    service_humidity_boost(u);
+  }
+  PROFILE_LAP(STAGE_HUMIDITY);
   
-  // Publish state
-  if (millis() - last_mqtt_publish > PUBLISH_INTERVAL) {
-    publish_state();
-    last_mqtt_publish = millis();
+  // Publish state, then the backlog from broker outages and queued events, paced
+  for (Unit& u : units) {
+    unit_publish(u);
+    outbox_service(u);
+  }
+  PROFILE_LAP(STAGE_PUBLISH);
+  
+  // Home Assistant discovery, a few entities per pass after the first state
+  discovery_service();
+  PROFILE_LAP(STAGE_DISCOVERY);
+  
+  // Publish bus and loop latency diagnostics
+  if (hal_millis() - last_diagnostics_publish > DIAGNOSTICS_INTERVAL) {
+    for (Unit& u : units) publish_diagnostics(u);
+#if TITON_PROFILE
+    request_latency();
+#endif
+    last_diagnostics_publish = hal_millis();
   }
+#if TITON_PROFILE
+  publish_latency();
+#endif
+  PROFILE_LAP(STAGE_DIAGNOSTICS);
+  
+  PROFILE_LOOP_END(net_profile);
+}
+
+void loop() {
+#if !TITON_DUAL_CORE
+  bus_loop();
+#endif
+  net_loop();
+}
+
+// The host tools see Unit only as a declaration
+Unit& gateway_unit(int index) {
+  return units[index];
 }
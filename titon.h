@@ -0,0 +1,336 @@
+// Titon MVHR - Event-driven driver
+// The bus protocol, a cache of decoded values and the SW1-3 relays behind one
+// object, for sketches that want Titon data without titon.cpp's gateway
+// (titonesp.ino). I/O goes through titon_hal.h, so it also builds and runs
+// against the simulated controller on a Linux host.
+//
+// loop() never blocks. The driver owns the line: registers are polled on the
+// periods in TITON_REGISTERS, one transaction at a time with a reply timeout
+// and retries; writes wait in one slot per register (a burst collapses to the
+// latest value) and are read back and re-sent until the controller reports
+// them, except one-shot commands such as the factory reset. The transaction
+// queue, the write slots and the relay pulses are titon.cpp's own
+// (titon_bus.h). Callbacks fire only when a decoded value moves by at least
+// the register's deadband, so a sketch can publish on change instead of on a
+// timer. Public names follow the API titonesp.ino was written against.
+//
+// Several units can run from one ESP32, each on its own UART or sharing one
+// through separate transceivers; TitonUnits then decides which unit uses
+// each line next. titon.cpp's gateway runs its units on the same scheduler
+// (TitonBusUnits in titon_bus.h).
+
+#ifndef TITON_H
+#define TITON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "titon_hal.h"
+#include "titon_frame.h"
+#include "titon_registers.h"
+#include "titon_bus.h"
+
+#define NOT_SET -999
+
+typedef void (*TitonCallback)();
+typedef void (*TitonValueCallback)(RegisterId id, int32_t value);
+typedef void (*TitonPacketCallback)(uint8_t* packet, unsigned int length, char* direction);
+typedef void (*TitonDebugCallback)(const char* message);
+
+class titon;
+typedef void (*TitonUnitCallback)(titon& unit);  // for sketches driving several units
+
+class titon {
+public:
+  explicit titon(bool debug = false) : debug_(debug) {
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      value_[i] = 0;
+      valid_[i] = false;
+      reported_[i] = 0;
+      next_poll_[i] = 0;
+      last_ok_[i] = 0;
+    }
+    line_.set_callbacks(this, on_transmit, on_log);
+    writes_.set_callback(this, on_write_result);
+  }
+
+  // ========== SETUP ==========
+  // MAX485 wiring as in titon.cpp; DE and RE may share a pin unless the UART
+  // is shared with another unit (see TitonUnits)
+  void connect(int rx_pin = 16, int tx_pin = 17, int de_pin = 4, int re_pin = 4, int uart = HAL_UART_BUS) {
+    line_.begin(rx_pin, tx_pin, de_pin, re_pin, uart);
+    unsigned long now = hal_millis();
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      next_poll_[i] = now;
+      last_ok_[i] = now;
+    }
+    connected_ = true;
+  }
+
+  // SW1 (SUMMERboost disable), SW2 (wet room boost), SW3 (kitchen boost)
+  void setRelayPins(int sw1, int sw2, int sw3) { relays_.begin(sw1, sw2, sw3); }
+
+  void setStatusChangedCallback(TitonCallback cb) { status_cb_ = cb; }
+  void setTemperatureChangedCallback(TitonCallback cb) { temperature_cb_ = cb; }
+  void setValueChangedCallback(TitonValueCallback cb) { value_cb_ = cb; }
+  void setPacketCallback(TitonPacketCallback cb) { packet_cb_ = cb; }
+  void setDebugPrintCallback(TitonDebugCallback cb) { debug_cb_ = cb; }
+  void setStatusChangedCallback(TitonUnitCallback cb) { status_unit_cb_ = cb; }
+  void setTemperatureChangedCallback(TitonUnitCallback cb) { temperature_unit_cb_ = cb; }
+  void setDebug(bool debug) { debug_ = debug; }
+
+  // ========== LOOP ==========
+  // Single unit; with several, call TitonUnits::loop() instead
+  void loop() {
+    if (!connected_) return;
+    receive();
+    if (line_.idle()) schedule();
+    line_.service();
+    service_relays();
+  }
+
+  // ========== STATE ==========
+  // Readings are NOT_SET until the first reply
+  bool isValid(RegisterId id) const { return valid_[id]; }
+  int32_t getRaw(RegisterId id) const { return valid_[id] ? value_[id] : NOT_SET; }
+
+  float getOutsideTemp() const { return tenths(REG_FRESH_AIR_IN_TEMP); }
+  float getInsideTemp() const { return tenths(REG_STALE_AIR_IN_TEMP); }
+  float getIncomingTemp() const { return tenths(REG_SUPPLY_TEMP); }
+  float getExhaustTemp() const { return tenths(REG_STALE_AIR_OUT_TEMP); }
+  float getExtractTemp() const { return tenths(REG_EXTRACT_TEMP); }
+  int getRh1() const { return getRaw(REG_INTERNAL_HUMIDITY); }
+  int getFanSpeed() const { return getRaw(REG_CURRENT_SPEED); }
+  int getStatusWord() const { return getRaw(REG_STATUS_WORD); }
+  int getRuntimeHours() const { return getRaw(REG_RUNTIME_HOURS); }
+  int getFilterRemaining() const { return getRaw(REG_FILTER_REMAINING); }
+  int getSupplyRpm() const { return getRaw(REG_SUPPLY_RPM); }
+  int getExtractRpm() const { return getRaw(REG_EXTRACT_RPM); }
+
+  bool isOn() const { return status(STATUS_ENGINE_RUNNING); }
+  bool isFault() const {
+    if (!valid_[REG_STATUS_WORD]) return false;
+    for (int i = 0; i < STATUS_BIT_COUNT; i++) {
+      if (TITON_STATUS_BITS[i].is_fault && (value_[REG_STATUS_WORD] & TITON_STATUS_BITS[i].mask)) return true;
+    }
+    return false;
+  }
+  bool isSwitchActive() const {
+    return status(STATUS_SWITCH1_ACTIVE) || status(STATUS_SWITCH2_ACTIVE) || status(STATUS_SWITCH3_ACTIVE);
+  }
+  bool isSummerMode() const { return valid_[REG_BYPASS_FLAGS] && (value_[REG_BYPASS_FLAGS] & 0x01); }
+  bool isSummerBoost() const { return valid_[REG_BYPASS_FLAGS] && (value_[REG_BYPASS_FLAGS] & 0x02); }
+  bool isServiceNeeded() const { return valid_[REG_FILTER_REMAINING] && value_[REG_FILTER_REMAINING] <= 0; }
+  bool isRelayOn(int sw) const { return relays_.on(sw); }
+
+  // How far the stalest polled register is past its poll period (0 = all fresh)
+  unsigned long getMaxOverdueMs() const {
+    unsigned long now = hal_millis();
+    unsigned long worst = 0;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      uint32_t period = TITON_REGISTERS[i].poll_period_ms;
+      if (period == 0) continue;
+      unsigned long age = now - last_ok_[i];
+      if (age > period && age - period > worst) worst = age - period;
+    }
+    return worst;
+  }
+
+  // Counters from the shared engine, for diagnostics
+  const WriteCounters& getWriteCounters() const { return writes_.counters(); }
+  LineCounters getLineCounters() const { return line_.counters(); }
+
+  // ========== COMMANDS ==========
+  // Queued; false if the register is read-only or the value out of range
+  bool setFanSpeed(int speed) {
+    if (speed < 1 || speed > 4) return false;
+    return writeRegister(REG_CURRENT_SPEED, 1 << (speed - 1));  // one bit per speed
+  }
+  bool setBoostInhibit(bool inhibit) { return writeRegister(REG_BOOST_INHIBIT, inhibit ? 1 : 0); }
+  bool setSummerBypass(bool enabled) { return writeRegister(REG_SUMMER_BYPASS_ENABLE, enabled ? 1 : 0); }
+  bool setSummerBoost(bool enabled) { return writeRegister(REG_SUMMERBOOST_DISABLE, enabled ? 0 : 1); }  // INVERTED
+
+  bool writeRegister(RegisterId id, int32_t value) {
+    if (!TITON_REGISTERS[id].write_cmd) return false;
+    writes_.stage(id, value);
+    return true;
+  }
+
+  void setRelay(int sw, bool on) {
+    if (relays_.set(sw, on)) notify(status_cb_, status_unit_cb_);
+  }
+
+  // Closes the switch input for duration_ms; the controller runs its own
+  // overrun timer from the edge (SW2 = wet room boost, SW3 = kitchen boost)
+  void pulseRelay(int sw, unsigned long duration_ms) {
+    bool was_on = relays_.on(sw);
+    if (relays_.pulse(sw, duration_ms) && !was_on) notify(status_cb_, status_unit_cb_);
+  }
+  void setSwitchOn() { pulseRelay(2, TitonRelays::BOOST_PULSE_MS); }
+
+private:
+  template <typename> friend class TitonBusUnits;
+  friend class TitonUnits;
+
+  // ---- TitonBusUnits ----
+  TitonLine& line() { return line_; }
+  void service_line() { line_.service(); }
+
+  float tenths(RegisterId id) const { return valid_[id] ? value_[id] / 10.0f : NOT_SET; }
+  bool status(uint16_t mask) const { return valid_[REG_STATUS_WORD] && (value_[REG_STATUS_WORD] & mask); }
+
+  void debug(const char* message) {
+    if (debug_ && debug_cb_) debug_cb_(message);
+  }
+
+  void notify(TitonCallback cb, TitonUnitCallback unit_cb) {
+    if (cb) cb();
+    if (unit_cb) unit_cb(*this);
+  }
+
+  // ---- engine callbacks ----
+  static void on_transmit(void* ctx, const Rs485Txn& txn) {
+    titon& t = *(titon*)ctx;
+    if (t.packet_cb_) t.packet_cb_((uint8_t*)txn.cmd, (unsigned int)strlen(txn.cmd), (char*)"out");
+  }
+
+  static void on_log(void* ctx, const char* message) { ((titon*)ctx)->debug(message); }
+
+  static void on_poll(void* ctx, const Rs485Txn& txn, TxnResult result, int value) {
+    if (result == TXN_OK) ((titon*)ctx)->read_ok(register_slot(txn.expect_address), value);
+  }
+
+  static void on_readback(void* ctx, const Rs485Txn& txn, TxnResult result, int value) {
+    titon& t = *(titon*)ctx;
+    int reg = register_slot(txn.expect_address);
+    t.writes_.readback(reg, result, value);
+    if (result == TXN_OK) t.read_ok(reg, value);
+  }
+
+  static bool on_write_result(void* ctx, const WriteResult& r) {
+    titon& t = *(titon*)ctx;
+    if (r.outcome == WRITE_MISMATCH) t.debug("Write not taken by the controller");
+    else if (r.outcome == WRITE_TIMEOUT) t.debug("Write readback timed out");
+    return true;
+  }
+
+  // ---- transactions ----
+  // How long the most urgent job has been due in ms, negative if none is;
+  // verifies and writes outrank any poll. Matches what schedule() would send.
+  long urgency() const {
+    static constexpr long COMMAND_URGENCY = 0x40000000L;
+    if (writes_.readback_due() >= 0 || writes_.next() >= 0) return COMMAND_URGENCY;
+    unsigned long now = hal_millis();
+    long worst = -1;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      if (TITON_REGISTERS[i].poll_period_ms && (long)(now - next_poll_[i]) > worst) worst = (long)(now - next_poll_[i]);
+    }
+    return worst;
+  }
+
+  // Due readback first, then the oldest pending write, then the most urgent due poll
+  void schedule() {
+    int reg = writes_.readback_due();
+    if (reg >= 0) {
+      if (line_.read(TITON_REGISTERS[reg].read_cmd, on_readback)) writes_.readback_started(reg);
+      return;
+    }
+
+    reg = writes_.next();
+    if (reg >= 0) {
+      if (line_.write((RegisterId)reg, writes_.value(reg))) writes_.sent(reg);
+      return;
+    }
+
+    unsigned long now = hal_millis();
+    int best = -1;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      const RegisterDesc& desc = TITON_REGISTERS[i];
+      if (desc.poll_period_ms == 0 || (long)(now - next_poll_[i]) < 0) continue;
+      if (best < 0 || desc.poll_priority < TITON_REGISTERS[best].poll_priority ||
+          (desc.poll_priority == TITON_REGISTERS[best].poll_priority && (long)(next_poll_[i] - next_poll_[best]) < 0)) {
+        best = i;
+      }
+    }
+    if (best < 0) return;
+    next_poll_[best] = now + TITON_REGISTERS[best].poll_period_ms;
+    line_.read(TITON_REGISTERS[best].read_cmd, on_poll);
+  }
+
+  void receive() {
+    uint8_t chunk[16];
+    size_t n;
+    while ((n = hal_uart_read(chunk, sizeof(chunk), line_.uart())) > 0) {
+      framer_.feed(chunk, n);
+      TitonFrame frame{};
+      FrameStatus status;
+      while ((status = framer_.next(frame)) != FRAME_NONE) {
+        if (packet_cb_) packet_cb_((uint8_t*)framer_.line(), (unsigned int)strlen(framer_.line()), (char*)"in");
+        if (status == FRAME_OK || status == FRAME_SENSOR_FAULT) line_.on_frame(frame.address, frame.value);
+      }
+    }
+  }
+
+  // ---- results ----
+  // Cache the value and tell the sketch if it moved by its deadband
+  void read_ok(int reg, int32_t value) {
+    if (reg < 0) return;
+    writes_.confirm(reg, value);
+    value_[reg] = value;
+    valid_[reg] = true;
+    last_ok_[reg] = hal_millis();
+    const RegisterDesc& desc = TITON_REGISTERS[reg];
+    if (seen_[reg] && !register_moved(desc, reported_[reg], value)) return;
+    seen_[reg] = true;
+    reported_[reg] = value;
+    if (value_cb_) value_cb_((RegisterId)reg, value);
+    bool climate = desc.decode == DECODE_TENTHS || reg == REG_INTERNAL_HUMIDITY;
+    if (climate) notify(temperature_cb_, temperature_unit_cb_);
+    else notify(status_cb_, status_unit_cb_);
+  }
+
+  void service_relays() {
+    if (relays_.service()) notify(status_cb_, status_unit_cb_);
+  }
+
+  bool debug_;
+  bool connected_ = false;
+
+  TitonCallback status_cb_ = nullptr;
+  TitonCallback temperature_cb_ = nullptr;
+  TitonValueCallback value_cb_ = nullptr;
+  TitonPacketCallback packet_cb_ = nullptr;
+  TitonDebugCallback debug_cb_ = nullptr;
+  TitonUnitCallback status_unit_cb_ = nullptr;
+  TitonUnitCallback temperature_unit_cb_ = nullptr;
+
+  TitonFramer framer_;
+  TitonLine line_;
+  TitonWrites writes_;
+  TitonRelays relays_;
+
+  int32_t value_[REGISTER_COUNT];
+  bool valid_[REGISTER_COUNT];
+  bool seen_[REGISTER_COUNT] = {};
+  int32_t reported_[REGISTER_COUNT];
+  unsigned long next_poll_[REGISTER_COUNT];
+  unsigned long last_ok_[REGISTER_COUNT];  // last reply, for staleness
+};
+
+// ========== MULTIPLE UNITS ==========
+// Several connected units on one scheduler (see TitonBusUnits): separate
+// UARTs run in parallel, a shared UART goes to the most overdue unit.
+class TitonUnits : public TitonBusUnits<titon> {
+public:
+  // After connect(); false if full or the wiring can't share the UART
+  bool add(titon& unit) {
+    return unit.connected_ && TitonBusUnits<titon>::add(unit);
+  }
+
+  void loop() {
+    for (int i = 0; i < count(); i++) unit(i).service_relays();
+    TitonBusUnits<titon>::loop();
+  }
+};
+
+#endif  // TITON_H
@@ -0,0 +1,774 @@
+// Titon MVHR - RS485 bus engine
+// The protocol machinery titon.cpp's gateway and the titon driver class
+// (titon.h) both run, written once:
+// - TitonLine: the transaction queue for one MAX485 transceiver
+// - TitonWrites: one write slot per register, read back and retried
+// - TitonRelays: the SW1-3 switch inputs and their timed pulses
+// - TitonBusUnits: several units' lines, sharing UARTs where wired to
+// Everything goes through titon_hal.h, so it builds for the ESP32 and runs
+// against the simulated controller on a Linux host. Nothing here logs
+// directly; callers pass a callback.
+
+#ifndef TITON_BUS_H
+#define TITON_BUS_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "titon_hal.h"
+#include "titon_registers.h"
+
+// ========== PROTOCOL ==========
+const uint32_t TITON_BAUD = 1200;
+const unsigned long TITON_REPLY_TIMEOUT_MS = 350;  // 12 chars @ 1200 baud = 100 ms + controller turnaround
+const uint8_t TITON_RETRIES = 2;
+const int TITON_FRAME_CHARS = 12;                  // "AAAO+VVVVV\r\n" either way
+const unsigned long TITON_FRAME_MS = TITON_FRAME_CHARS * 10UL * 1000UL / TITON_BAUD;
+const float TITON_LINE_FRAMES_PER_S = TITON_BAUD / 10.0f / TITON_FRAME_CHARS;
+// A reply decodes at its CR; the LF is still on the wire, and a controller
+// with DE and RE on one pin can't hear a request until it has finished
+const unsigned long TITON_TURNAROUND_MS = (2 * 10UL * 1000UL + TITON_BAUD - 1) / TITON_BAUD;
+
+// "0301+00000" reads address 030: the first four digits are the address
+// followed by the opcode (1 = read, 0 = write).
+inline int titon_command_address(const char* cmd) {
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    if (cmd[i] < '0' || cmd[i] > '9') return -1;
+    v = v * 10 + (cmd[i] - '0');
+  }
+  return v / 10;
+}
+
+// ========== TRANSACTIONS ==========
+// Every command is queued as a transaction and driven by service(); nothing
+// here waits on the UART. Reads expect a reply from the register they
+// address and are re-issued on timeout; writes complete once sent.
+//
+// The line is half duplex, so normally one transaction is on the wire at a
+// time. With set_burst(true), reads queued back to back go out together in
+// one transmit window and their replies are matched as they come in, saving
+// a direction turnaround and controller turnaround per read. Whether the
+// controller holds its replies until the batch has been sent is found out at
+// runtime: a probe of two reads, then bursts of up to BURST_MAX while every
+// reply arrives. A failed probe or BURST_FAILURES short bursts in a row
+// switch back to one read per window. A window that gets no replies at all
+// counts as short: with DE and RE on one pin the controller's receiver is
+// off while it answers the first read, so it may never hear the rest. The
+// next probe is BURST_REPROBE_MS later, doubling after each failed probe up
+// to BURST_REPROBE_MAX_MS, so a controller that can't take bursts costs a
+// collision a day rather than one every ten minutes.
+enum TxnResult { TXN_OK, TXN_TIMEOUT, TXN_FAULT };  // FAULT = controller answered -99999
+
+struct Rs485Txn;
+typedef void (*TxnCallback)(void* ctx, const Rs485Txn& txn, TxnResult result, int value);
+
+struct Rs485Txn {
+  char cmd[16];
+  int expect_address;          // -1 = no reply expected (writes)
+  uint8_t retries_left;
+  unsigned long sent_at;       // hal_millis() when transmission started
+  unsigned long deadline;      // hal_millis() by which the reply must arrive
+  TxnCallback on_complete;
+};
+
+enum BurstMode : uint8_t { BURST_PROBE, BURST_ON, BURST_OFF };
+const char* const BURST_MODE_NAMES[] = { "probe", "on", "off" };
+
+// Our traffic on the line: frames sent and answered while transactions were
+// queued, against TITON_LINE_FRAMES_PER_S
+struct LineCounters {
+  uint32_t frames;
+  uint32_t busy_ms;
+  uint8_t burst_mode;
+  uint32_t bursts;
+  uint32_t burst_failures;     // bursts that lost replies
+  uint32_t reprobe_ms;         // wait before the next probe once bursts are off
+  uint32_t sweep_ms;           // first read of every polled register, 0 = not yet
+};
+
+struct RegisterStats {
+  uint32_t ok;
+  uint32_t timeouts;           // transactions that exhausted their retries
+  uint32_t retries;
+  uint32_t faults;             // -99999 replies
+  uint32_t last_latency_ms;
+  uint32_t max_latency_ms;
+  uint32_t total_latency_ms;
+};
+
+class TitonLine {
+public:
+  static constexpr int QUEUE_SIZE = 8;
+  static constexpr int BURST_MAX = 5;
+  static constexpr uint8_t BURST_FAILURES = 3;
+  static constexpr unsigned long BURST_REPROBE_MS = 600000;
+  static constexpr unsigned long BURST_REPROBE_MAX_MS = 76800000;  // 128 x 10 min
+
+  typedef void (*TxCallback)(void* ctx, const Rs485Txn& txn);  // as each transaction goes out
+  typedef void (*LogCallback)(void* ctx, const char* message);
+
+  TitonLine() : queue_(), counters_(), stats_() { counters_.burst_mode = BURST_OFF; }
+
+  // MAX485 on a UART; DE and RE may share a pin
+  void begin(int rx_pin, int tx_pin, int de_pin, int re_pin, int uart = HAL_UART_BUS) {
+    de_pin_ = de_pin;
+    re_pin_ = re_pin;
+    uart_ = uart;
+    hal_uart_begin(TITON_BAUD, rx_pin, tx_pin, uart_);
+    hal_gpio_output(de_pin_);
+    hal_gpio_output(re_pin_);
+    receive_mode();
+  }
+
+  void set_callbacks(void* ctx, TxCallback on_transmit, LogCallback log) {
+    ctx_ = ctx;
+    on_transmit_ = on_transmit;
+    log_ = log;
+  }
+
+  // Off by default: one read per transmit window
+  void set_burst(bool enabled) {
+    burst_ = enabled;
+    counters_.burst_mode = enabled ? BURST_PROBE : BURST_OFF;
+  }
+
+  // ---- queueing ----
+  bool enqueue(const char* cmd, bool expect_reply, uint8_t retries, TxnCallback on_complete) {
+    if (count_ >= QUEUE_SIZE) {
+      log("RS485 queue full, dropping %.10s", cmd);
+      return false;
+    }
+    if (count_ == 0) busy_since_ = hal_millis();
+    Rs485Txn& t = at(count_);
+    size_t n = strnlen(cmd, sizeof(t.cmd) - 1);
+    memcpy(t.cmd, cmd, n);
+    t.cmd[n] = '\0';
+    t.expect_address = expect_reply ? titon_command_address(cmd) : -1;
+    t.retries_left = retries;
+    t.sent_at = 0;
+    t.deadline = 0;
+    t.on_complete = on_complete;
+    count_++;
+    return true;
+  }
+
+  bool read(const char* cmd, TxnCallback on_complete) {
+    return enqueue(cmd, true, TITON_RETRIES, on_complete);
+  }
+
+  bool write(RegisterId id, int32_t value) {
+    const RegisterDesc& reg = TITON_REGISTERS[id];
+    if (!reg.write_cmd) return false;
+    char cmd[16];
+    snprintf(cmd, sizeof(cmd), "%s%c%05ld\r\n", reg.write_cmd, value < 0 ? '-' : '+', (long)(value < 0 ? -value : value));
+    return enqueue(cmd, false, TITON_RETRIES, nullptr);
+  }
+
+  int queued() const { return count_; }
+  bool idle() const { return count_ == 0; }
+
+  // Reads that may share the next transmit window
+  int burst_limit() {
+    if (!burst_) return 1;
+    switch (counters_.burst_mode) {
+      case BURST_ON:
+        return BURST_MAX;
+      case BURST_PROBE:
+        return 2;
+      default:
+        if (hal_millis() - burst_off_at_ < counters_.reprobe_ms) return 1;
+        counters_.burst_mode = BURST_PROBE;
+        return 2;
+    }
+  }
+
+  // ---- line ----
+  // Called from the RX path for every decoded frame; true if it answered an
+  // outstanding read
+  bool on_frame(int address, int32_t value) {
+    if (state_ == AWAIT_REPLY) {
+      for (int i = 0; i < inflight_; i++) {
+        if (at(i).expect_address != address) continue;
+        complete(i, value == -99999 ? TXN_FAULT : TXN_OK, value);
+        window_answered_++;
+        quiet_at_ = hal_millis() + TITON_TURNAROUND_MS;
+        if (window_ > 1 && inflight_ == 0) burst_result(true);
+        return true;
+      }
+    }
+    unsolicited_++;
+    return false;
+  }
+
+  // Turnaround, timeouts and retries; the next window goes out only while
+  // line_quiet (nobody else is mid-exchange)
+  void service(bool line_quiet = true) {
+    if (state_ == TRANSMITTING) {
+      if ((long)(hal_micros() - tx_done_us_) < 0) return;
+      receive_mode();
+      if (at(0).expect_address < 0) {
+        complete(0, TXN_OK, 0);
+        return;
+      }
+      // Replies to a burst come one after another
+      unsigned long deadline = hal_millis() + TITON_REPLY_TIMEOUT_MS + (inflight_ - 1) * TITON_FRAME_MS;
+      for (int i = 0; i < inflight_; i++) at(i).deadline = deadline;
+      state_ = AWAIT_REPLY;
+      return;
+    }
+
+    if (state_ == AWAIT_REPLY) {
+      if ((long)(hal_millis() - at(0).deadline) < 0) return;
+      if (window_ > 1) burst_result(false);
+      timeout();
+      // fall through: a retry goes out as soon as the line is quiet
+    }
+
+    if (count_ == 0 || !line_quiet || (long)(hal_millis() - quiet_at_) < 0) return;
+    int limit = burst_limit();
+    if (limit > count_) limit = count_;
+    int count = 1;
+    while (count < limit && at(0).expect_address >= 0 && at(count).expect_address >= 0) count++;
+    transmit(count);
+  }
+
+  void transmit_mode() {
+    hal_gpio_write(de_pin_, true);   // Enable driver
+    hal_gpio_write(re_pin_, true);   // Disable receiver
+    hal_delay_us(10);                // Small delay for switching
+  }
+
+  void receive_mode() {
+    hal_delay_us(10);                // Wait for transmission to complete
+    hal_gpio_write(de_pin_, false);  // Disable driver
+    hal_gpio_write(re_pin_, false);  // Enable receiver
+  }
+
+  // Driver and receiver both off, so another transceiver has the UART
+  void off() {
+    hal_gpio_write(de_pin_, false);
+    hal_gpio_write(re_pin_, true);
+  }
+
+  int uart() const { return uart_; }
+  bool pins_shared() const { return de_pin_ == re_pin_; }
+
+  // ---- counters ----
+  const RegisterStats& stats(int reg) const { return stats_[reg]; }
+  uint32_t unsolicited() const { return unsolicited_; }
+  void set_sweep_ms(uint32_t ms) { counters_.sweep_ms = ms; }
+
+  // busy_ms includes the stretch still in progress
+  LineCounters counters() const {
+    LineCounters c = counters_;
+    if (count_ > 0) c.busy_ms += hal_millis() - busy_since_;
+    return c;
+  }
+
+private:
+  enum State { IDLE, TRANSMITTING, AWAIT_REPLY };
+
+  // i-th queued transaction, 0 = head
+  Rs485Txn& at(int i) { return queue_[(head_ + i) % QUEUE_SIZE]; }
+  const Rs485Txn& at(int i) const { return queue_[(head_ + i) % QUEUE_SIZE]; }
+
+  RegisterStats* stats_for(int address) {
+    int slot = register_slot(address);
+    return slot >= 0 ? &stats_[slot] : nullptr;
+  }
+
+  void log(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    if (!log_) return;
+    char message[64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    log_(ctx_, message);
+  }
+
+  void burst_result(bool complete) {
+    counters_.bursts++;
+    if (complete) {
+      burst_failed_ = 0;
+      probe_failed_ = false;
+      if (counters_.burst_mode == BURST_PROBE) log("RS485 controller answers bursts, batching reads");
+      counters_.burst_mode = BURST_ON;
+      return;
+    }
+    counters_.burst_failures++;
+    bool probe = counters_.burst_mode == BURST_PROBE;
+    if (++burst_failed_ < BURST_FAILURES && !probe) return;
+    // Backs off only while probes keep failing; bursts that worked for a
+    // while get the short wait again
+    if (!probe || !probe_failed_) counters_.reprobe_ms = BURST_REPROBE_MS;
+    else if (counters_.reprobe_ms < BURST_REPROBE_MAX_MS) counters_.reprobe_ms *= 2;
+    probe_failed_ = probe;
+    log("RS485 bursts lose replies, reprobe in %lu min", (unsigned long)(counters_.reprobe_ms / 60000));
+    counters_.burst_mode = BURST_OFF;
+    burst_off_at_ = hal_millis();
+    burst_failed_ = 0;
+  }
+
+  // Sends the first `count` queued transactions in one transmit window
+  void transmit(int count) {
+    char buffer[BURST_MAX * sizeof(Rs485Txn::cmd)];
+    size_t len = 0;
+    unsigned long now = hal_millis();
+    for (int i = 0; i < count; i++) {
+      Rs485Txn& t = at(i);
+      size_t n = strlen(t.cmd);
+      memcpy(buffer + len, t.cmd, n);
+      len += n;
+      t.sent_at = now;
+      if (on_transmit_) on_transmit_(ctx_, t);
+    }
+    transmit_mode();
+    hal_uart_write((const uint8_t*)buffer, len, uart_);
+    // 10 bits per character on the wire; turn the driver off once the last
+    // stop bit has left instead of blocking on a UART flush.
+    tx_done_us_ = hal_micros() + (unsigned long)(len * 10UL * 1000000UL / TITON_BAUD) + 500;
+    inflight_ = window_ = count;
+    window_answered_ = 0;
+    state_ = TRANSMITTING;
+  }
+
+  // Completes the i-th in-flight transaction; the rest keep their order
+  void complete(int index, TxnResult result, int value) {
+    Rs485Txn t = at(index);
+    for (int i = index; i > 0; i--) at(i) = at(i - 1);
+    head_ = (head_ + 1) % QUEUE_SIZE;
+    count_--;
+    if (inflight_ > 0) inflight_--;
+    if (inflight_ == 0) state_ = IDLE;
+    if (count_ == 0) counters_.busy_ms += hal_millis() - busy_since_;
+
+    if (t.expect_address >= 0) {
+      if (result != TXN_TIMEOUT) counters_.frames += 2;
+      RegisterStats* s = stats_for(t.expect_address);
+      if (s) {
+        if (result == TXN_OK) {
+          uint32_t latency = hal_millis() - t.sent_at;
+          s->ok++;
+          s->last_latency_ms = latency;
+          s->total_latency_ms += latency;
+          if (latency > s->max_latency_ms) s->max_latency_ms = latency;
+        } else if (result == TXN_FAULT) {
+          s->faults++;
+        } else {
+          s->timeouts++;
+        }
+      }
+    } else {
+      counters_.frames++;
+    }
+
+    if (t.on_complete) t.on_complete(ctx_, t, result, value);
+  }
+
+  // Reads still unanswered at the deadline go back to the queue for another
+  // window, or fail once out of retries
+  void timeout() {
+    int remaining = inflight_;
+    inflight_ = 0;
+    state_ = IDLE;
+    for (int i = 0; i < remaining;) {
+      Rs485Txn& t = at(i);
+      if (t.retries_left == 0) {
+        log("⚠️  RS485 no reply from %03d", t.expect_address);
+        complete(i, TXN_TIMEOUT, 0);
+        remaining--;
+        continue;
+      }
+      t.retries_left--;
+      RegisterStats* s = stats_for(t.expect_address);
+      if (s) s->retries++;
+      log("RS485 timeout on %03d, retrying", t.expect_address);
+      i++;
+    }
+  }
+
+  int de_pin_ = -1;
+  int re_pin_ = -1;
+  int uart_ = HAL_UART_BUS;
+  void* ctx_ = nullptr;
+  TxCallback on_transmit_ = nullptr;
+  LogCallback log_ = nullptr;
+  bool burst_ = false;
+
+  Rs485Txn queue_[QUEUE_SIZE];
+  int head_ = 0;               // index of the first in-flight / next transaction
+  int count_ = 0;
+  int inflight_ = 0;           // transactions from the head sent in the current window
+  int window_ = 0;             // how many went out in it
+  int window_answered_ = 0;
+  State state_ = IDLE;
+  unsigned long tx_done_us_ = 0;
+  unsigned long quiet_at_ = 0;    // hal_millis() the last reply is off the line
+  unsigned long busy_since_ = 0;  // hal_millis() the queue last went non-empty
+  uint8_t burst_failed_ = 0;      // short bursts in a row
+  bool probe_failed_ = false;     // bursts went off after a probe, not after working
+  unsigned long burst_off_at_ = 0;
+  uint32_t unsolicited_ = 0;      // frames that matched no outstanding read
+  LineCounters counters_;
+  RegisterStats stats_[REGISTER_COUNT];  // indexed by RegisterId
+};
+
+// ========== WRITES ==========
+// Register writes wait in one slot per register rather than in the
+// transaction queue, so a burst of commands (a slider drag, a chatty
+// automation) collapses to the latest value per register. A write equal to
+// the value last read back from the controller is dropped.
+//
+// Every write is then checked by reading the register back VERIFY_DELAY_MS
+// after it went out. A mismatch or a readback timeout re-sends it, up to
+// VERIFY_ATTEMPTS writes in all, and the outcome goes to the result
+// callback. Command registers (RegisterDesc::command) are neither
+// deduplicated nor read back.
+enum WriteOutcome : uint8_t { WRITE_OK, WRITE_MISMATCH, WRITE_TIMEOUT, WRITE_SUPERSEDED };
+const char* const WRITE_OUTCOME_NAMES[] = { "ok", "mismatch", "timeout", "superseded" };
+
+struct WriteCounters {
+  uint32_t sent;
+  uint32_t coalesced;          // replaced a pending write to the same register
+  uint32_t suppressed;         // equal to the value last read from the controller
+  uint32_t retries;            // re-sent after a failed readback
+  uint32_t failed;             // gave up: mismatch or timeout
+  uint32_t result_drops;       // the result callback couldn't take it
+};
+
+struct WriteResult {
+  uint8_t reg;
+  uint8_t outcome;
+  uint8_t attempts;
+  int32_t value;               // as written
+  int32_t readback;            // last value read, 0 on timeout
+};
+
+class TitonWrites {
+public:
+  static constexpr uint8_t VERIFY_ATTEMPTS = 3;
+  static constexpr unsigned long VERIFY_DELAY_MS = 400;  // ~100 ms on the wire + time to apply
+
+  typedef bool (*ResultCallback)(void* ctx, const WriteResult& result);  // false = dropped
+
+  TitonWrites() : pending_(), verify_(), confirmed_(), confirmed_valid_(), counters_() {}
+
+  void set_callback(void* ctx, ResultCallback on_result) {
+    ctx_ = ctx;
+    on_result_ = on_result;
+  }
+
+  // The controller reported this value
+  void confirm(int reg, int32_t value) {
+    confirmed_[reg] = value;
+    confirmed_valid_[reg] = true;
+  }
+
+  // Someone else changed the register: unknown until read again
+  void forget(int reg) { confirmed_valid_[reg] = false; }
+
+  void stage(int reg, int32_t value) {
+    Pending& w = pending_[reg];
+    bool redundant = !TITON_REGISTERS[reg].command && confirmed_valid_[reg] &&
+                     confirmed_[reg] == register_readback((RegisterId)reg, value);
+    if (w.pending) {
+      counters_.coalesced++;
+      w.value = value;
+      if (redundant) {  // dragged back to where the controller already is
+        w.pending = false;
+        counters_.suppressed++;
+      }
+    } else if (redundant) {
+      counters_.suppressed++;
+    } else {
+      w = Pending{ true, value, seq_++ };
+    }
+  }
+
+  // Oldest pending write, or -1
+  int next() const {
+    int best = -1;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      if (!pending_[i].pending) continue;
+      if (best < 0 || (int32_t)(pending_[i].seq - pending_[best].seq) < 0) best = i;
+    }
+    return best;
+  }
+
+  int32_t value(int reg) const { return pending_[reg].value; }
+
+  // The write went out; a different value replaces the one being verified
+  void sent(int reg) {
+    Pending& w = pending_[reg];
+    w.pending = false;
+    confirmed_valid_[reg] = false;  // unknown until read back
+    counters_.sent++;
+    if (TITON_REGISTERS[reg].command) return;  // a command doesn't read back
+
+    Verify& v = verify_[reg];
+    if (v.active && v.value != w.value) finish(reg, WRITE_SUPERSEDED, 0);
+    if (!v.active) v.attempts = 0;
+    v.active = true;
+    v.reading = false;
+    v.value = w.value;
+    v.attempts++;
+    v.due = hal_millis() + VERIFY_DELAY_MS;
+  }
+
+  // First register whose readback is due, or -1. A register with a write
+  // still pending (a retry or a newer command) is read after it.
+  int readback_due() const {
+    unsigned long now = hal_millis();
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+      const Verify& v = verify_[i];
+      if (!v.active || v.reading || pending_[i].pending || (long)(now - v.due) < 0) continue;
+      return i;
+    }
+    return -1;
+  }
+
+  void readback_started(int reg) { verify_[reg].reading = true; }
+
+  void readback(int reg, TxnResult result, int32_t value) {
+    if (reg < 0 || !verify_[reg].active) return;
+    Verify& v = verify_[reg];
+    v.reading = false;
+
+    if (result == TXN_OK && value == register_readback((RegisterId)reg, v.value)) {
+      finish(reg, WRITE_OK, value);
+    } else if (pending_[reg].pending) {
+      finish(reg, WRITE_SUPERSEDED, value);  // a newer command gets verified instead
+    } else if (v.attempts >= VERIFY_ATTEMPTS) {
+      if (result == TXN_TIMEOUT) finish(reg, WRITE_TIMEOUT, 0);
+      else finish(reg, WRITE_MISMATCH, value);
+    } else {
+      pending_[reg] = Pending{ true, v.value, seq_++ };
+      counters_.retries++;
+    }
+  }
+
+  const WriteCounters& counters() const { return counters_; }
+
+private:
+  struct Pending {
+    bool pending;
+    int32_t value;
+    uint32_t seq;              // arrival order of the first write coalesced here
+  };
+
+  struct Verify {
+    bool active;
+    bool reading;              // readback queued or on the wire
+    uint8_t attempts;          // writes sent so far
+    int32_t value;
+    unsigned long due;
+  };
+
+  void finish(int reg, WriteOutcome outcome, int32_t readback) {
+    Verify& v = verify_[reg];
+    v.active = false;
+    if (outcome == WRITE_MISMATCH || outcome == WRITE_TIMEOUT) counters_.failed++;
+    WriteResult r{ (uint8_t)reg, (uint8_t)outcome, v.attempts, v.value, readback };
+    if (on_result_ && !on_result_(ctx_, r)) counters_.result_drops++;
+  }
+
+  Pending pending_[REGISTER_COUNT];
+  Verify verify_[REGISTER_COUNT];
+  int32_t confirmed_[REGISTER_COUNT];      // last value read from the controller
+  bool confirmed_valid_[REGISTER_COUNT];   // cleared when we write the register
+  uint32_t seq_ = 0;
+  WriteCounters counters_;
+  void* ctx_ = nullptr;
+  ResultCallback on_result_ = nullptr;
+};
+
+// ========== RELAYS ==========
+// SW1 (SUMMERboost disable), SW2 (wet room boost), SW3 (kitchen boost). A
+// pulse closes the input and opens it again after the given time; the
+// controller runs its own overrun timer from the edge.
+class TitonRelays {
+public:
+  static constexpr int COUNT = 3;
+  static constexpr unsigned long BOOST_PULSE_MS = 2000;
+
+  TitonRelays() {
+    for (int i = 0; i < COUNT; i++) {
+      pin_[i] = -1;
+      on_[i] = false;
+      timed_[i] = false;
+      off_at_[i] = 0;
+    }
+  }
+
+  // -1 = not fitted; fitted outputs start open
+  void begin(int sw1, int sw2, int sw3) {
+    int pins[COUNT] = { sw1, sw2, sw3 };
+    for (int i = 0; i < COUNT; i++) {
+      pin_[i] = pins[i];
+      if (pins[i] < 0) continue;
+      hal_gpio_output(pins[i]);
+      hal_gpio_write(pins[i], false);
+    }
+  }
+
+  // Cancels a pulse in progress; true if the output changed
+  bool set(int sw, bool on) {
+    if (sw < 1 || sw > COUNT || pin_[sw - 1] < 0) return false;
+    timed_[sw - 1] = false;
+    if (on_[sw - 1] == on) return false;
+    on_[sw - 1] = on;
+    hal_gpio_write(pin_[sw - 1], on);
+    return true;
+  }
+
+  // A new pulse restarts one in progress; false if the switch isn't fitted
+  bool pulse(int sw, unsigned long duration_ms) {
+    if (sw < 1 || sw > COUNT || pin_[sw - 1] < 0) return false;
+    set(sw, true);
+    timed_[sw - 1] = true;
+    off_at_[sw - 1] = hal_millis() + duration_ms;
+    return true;
+  }
+
+  bool on(int sw) const { return sw >= 1 && sw <= COUNT && on_[sw - 1]; }
+
+  // Opens the inputs whose pulse has run out: bit sw set for each
+  int service() {
+    unsigned long now = hal_millis();
+    int ended = 0;
+    for (int i = 0; i < COUNT; i++) {
+      if (!timed_[i] || (long)(now - off_at_[i]) < 0) continue;
+      set(i + 1, false);
+      ended |= 1 << (i + 1);
+    }
+    return ended;
+  }
+
+private:
+  int pin_[COUNT];
+  bool on_[COUNT];
+  bool timed_[COUNT];
+  unsigned long off_at_[COUNT];
+};
+
+// ========== MULTIPLE UNITS ==========
+// One loop for several units' lines. Units on separate UARTs run their
+// transactions in parallel; units sharing a UART take turns, one transaction
+// at a time, and each free line goes to the unit whose most urgent job is
+// the most overdue (earliest deadline first), so every unit's staleness
+// stays bounded by the line's load rather than by its position in the list.
+// A shared UART needs DE and RE on separate pins per unit so the idle
+// transceivers can release the RX line.
+//
+// Unit is the caller's per-unit type. It provides:
+//   TitonLine& line()        its transceiver, begun before add()
+//   void receive()           reads the UART into its framer
+//   void service_line()      line().service(), with its own line-quiet test
+//   long urgency()           ms its most urgent job has been due, negative if none
+//   void schedule()          queues that job (or the next best)
+//   void debug(const char*)  wiring errors from add()
+template <typename Unit>
+class TitonBusUnits {
+public:
+  static constexpr int MAX_UNITS = 8;
+
+  // False if full or the wiring can't share the UART
+  bool add(Unit& unit) {
+    if (count_ == MAX_UNITS) return false;
+    TitonLine& line = unit.line();
+    bool shared = false;
+    for (int i = 0; i < count_; i++) {
+      TitonLine& other = units_[i]->line();
+      if (other.uart() != line.uart()) continue;
+      if (line.pins_shared() || other.pins_shared()) {
+        unit.debug("Units sharing a UART need separate DE and RE pins");
+        return false;
+      }
+      shared = true;
+    }
+    for (int i = 0; shared && i < count_; i++) {
+      if (units_[i]->line().uart() == line.uart()) shared_[i] = true;
+    }
+    shared_[count_] = shared;
+    units_[count_++] = &unit;
+    for (int i = 0; i < count_; i++) {
+      if (shared_[i] && units_[i]->line().idle()) units_[i]->line().off();
+    }
+    return true;
+  }
+
+  int count() const { return count_; }
+  Unit& unit(int i) { return *units_[i]; }
+
+  // Replies for every unit that owns its UART's input
+  void receive() {
+    for (int i = 0; i < count_; i++) {
+      if (owns_input(i)) units_[i]->receive();
+    }
+  }
+
+  // Turnaround, timeouts and retries on the lines in use
+  void service() {
+    for (int i = 0; i < count_; i++) {
+      if (owns_input(i)) units_[i]->service_line();
+    }
+  }
+
+  // Each free UART to the unit that needs it most
+  void schedule() {
+    for (int i = 0; i < count_; i++) {
+      if (first_on_uart(i)) grant(units_[i]->line().uart());
+    }
+  }
+
+  void loop() {
+    receive();
+    service();
+    schedule();
+  }
+
+private:
+  // Only a unit mid-transaction owns a shared UART's input
+  bool owns_input(int index) {
+    return !shared_[index] || !units_[index]->line().idle();
+  }
+
+  bool first_on_uart(int index) {
+    for (int i = 0; i < index; i++) {
+      if (units_[i]->line().uart() == units_[index]->line().uart()) return false;
+    }
+    return true;
+  }
+
+  void grant(int uart) {
+    int best = -1;
+    long best_urgency = -1;
+    for (int i = 0; i < count_; i++) {
+      Unit& u = *units_[i];
+      if (u.line().uart() != uart) continue;
+      if (!u.line().idle()) return;  // line busy
+      long urgency = u.urgency();
+      if (urgency > best_urgency) {
+        best = i;
+        best_urgency = urgency;
+      }
+    }
+    if (best < 0) return;
+    if (shared_[best]) {
+      for (int i = 0; i < count_; i++) {
+        if (i != best && units_[i]->line().uart() == uart) units_[i]->line().off();
+      }
+      units_[best]->line().receive_mode();
+    }
+    units_[best]->schedule();
+    units_[best]->service_line();
+  }
+
+  Unit* units_[MAX_UNITS] = {};
+  bool shared_[MAX_UNITS] = {};  // another unit uses the same UART
+  int count_ = 0;
+};
+
+#endif  // TITON_BUS_H
@@ -0,0 +1,62 @@
+// Titon MVHR - Minimal CBOR writer (RFC 8949)
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// Only what the compact state message needs: an indefinite-length map,
+// integers, booleans and null, written straight into a caller buffer. Small
+// integers cost one byte, so a map keyed by field id is a fraction of the
+// JSON equivalent. Writes past the end are counted, not stored; check
+// overflowed() before sending.
+
+#ifndef TITON_CBOR_H
+#define TITON_CBOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class CborWriter {
+public:
+  CborWriter(uint8_t* buffer, size_t capacity) : buf_(buffer), cap_(capacity), len_(0) {}
+
+  void begin_map() { put(0xbf); }  // indefinite length, closed by end_map()
+  void end_map() { put(0xff); }
+
+  void integer(int32_t v) {
+    if (v >= 0) head(0, (uint32_t)v);
+    else head(1, (uint32_t)(-1 - v));
+  }
+  void boolean(bool v) { put(v ? 0xf5 : 0xf4); }
+  void null() { put(0xf6); }
+
+  size_t length() const { return len_; }
+  bool overflowed() const { return len_ > cap_; }
+
+private:
+  // Major type in the top 3 bits, then the argument in 0, 1, 2 or 4 bytes
+  void head(uint8_t major, uint32_t arg) {
+    uint8_t mt = (uint8_t)(major << 5);
+    if (arg < 24) {
+      put(mt | (uint8_t)arg);
+    } else if (arg <= 0xff) {
+      put(mt | 24);
+      put((uint8_t)arg);
+    } else if (arg <= 0xffff) {
+      put(mt | 25);
+      put((uint8_t)(arg >> 8));
+      put((uint8_t)arg);
+    } else {
+      put(mt | 26);
+      for (int shift = 24; shift >= 0; shift -= 8) put((uint8_t)(arg >> shift));
+    }
+  }
+
+  void put(uint8_t b) {
+    if (len_ < cap_) buf_[len_] = b;
+    len_++;
+  }
+
+  uint8_t* buf_;
+  size_t cap_;
+  size_t len_;
+};
+
+#endif  // TITON_CBOR_H
@@ -0,0 +1,68 @@
+// Titon MVHR - ADC sample filter
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// Raw ADC counts go through a 5-sample sliding median, which throws away
+// single-sample spikes from the long 0-10 V sensor run, then a first-order IIR
+// low-pass (y += (x - y) / 2^shift) kept in Q8 fixed point. Both stages are
+// constant time per sample and value() is a field read.
+
+#ifndef TITON_FILTER_H
+#define TITON_FILTER_H
+
+#include <stdint.h>
+
+#define TITON_MEDIAN_TAPS 5
+
+class MedianIirFilter {
+public:
+  // shift sets the IIR time constant: ~2^shift samples
+  explicit MedianIirFilter(uint8_t shift) : shift_(shift) { reset(); }
+
+  void reset() {
+    for (int i = 0; i < TITON_MEDIAN_TAPS; i++) window_[i] = 0;
+    next_ = 0;
+    state_q8_ = 0;
+    count_ = 0;
+  }
+
+  void add(uint16_t raw) {
+    if (count_ == 0) {
+      // Prime both stages so the output starts at the first reading
+      for (int i = 0; i < TITON_MEDIAN_TAPS; i++) window_[i] = raw;
+      state_q8_ = (int32_t)raw << 8;
+    }
+    window_[next_] = raw;
+    next_ = (next_ + 1) % TITON_MEDIAN_TAPS;
+    if (count_ < UINT32_MAX) count_++;
+
+    int32_t x_q8 = (int32_t)median() << 8;
+    state_q8_ += (x_q8 - state_q8_) >> shift_;
+  }
+
+  bool ready() const { return count_ > 0; }
+  uint32_t samples() const { return count_; }
+
+  // Filtered value in ADC counts, rounded
+  uint16_t value() const { return (uint16_t)((state_q8_ + 128) >> 8); }
+
+private:
+  // Median of five by partial sorting network on a copy
+  uint16_t median() const {
+    uint16_t a = window_[0], b = window_[1], c = window_[2], d = window_[3], e = window_[4];
+    sort2(a, b); sort2(d, e); sort2(a, c); sort2(b, c); sort2(a, d);
+    sort2(c, d); sort2(b, e); sort2(b, c); sort2(d, e);
+    return c;
+  }
+
+  static void sort2(uint16_t& x, uint16_t& y) {
+    if (x > y) { uint16_t t = x; x = y; y = t; }
+  }
+
+  uint8_t shift_;
+  uint16_t window_[TITON_MEDIAN_TAPS];
+  uint8_t next_;
+  int32_t state_q8_;
+  uint32_t count_;
+};
+
+#endif  // TITON_FILTER_H
@@ -0,0 +1,185 @@
+// Titon MVHR - RS485 line framer and frame parser
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// The controller speaks ASCII lines of the form AAAA±VVVVV terminated by CR
+// and/or LF, e.g. "0030+00215". Bytes are pushed into a fixed ring buffer as
+// they come off the UART and decoded by a single-pass state machine straight
+// into integers. Nothing here allocates; the work per byte is constant.
+
+#ifndef TITON_FRAME_H
+#define TITON_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TITON_FRAME_RING_SIZE 64        // must be a power of two
+#define TITON_FRAME_MAX_LEN 16          // longest line accepted before EOL
+#define TITON_FRAME_ADDRESS_DIGITS 4
+#define TITON_FRAME_VALUE_DIGITS 5
+#define TITON_FRAME_FAULT_VALUE -99999  // controller reply for a faulty sensor
+
+enum FrameStatus {
+  FRAME_NONE,          // no complete line buffered yet
+  FRAME_OK,            // address and value decoded
+  FRAME_MALFORMED,     // unexpected character, missing sign or digits
+  FRAME_OVERLONG,      // too many digits or line longer than TITON_FRAME_MAX_LEN
+  FRAME_SENSOR_FAULT   // well-formed frame carrying -99999
+};
+
+struct TitonFrame {
+  int address;
+  int32_t value;
+};
+
+struct FrameCounters {
+  uint32_t ok;
+  uint32_t malformed;
+  uint32_t overlong;
+  uint32_t faults;
+  uint32_t noise;        // non-printable bytes discarded outside CR/LF
+  uint32_t overruns;     // bytes lost because the ring was full
+};
+
+class TitonFramer {
+public:
+  TitonFramer() { reset(); }
+
+  void reset() {
+    head_ = tail_ = 0;
+    start_line();
+    last_line_[0] = '\0';
+    counters_ = FrameCounters();
+  }
+
+  // Producer side: copy received bytes into the ring. Returns how many were
+  // accepted; the rest are counted as overruns.
+  size_t feed(const uint8_t* data, size_t len) {
+    size_t i = 0;
+    for (; i < len; i++) {
+      if ((uint8_t)(head_ - tail_) == TITON_FRAME_RING_SIZE) break;
+      ring_[head_++ & (TITON_FRAME_RING_SIZE - 1)] = data[i];
+    }
+    counters_.overruns += len - i;
+    return i;
+  }
+
+  // Consumer side: run the state machine over buffered bytes until a line
+  // ends. Returns FRAME_NONE once the ring is drained mid-line.
+  FrameStatus next(TitonFrame& out) {
+    while (tail_ != head_) {
+      char c = (char)ring_[tail_++ & (TITON_FRAME_RING_SIZE - 1)];
+
+      if (c == '\r' || c == '\n') {
+        if (len_ == 0) continue;  // blank line or second half of CRLF
+        FrameStatus status = finish_line(out);
+        start_line();
+        return status;
+      }
+
+      if (c < 32 || c > 126) {
+        counters_.noise++;
+        continue;
+      }
+
+      if (len_ < TITON_FRAME_MAX_LEN) {
+        line_[len_] = c;
+        line_[len_ + 1] = '\0';
+      }
+      len_++;
+      if (len_ > TITON_FRAME_MAX_LEN) error(FRAME_OVERLONG);
+      step(c);
+    }
+    return FRAME_NONE;
+  }
+
+  // Printable text of the line that produced the last frame (truncated)
+  const char* line() const { return last_line_; }
+  const FrameCounters& counters() const { return counters_; }
+
+private:
+  enum State { ST_ADDRESS, ST_VALUE, ST_ERROR };
+
+  void start_line() {
+    state_ = ST_ADDRESS;
+    error_ = FRAME_NONE;
+    len_ = 0;
+    line_[0] = '\0';
+    address_ = 0;
+    address_digits_ = 0;
+    value_ = 0;
+    value_digits_ = 0;
+    negative_ = false;
+  }
+
+  void error(FrameStatus status) {
+    if (state_ == ST_ERROR) return;
+    state_ = ST_ERROR;
+    error_ = status;
+  }
+
+  void step(char c) {
+    switch (state_) {
+      case ST_ADDRESS:
+        if (c >= '0' && c <= '9') {
+          if (++address_digits_ > TITON_FRAME_ADDRESS_DIGITS) { error(FRAME_OVERLONG); return; }
+          address_ = address_ * 10 + (c - '0');
+        } else if ((c == '+' || c == '-') && address_digits_ > 0) {
+          negative_ = (c == '-');
+          state_ = ST_VALUE;
+        } else {
+          error(FRAME_MALFORMED);
+        }
+        break;
+      case ST_VALUE:
+        if (c >= '0' && c <= '9') {
+          if (++value_digits_ > TITON_FRAME_VALUE_DIGITS) { error(FRAME_OVERLONG); return; }
+          value_ = value_ * 10 + (c - '0');
+        } else {
+          error(FRAME_MALFORMED);
+        }
+        break;
+      case ST_ERROR:
+        break;
+    }
+  }
+
+  FrameStatus finish_line(TitonFrame& out) {
+    for (size_t i = 0; i <= TITON_FRAME_MAX_LEN && i <= len_; i++) last_line_[i] = line_[i];
+    last_line_[TITON_FRAME_MAX_LEN] = '\0';
+
+    FrameStatus status = error_;
+    if (status == FRAME_NONE && (state_ != ST_VALUE || value_digits_ == 0)) status = FRAME_MALFORMED;
+
+    if (status == FRAME_NONE) {
+      out.address = address_;
+      out.value = negative_ ? -value_ : value_;
+      status = (out.value == TITON_FRAME_FAULT_VALUE) ? FRAME_SENSOR_FAULT : FRAME_OK;
+    }
+
+    switch (status) {
+      case FRAME_OK: counters_.ok++; break;
+      case FRAME_SENSOR_FAULT: counters_.faults++; break;
+      case FRAME_OVERLONG: counters_.overlong++; break;
+      default: counters_.malformed++; break;
+    }
+    return status;
+  }
+
+  uint8_t ring_[TITON_FRAME_RING_SIZE];
+  uint8_t head_;
+  uint8_t tail_;
+
+  State state_;
+  FrameStatus error_;
+  size_t len_;
+  char line_[TITON_FRAME_MAX_LEN + 1];
+  char last_line_[TITON_FRAME_MAX_LEN + 1];
+  int address_;
+  uint8_t address_digits_;
+  int32_t value_;
+  uint8_t value_digits_;
+  bool negative_;
+  FrameCounters counters_;
+};
+
+#endif  // TITON_FRAME_H
@@ -0,0 +1,190 @@
+// Titon MVHR - Hardware abstraction layer
+// The firmware logic reaches the platform only through these calls: clocks,
+// GPIO, ADC, the RS485 UART, entropy, tasks, flash files, the NVS settings
+// store, the Wi-Fi link and the MQTT client. Logging stays on Serial.
+//
+// On the ESP32 (ARDUINO defined) they are thin inline wrappers over the
+// Arduino core. Anywhere else they are implemented by host/titon_hal_host.cpp
+// against a simulated Titon controller and an in-process MQTT broker, so the
+// same titon.cpp runs on a Linux host (see host/titon_host_main.cpp).
+
+#ifndef TITON_HAL_H
+#define TITON_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <PubSubClient.h>
+#include <LittleFS.h>
+#include <Preferences.h>
+
+typedef PubSubClient MqttClient;
+
+// ========== CLOCK ==========
+inline uint32_t hal_millis() { return millis(); }
+inline uint32_t hal_micros() { return micros(); }
+inline void hal_delay_ms(uint32_t ms) { delay(ms); }
+inline void hal_delay_us(uint32_t us) { delayMicroseconds(us); }
+inline uint32_t hal_cycles() { return ESP.getCycleCount(); }  // wraps every ~18 s at 240 MHz
+inline uint32_t hal_cycles_per_us() { return ESP.getCpuFreqMHz(); }
+
+// ========== GPIO / ADC ==========
+inline void hal_gpio_output(int pin) { pinMode(pin, OUTPUT); }
+inline void hal_gpio_write(int pin, bool high) { digitalWrite(pin, high ? HIGH : LOW); }
+
+inline void hal_adc_begin(int pin) {
+  pinMode(pin, INPUT);
+  analogSetAttenuation(ADC_11db);  // 0-3.3V range
+}
+inline int hal_adc_read(int pin) { return analogRead(pin); }
+
+// Continuous (DMA) sampling of one pin. The driver averages
+// HAL_ADC_CONVERSIONS conversions into each result, so results arrive at
+// HAL_ADC_SAMPLE_HZ / HAL_ADC_CONVERSIONS (100 Hz) without CPU involvement.
+#define HAL_ADC_SAMPLE_HZ 20000   // lowest rate the ESP32 ADC DMA supports
+#define HAL_ADC_CONVERSIONS 200
+
+inline volatile bool hal_adc_result_ready = false;
+inline void ARDUINO_ISR_ATTR hal_adc_on_result() { hal_adc_result_ready = true; }
+
+inline bool hal_adc_stream_begin(int pin) {
+  uint8_t pins[] = { (uint8_t)pin };
+  analogContinuousSetAtten(ADC_11db);
+  return analogContinuous(pins, 1, HAL_ADC_CONVERSIONS, HAL_ADC_SAMPLE_HZ, hal_adc_on_result) &&
+         analogContinuousStart();
+}
+
+// Newest averaged result if one has completed since the last call; never blocks
+inline bool hal_adc_stream_read(int* raw) {
+  if (!hal_adc_result_ready) return false;
+  hal_adc_result_ready = false;
+  adc_continuous_data_t* result = nullptr;
+  if (!analogContinuousRead(&result, 0) || !result) return false;
+  *raw = result[0].avg_read_raw;
+  return true;
+}
+
+// ========== RS485 UART ==========
+// Ports 0-2 are Serial, Serial1 and Serial2; the bus defaults to Serial2
+// because Serial is the console. Pins are routed through the GPIO matrix, so
+// any port can use any free pins.
+#define HAL_UART_BUS 2
+
+inline HardwareSerial& hal_uart(int port) {
+#if ARDUINO_USB_CDC_ON_BOOT
+  if (port == 0) return Serial0;  // Serial is the USB CDC console
+#else
+  if (port == 0) return Serial;
+#endif
+  if (port == 1) return Serial1;
+  return Serial2;
+}
+inline void hal_uart_begin(uint32_t baud, int rx_pin, int tx_pin, int port = HAL_UART_BUS) {
+  hal_uart(port).begin(baud, SERIAL_8N1, rx_pin, tx_pin);
+}
+inline size_t hal_uart_write(const uint8_t* data, size_t len, int port = HAL_UART_BUS) {
+  return hal_uart(port).write(data, len);
+}
+inline size_t hal_uart_read(uint8_t* data, size_t len, int port = HAL_UART_BUS) { return hal_uart(port).read(data, len); }
+
+// ========== ENTROPY ==========
+inline uint32_t hal_entropy() { return (uint32_t)ESP.getEfuseMac(); }
+inline void hal_random_seed(uint32_t seed) { randomSeed(seed); }
+inline long hal_random(long lo, long hi) { return random(lo, hi); }
+
+// ========== TASKS ==========
+// Runs body() forever on the given core, yielding one tick between passes
+inline void hal_task_start(const char* name, void (*body)(), int core) {
+  xTaskCreatePinnedToCore([](void* arg) {
+    void (*fn)() = (void (*)())arg;
+    for (;;) {
+      fn();
+      vTaskDelay(1);
+    }
+  }, name, 4096, (void*)body, 2, nullptr, core);
+}
+
+// ========== FLASH FILES ==========
+// LittleFS spreads writes across the partition itself; callers keep appends
+// batched and remove whole files rather than rewriting them.
+inline bool hal_fs_begin() { return LittleFS.begin(true); }  // formats on first use
+
+inline bool hal_fs_append(const char* path, const void* data, size_t len) {
+  File f = LittleFS.open(path, FILE_APPEND);
+  if (!f) return false;
+  size_t n = f.write((const uint8_t*)data, len);
+  f.close();
+  return n == len;
+}
+
+inline size_t hal_fs_read(const char* path, size_t offset, void* data, size_t len) {
+  if (!LittleFS.exists(path)) return 0;
+  File f = LittleFS.open(path, FILE_READ);
+  if (!f) return 0;
+  size_t n = f.seek(offset) ? f.read((uint8_t*)data, len) : 0;
+  f.close();
+  return n;
+}
+
+inline size_t hal_fs_size(const char* path) {
+  if (!LittleFS.exists(path)) return 0;
+  File f = LittleFS.open(path, FILE_READ);
+  if (!f) return 0;
+  size_t n = f.size();
+  f.close();
+  return n;
+}
+
+inline void hal_fs_remove(const char* path) { LittleFS.remove(path); }
+
+// ========== NVS ==========
+// Named integers in one Preferences namespace. NVS appends every put as a new
+// entry and wear-levels across its pages; callers still batch and skip
+// unchanged values.
+inline Preferences& hal_prefs() {
+  static Preferences prefs;
+  return prefs;
+}
+inline bool hal_nvs_begin(const char* name) { return hal_prefs().begin(name, false); }
+
+inline bool hal_nvs_get(const char* key, int32_t* value) {
+  if (!hal_prefs().isKey(key)) return false;
+  *value = hal_prefs().getInt(key, 0);
+  return true;
+}
+
+inline bool hal_nvs_put(const char* key, int32_t value) { return hal_prefs().putInt(key, value) == sizeof(value); }
+
+// ========== WI-FI ==========
+inline void hal_wifi_init() {
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+}
+inline void hal_wifi_connect(const char* ssid, const char* password) {
+  WiFi.disconnect();
+  WiFi.begin(ssid, password);
+}
+inline bool hal_wifi_connected() { return WiFi.status() == WL_CONNECTED; }
+inline void hal_wifi_ip(char* buffer, size_t size) {
+  IPAddress ip = WiFi.localIP();
+  snprintf(buffer, size, "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
+
+// ========== MQTT ==========
+inline MqttClient& hal_mqtt() {
+  static WiFiClient client;
+  static PubSubClient mqtt(client);
+  return mqtt;
+}
+
+#else  // host build
+
+#include "host/titon_host.h"
+
+#endif  // ARDUINO
+
+#endif  // TITON_HAL_H
@@ -0,0 +1,130 @@
+// Titon MVHR - On-device time-series history
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// Each series keeps three fixed-size rings: the last raw samples, 1-minute
+// and 15-minute rollups (min/max/sum/count). Storage is columnar (one array
+// per field) so a range query walks contiguous memory, and rollup buckets
+// carry no timestamp: bucket b covers [b * period, (b + 1) * period) and
+// lives in slot b % N. Times are seconds on whatever monotonic clock the
+// caller uses.
+
+#ifndef TITON_HISTORY_H
+#define TITON_HISTORY_H
+
+#include <stdint.h>
+
+#define TITON_HISTORY_RAW 32        // newest samples as received
+#define TITON_HISTORY_MINUTES 60    // 1 hour of 1-minute buckets
+#define TITON_HISTORY_QUARTERS 96   // 24 hours of 15-minute buckets
+
+template <uint16_t N>
+class RawRing {
+public:
+  RawRing() : head_(0), count_(0) {}
+
+  void add(uint32_t t, int32_t v) {
+    t_[head_] = t;
+    v_[head_] = v;
+    head_ = (uint16_t)((head_ + 1) % N);
+    if (count_ < N) count_++;
+  }
+
+  uint16_t size() const { return count_; }
+  // i = 0 is the oldest sample held
+  uint32_t time(uint16_t i) const { return t_[index(i)]; }
+  int32_t value(uint16_t i) const { return v_[index(i)]; }
+
+private:
+  uint16_t index(uint16_t i) const { return (uint16_t)((head_ + N - count_ + i) % N); }
+
+  uint32_t t_[N];
+  int32_t v_[N];
+  uint16_t head_;
+  uint16_t count_;
+};
+
+struct Rollup {
+  int32_t min;
+  int32_t max;
+  int32_t avg;
+  uint16_t count;
+};
+
+template <uint16_t N>
+class RollupRing {
+public:
+  explicit RollupRing(uint32_t period_s) : period_s_(period_s), newest_(0), started_(false) {
+    for (uint32_t b = 0; b < N; b++) clear(b);
+  }
+
+  void add(uint32_t t, int32_t v) {
+    uint32_t b = t / period_s_;
+    if (!started_) {
+      started_ = true;
+      newest_ = b;
+      clear(b);
+    } else if (b > newest_) {
+      // Empty every bucket skipped since the last sample, at most a lap
+      uint32_t first = b - newest_ > N ? b - N + 1 : newest_ + 1;
+      for (uint32_t k = first; k <= b; k++) clear(k);
+      newest_ = b;
+    } else if (newest_ - b >= N) {
+      return;  // older than the window
+    }
+    uint16_t s = (uint16_t)(b % N);
+    if (count_[s] == 0 || v < min_[s]) min_[s] = v;
+    if (count_[s] == 0 || v > max_[s]) max_[s] = v;
+    if (count_[s] < MAX_COUNT) {  // keeps sum_ in range for 5-digit values
+      sum_[s] += v;
+      count_[s]++;
+    }
+  }
+
+  uint32_t period() const { return period_s_; }
+  bool empty() const { return !started_; }
+  uint32_t newest() const { return newest_; }
+  uint32_t oldest() const { return newest_ >= N - 1 ? newest_ - (N - 1) : 0; }
+
+  // Bucket by absolute index; false if outside the window or no samples
+  bool bucket(uint32_t b, Rollup& out) const {
+    if (!started_ || b > newest_ || b < oldest()) return false;
+    uint16_t s = (uint16_t)(b % N);
+    if (count_[s] == 0) return false;
+    out.min = min_[s];
+    out.max = max_[s];
+    out.avg = sum_[s] / count_[s];
+    out.count = count_[s];
+    return true;
+  }
+
+private:
+  static const uint16_t MAX_COUNT = 21000;
+
+  void clear(uint32_t b) {
+    uint16_t s = (uint16_t)(b % N);
+    count_[s] = 0;
+    sum_[s] = 0;
+  }
+
+  uint32_t period_s_;
+  uint32_t newest_;
+  bool started_;
+  int32_t min_[N];
+  int32_t max_[N];
+  int32_t sum_[N];
+  uint16_t count_[N];
+};
+
+struct TimeSeries {
+  RawRing<TITON_HISTORY_RAW> raw;
+  RollupRing<TITON_HISTORY_MINUTES> minute{ 60 };
+  RollupRing<TITON_HISTORY_QUARTERS> quarter{ 900 };
+
+  void add(uint32_t t, int32_t v) {
+    raw.add(t, v);
+    minute.add(t, v);
+    quarter.add(t, v);
+  }
+};
+
+#endif  // TITON_HISTORY_H
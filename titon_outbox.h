@@ -0,0 +1,79 @@
+// Titon MVHR - Store-and-forward outbox
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// A bounded FIFO of timestamped records waiting for the broker. Events are
+// appended as they happen. Deltas coalesce: while a record for the same key
+// is still queued, a new value updates it in place (latest value, min, max,
+// count, last time) instead of taking a new slot, so an outage costs one
+// record per field however long it lasts. Records are fixed-size and
+// trivially copyable so the caller can spill them to flash as-is.
+
+#ifndef TITON_OUTBOX_H
+#define TITON_OUTBOX_H
+
+#include <stdint.h>
+
+enum OutboxKind : uint8_t { OUTBOX_DELTA, OUTBOX_EVENT };
+
+struct OutboxRecord {
+  uint32_t first_s;   // first update folded in (events: when it happened)
+  uint32_t last_s;    // latest update
+  int32_t value;      // latest value
+  int32_t min;
+  int32_t max;
+  uint16_t count;     // updates folded in
+  uint8_t kind;       // OutboxKind
+  uint8_t key;        // delta: caller's field id, event: caller's event id
+};
+static_assert(sizeof(OutboxRecord) == 24, "OutboxRecord is stored on flash as-is");
+
+// N records in RAM; delta keys are 0..KEYS-1
+template <uint16_t N, uint16_t KEYS>
+class OutboxRing {
+public:
+  OutboxRing() : head_(0), tail_(0) {
+    for (int k = 0; k < KEYS; k++) pending_[k] = 0;
+  }
+
+  // False only if the ring is full and the value couldn't be folded in
+  bool delta(uint8_t key, uint32_t t, int32_t v) {
+    uint32_t pos = pending_[key];
+    if (pos > tail_) {  // still queued (positions are stored +1)
+      OutboxRecord& r = slots_[(pos - 1) % N];
+      r.last_s = t;
+      r.value = v;
+      if (v < r.min) r.min = v;
+      if (v > r.max) r.max = v;
+      if (r.count < UINT16_MAX) r.count++;
+      return true;
+    }
+    if (full()) return false;
+    pending_[key] = head_ + 1;
+    return append(OutboxRecord{ t, t, v, v, v, 1, OUTBOX_DELTA, key });
+  }
+
+  bool event(uint8_t key, uint32_t t, int32_t v) {
+    return append(OutboxRecord{ t, t, v, v, v, 1, OUTBOX_EVENT, key });
+  }
+
+  bool full() const { return head_ - tail_ == N; }
+  uint32_t size() const { return head_ - tail_; }
+  const OutboxRecord& front() const { return slots_[tail_ % N]; }
+  // A popped delta stops coalescing; the next value for its key starts a new record
+  void pop() { tail_++; }
+
+private:
+  bool append(const OutboxRecord& r) {
+    if (full()) return false;
+    slots_[head_ % N] = r;
+    head_++;
+    return true;
+  }
+
+  OutboxRecord slots_[N];
+  uint32_t head_;
+  uint32_t tail_;
+  uint32_t pending_[KEYS];
+};
+
+#endif  // TITON_OUTBOX_H
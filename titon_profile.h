@@ -0,0 +1,80 @@
+// Titon MVHR - Latency histograms for loop profiling
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// Durations are recorded in CPU cycles into log-linear buckets: one octave per
+// power of two, split into 2^TITON_HIST_SUB_BITS linear sub-buckets, so any
+// percentile is within ~19% of the true value while the whole histogram is a
+// fixed 512-byte array. Recording is a count-leading-zeros and an increment.
+
+#ifndef TITON_PROFILE_H
+#define TITON_PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TITON_HIST_SUB_BITS 2
+#define TITON_HIST_SUB_COUNT (1 << TITON_HIST_SUB_BITS)
+#define TITON_HIST_BUCKETS (32 * TITON_HIST_SUB_COUNT)
+
+class LatencyHistogram {
+public:
+  LatencyHistogram() { reset(); }
+
+  void reset() {
+    for (int i = 0; i < TITON_HIST_BUCKETS; i++) buckets_[i] = 0;
+    count_ = 0;
+    max_ = 0;
+    total_ = 0;
+  }
+
+  void record(uint32_t v) {
+    buckets_[bucket(v)]++;
+    count_++;
+    total_ += v;
+    if (v > max_) max_ = v;
+  }
+
+  uint32_t count() const { return count_; }
+  uint32_t max() const { return max_; }
+  uint32_t mean() const { return count_ ? (uint32_t)(total_ / count_) : 0; }
+
+  // Upper edge of the bucket holding the given rank (per_mille = 500 for
+  // p50, 990 for p99), never above the recorded maximum
+  uint32_t percentile(uint32_t per_mille) const {
+    if (!count_) return 0;
+    uint64_t rank = ((uint64_t)count_ * per_mille + 999) / 1000;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < TITON_HIST_BUCKETS; i++) {
+      seen += buckets_[i];
+      if (seen >= rank) {
+        uint64_t edge = upper_edge(i);
+        return edge < max_ ? (uint32_t)edge : max_;
+      }
+    }
+    return max_;
+  }
+
+private:
+  static int bucket(uint32_t v) {
+    if (v < TITON_HIST_SUB_COUNT) return (int)v;
+    int msb = 31 - __builtin_clz(v);
+    int shift = msb - TITON_HIST_SUB_BITS;
+    int sub = (int)(v >> shift) & (TITON_HIST_SUB_COUNT - 1);
+    return (shift + 1) * TITON_HIST_SUB_COUNT + sub;
+  }
+
+  static uint64_t upper_edge(int index) {
+    if (index < TITON_HIST_SUB_COUNT) return (uint64_t)index;
+    int shift = index / TITON_HIST_SUB_COUNT - 1;
+    int sub = index % TITON_HIST_SUB_COUNT;
+    return ((uint64_t)(TITON_HIST_SUB_COUNT + sub + 1) << shift) - 1;
+  }
+
+  uint32_t buckets_[TITON_HIST_BUCKETS];
+  uint32_t count_;
+  uint32_t max_;
+  uint64_t total_;
+};
+
+#endif  // TITON_PROFILE_H
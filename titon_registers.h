@@ -0,0 +1,190 @@
+// Titon MVHR - Register descriptor table
+// Single source of truth for every controller register the gateway knows
+// about: protocol opcodes, decoding, JSON key, Home Assistant metadata and
+// poll schedule. Adding a register is one line in TITON_REGISTERS plus its
+// RegisterId; the read command and the address lookup follow from it at
+// compile time.
+
+#ifndef TITON_REGISTERS_H
+#define TITON_REGISTERS_H
+
+#include <stdint.h>
+
+// Commands are the 3-digit address followed by an opcode digit (1 = read,
+// 0 = write), a sign and a 5-digit value, e.g. "0301+00000" reads 030.
+#define TITON_READ_CMD(aaa) #aaa "1+00000\r\n"
+#define TITON_WRITE_CMD(aaa) #aaa "0"
+#define TITON_MAX_ADDRESS 1000
+
+// ========== STATUS WORD BIT DEFINITIONS ==========
+#define STATUS_SUPPLY_FAN_ERROR     0x0001  // Bit 0
+#define STATUS_THERMISTOR_ERROR     0x0002  // Bit 1 (general)
+#define STATUS_EXTRACT_FAN_ERROR    0x0004  // Bit 2
+#define STATUS_EEPROM_ERROR         0x0008  // Bit 3
+#define STATUS_SWITCH1_ACTIVE       0x0010  // Bit 4
+#define STATUS_SWITCH2_ACTIVE       0x0020  // Bit 5
+#define STATUS_SWITCH3_ACTIVE       0x0040  // Bit 6
+#define STATUS_LS1_ACTIVE           0x0080  // Bit 7
+#define STATUS_LS2_ACTIVE           0x0100  // Bit 8
+#define STATUS_ENGINE_ERROR         0x0200  // Bit 9
+#define STATUS_SWITCH_ERROR         0x0400  // Bit 10
+#define STATUS_ENGINE_RUNNING       0x0800  // Bit 11 (2048 decimal)
+#define STATUS_THERM1_ERROR         0x1000  // Bit 12
+#define STATUS_THERM2_ERROR         0x2000  // Bit 13
+#define STATUS_THERM3_ERROR         0x4000  // Bit 14
+#define STATUS_HUMIDITY_ERROR       0x8000  // Bit 15
+
+enum RegisterDecode : uint8_t {
+  DECODE_INT,            // value as-is
+  DECODE_TENTHS,         // 0.1 resolution (temperatures)
+  DECODE_BYPASS_FLAGS,   // bit 0 = summer bypass, bit 1 = SUMMERboost
+};
+
+struct RegisterDesc {
+  uint16_t address;
+  const char* read_cmd;        // full read request including CRLF
+  const char* write_cmd;       // address + write opcode, nullptr if read-only
+  RegisterDecode decode;
+  const char* json_key;        // state topic key, nullptr if not published
+  const char* name;            // HA sensor name, nullptr = no sensor entity
+  const char* unit;
+  const char* device_class;
+  uint32_t poll_period_ms;     // 0 = never polled
+  uint8_t poll_priority;       // 0 = most urgent
+  uint16_t deadband;           // raw change needed before a delta is published, 0 = any
+  bool command;                // one-shot action: never deduplicated or read back
+};
+
+// Must stay in the same order as TITON_REGISTERS
+enum RegisterId : uint8_t {
+  REG_STALE_AIR_IN_TEMP,
+  REG_STALE_AIR_OUT_TEMP,
+  REG_FRESH_AIR_IN_TEMP,
+  REG_INTERNAL_HUMIDITY,
+  REG_RUNTIME_HOURS,
+  REG_STATUS_WORD,
+  REG_FACTORY_RESET,
+  REG_SUMMER_BYPASS_ENABLE,
+  REG_SUMMERBOOST_DISABLE,
+  REG_BOOST_INHIBIT,
+  REG_FILTER_REMAINING,
+  REG_SUPPLY_RPM,
+  REG_EXTRACT_RPM,
+  REG_SUPPLY_TEMP,
+  REG_EXTRACT_TEMP,
+  REG_CURRENT_SPEED,
+  REG_BYPASS_FLAGS,
+  REGISTER_COUNT
+};
+
+// Poll periods keep the average load at ~0.5 frames/s: status word and
+// current speed every 8 s, internal humidity 20 s, temperatures 30 s,
+// counters 60 s. Deadbands: 0.2°C on temperatures, 50 RPM on fans.
+static constexpr RegisterDesc TITON_REGISTERS[REGISTER_COUNT] = {
+  { 30,  TITON_READ_CMD(030), nullptr,              DECODE_TENTHS, "stale_air_in_temp",  "Stale Air In Temperature",  "°C",  "temperature", 30000, 2, 2, false },
+  { 31,  TITON_READ_CMD(031), nullptr,              DECODE_TENTHS, "stale_air_out_temp", "Stale Air Out Temperature", "°C",  "temperature", 30000, 2, 2, false },
+  { 32,  TITON_READ_CMD(032), nullptr,              DECODE_TENTHS, "fresh_air_in_temp",  "Fresh Air In Temperature",  "°C",  "temperature", 30000, 2, 2, false },
+  { 36,  TITON_READ_CMD(036), nullptr,              DECODE_INT,    "internal_humidity",  "Internal Humidity",         "%",   "humidity",    20000, 1, 0, false },
+  { 60,  TITON_READ_CMD(060), nullptr,              DECODE_INT,    "runtime_hours",      "Runtime Hours",             "h",   "duration",    60000, 3, 0, false },
+  { 61,  TITON_READ_CMD(061), nullptr,              DECODE_INT,    "status_word",        "Status Word (Raw)",         "",    "",            8000,  0, 0, false },
+  { 68,  TITON_READ_CMD(068), TITON_WRITE_CMD(068), DECODE_INT,    nullptr,              nullptr,                     "",    "",            0,     0, 0, true  },
+  { 230, TITON_READ_CMD(230), TITON_WRITE_CMD(230), DECODE_INT,    nullptr,              nullptr,                     "",    "",            0,     0, 0, false },
+  { 290, TITON_READ_CMD(290), TITON_WRITE_CMD(290), DECODE_INT,    nullptr,              nullptr,                     "",    "",            0,     0, 0, false },  // INVERTED: 0 = SUMMERboost enabled
+  { 326, TITON_READ_CMD(326), TITON_WRITE_CMD(326), DECODE_INT,    nullptr,              nullptr,                     "",    "",            0,     0, 0, false },
+  { 341, TITON_READ_CMD(341), nullptr,              DECODE_INT,    "filter_remaining",   "Filter Remaining",          "h",   "duration",    60000, 3, 0, false },
+  { 380, TITON_READ_CMD(380), nullptr,              DECODE_INT,    "supply_rpm",         "Supply Fan RPM",            "RPM", "",            0,     0, 50, false },
+  { 381, TITON_READ_CMD(381), nullptr,              DECODE_INT,    "extract_rpm",        "Extract Fan RPM",           "RPM", "",            0,     0, 50, false },
+  { 382, TITON_READ_CMD(382), nullptr,              DECODE_TENTHS, "supply_temp",        "Supply Temperature",        "°C",  "temperature", 30000, 2, 2, false },
+  { 383, TITON_READ_CMD(383), nullptr,              DECODE_TENTHS, "extract_temp",       "Extract Temperature",       "°C",  "temperature", 30000, 2, 2, false },
+  { 384, TITON_READ_CMD(384), TITON_WRITE_CMD(384), DECODE_INT,    "current_speed",      "Current Speed",             "",    "",            8000,  0, 0, false },
+  { 385, TITON_READ_CMD(385), nullptr,              DECODE_BYPASS_FLAGS, nullptr,        nullptr,                     "",    "",            0,     0, 0, false },
+};
+
+struct StatusBitDesc {
+  uint16_t mask;
+  const char* label;           // serial log text
+  bool is_fault;
+  const char* json_key;        // nullptr = not published
+  const char* name;
+  const char* device_class;
+};
+
+static constexpr StatusBitDesc TITON_STATUS_BITS[] = {
+  { STATUS_SUPPLY_FAN_ERROR,  "Supply Fan Error",             true,  "supply_fan_error",      "Supply Fan Error",           "problem" },
+  { STATUS_THERMISTOR_ERROR,  "Thermistor Error (General)",   true,  "thermistor_error",      "Thermistor Error (General)", "problem" },
+  { STATUS_EXTRACT_FAN_ERROR, "Extract Fan Error",            true,  "extract_fan_error",     "Extract Fan Error",          "problem" },
+  { STATUS_EEPROM_ERROR,      "EEPROM Error",                 true,  "eeprom_error",          "EEPROM Error",               "problem" },
+  { STATUS_SWITCH1_ACTIVE,    "Switch 1 Active",              false, nullptr,                 nullptr,                      nullptr },
+  { STATUS_SWITCH2_ACTIVE,    "Switch 2 Active",              false, nullptr,                 nullptr,                      nullptr },
+  { STATUS_SWITCH3_ACTIVE,    "Switch 3 Active",              false, nullptr,                 nullptr,                      nullptr },
+  { STATUS_LS1_ACTIVE,        "LS1 Active",                   false, nullptr,                 nullptr,                      nullptr },
+  { STATUS_LS2_ACTIVE,        "LS2 Active",                   false, nullptr,                 nullptr,                      nullptr },
+  { STATUS_ENGINE_ERROR,      "Engine Error",                 true,  "engine_error",          "Engine Error",               "problem" },
+  { STATUS_SWITCH_ERROR,      "Switch Error",                 true,  "switch_error",          "Switch Error",               "problem" },
+  { STATUS_ENGINE_RUNNING,    "Engine Running",               false, "engine_running",        "Engine Running",             "running" },
+  { STATUS_THERM1_ERROR,      "Thermistor 1 Error",           true,  "therm1_error",          "Thermistor 1 Error",         "problem" },
+  { STATUS_THERM2_ERROR,      "Thermistor 2 Error",           true,  "therm2_error",          "Thermistor 2 Error",         "problem" },
+  { STATUS_THERM3_ERROR,      "Thermistor 3 Error",           true,  "therm3_error",          "Thermistor 3 Error",         "problem" },
+  { STATUS_HUMIDITY_ERROR,    "Humidity Sensor Error",        true,  "humidity_sensor_error", "Humidity Sensor Error",      "problem" },
+};
+static constexpr int STATUS_BIT_COUNT = sizeof(TITON_STATUS_BITS) / sizeof(TITON_STATUS_BITS[0]);
+
+// ========== ADDRESS -> SLOT LOOKUP ==========
+// Built at compile time so decoding a reply is a single array index instead
+// of a switch over every known address.
+struct RegisterSlotMap {
+  int8_t slot[TITON_MAX_ADDRESS];
+};
+
+constexpr RegisterSlotMap make_register_slot_map() {
+  RegisterSlotMap m{};
+  for (int a = 0; a < TITON_MAX_ADDRESS; a++) m.slot[a] = -1;
+  for (int i = 0; i < REGISTER_COUNT; i++) m.slot[TITON_REGISTERS[i].address] = (int8_t)i;
+  return m;
+}
+
+static constexpr RegisterSlotMap REGISTER_SLOT_MAP = make_register_slot_map();
+
+constexpr bool register_addresses_unique() {
+  for (int i = 0; i < REGISTER_COUNT; i++) {
+    if (REGISTER_SLOT_MAP.slot[TITON_REGISTERS[i].address] != i) return false;
+  }
+  return true;
+}
+static_assert(register_addresses_unique(), "duplicate address in TITON_REGISTERS");
+
+// Keeping the table sorted by address makes a RegisterId/row mismatch show up
+// as a build error rather than as values landing in the wrong field
+constexpr bool register_table_sorted() {
+  for (int i = 1; i < REGISTER_COUNT; i++) {
+    if (TITON_REGISTERS[i - 1].address >= TITON_REGISTERS[i].address) return false;
+  }
+  return true;
+}
+static_assert(register_table_sorted(), "TITON_REGISTERS must be sorted by address");
+static_assert(REGISTER_COUNT < 128, "slot map stores int8_t");
+
+// What a read returns once `written` has been applied. Current speed is
+// written as one bit per speed (1/2/4/8) but reads back as the speed number.
+constexpr int32_t register_readback(RegisterId id, int32_t written) {
+  if (id != REG_CURRENT_SPEED) return written;
+  switch (written) {
+    case 1: return 1;
+    case 2: return 2;
+    case 4: return 3;
+    case 8: return 4;
+    default: return -1;
+  }
+}
+
+// A value has moved far enough from the one last published to publish again
+constexpr bool register_moved(const RegisterDesc& reg, int32_t published, int32_t value) {
+  int32_t change = value > published ? value - published : published - value;
+  return change > 0 && change >= reg.deadband;
+}
+
+inline int register_slot(int address) {
+  return (address >= 0 && address < TITON_MAX_ADDRESS) ? REGISTER_SLOT_MAP.slot[address] : -1;
+}
+
+#endif  // TITON_REGISTERS_H
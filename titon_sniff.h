@@ -0,0 +1,128 @@
+// Titon MVHR - Passive decoder for other masters' bus traffic
+// Plain C++ with no Arduino dependencies so it also builds on a Linux host.
+//
+// When a wall controller shares the RS485 line, the gateway hears both sides
+// of its exchanges: requests "AAAO±VVVVV" (3-digit address, opcode 1 = read,
+// 0 = write) and replies "0AAA±VVVVV". The framer decodes both as a 4-digit
+// address and a value, so a read of 038 ("0381+00000") looks exactly like a
+// reply from 381. BusSniffer tells them apart by pairing: a read request
+// leaves its register pending, and the next frame from that register within
+// the reply timeout is its answer. Anything else is taken as a request.
+//
+// Each of our own reads stays pending on its own, for own_timeout_ms, so
+// late replies to every read of a burst still pair after our transaction
+// has given up on them. Another master has one read outstanding at a time.
+
+#ifndef TITON_SNIFF_H
+#define TITON_SNIFF_H
+
+#include <stdint.h>
+#include "titon_frame.h"
+
+enum SniffKind {
+  SNIFF_REQUEST,       // read request from another master
+  SNIFF_REPLY,         // answer to a pending read: address and value are the register's
+  SNIFF_WRITE,         // write request: address is the register, value as written
+  SNIFF_UNKNOWN        // neither, e.g. a reply whose request was lost
+};
+
+struct SniffEvent {
+  SniffKind kind;
+  int address;
+  int32_t value;
+  bool own;            // reply to a read we sent (arrived after our transaction gave up)
+};
+
+struct SniffCounters {
+  uint32_t requests;
+  uint32_t replies;
+  uint32_t writes;
+  uint32_t unknown;
+  uint32_t deferred;   // polls skipped because another master read the register
+};
+
+class BusSniffer {
+public:
+  static constexpr int PENDING_MAX = 6;  // a full burst of ours and another master's read
+
+  BusSniffer(uint32_t reply_timeout_ms, uint32_t own_timeout_ms)
+    : timeout_ms_(reply_timeout_ms), own_timeout_ms_(own_timeout_ms), pending_(), counters_() {}
+
+  // A read we sent ourselves, so a late reply still pairs
+  void own_request(int address, uint32_t now_ms) {
+    pend(address, now_ms, true);
+  }
+
+  SniffEvent decode(const TitonFrame& f, uint32_t now_ms) {
+    for (int i = 0; i < PENDING_MAX; i++) {
+      Pending& p = pending_[i];
+      if (!live(p, now_ms) || f.address != p.address) continue;
+      p.active = false;
+      counters_.replies++;
+      return SniffEvent{ SNIFF_REPLY, f.address, f.value, p.own };
+    }
+    int reg = f.address / 10;
+    int opcode = f.address % 10;
+    if (opcode == 1 && f.value == 0) {
+      pend(reg, now_ms, false);
+      counters_.requests++;
+      return SniffEvent{ SNIFF_REQUEST, reg, 0, false };
+    }
+    if (opcode == 0) {
+      counters_.writes++;
+      return SniffEvent{ SNIFF_WRITE, reg, f.value, false };
+    }
+    counters_.unknown++;
+    return SniffEvent{ SNIFF_UNKNOWN, f.address, f.value, false };
+  }
+
+  // Another master's read is still waiting for its answer: keep off the line
+  bool awaiting_reply(uint32_t now_ms) const {
+    for (int i = 0; i < PENDING_MAX; i++) {
+      if (!pending_[i].own && live(pending_[i], now_ms)) return true;
+    }
+    return false;
+  }
+
+  void count_deferred() { counters_.deferred++; }
+  const SniffCounters& counters() const { return counters_; }
+
+private:
+  struct Pending {
+    bool active;
+    bool own;
+    int address;
+    uint32_t at_ms;
+  };
+
+  bool live(const Pending& p, uint32_t now_ms) const {
+    return p.active && now_ms - p.at_ms < (p.own ? own_timeout_ms_ : timeout_ms_);
+  }
+
+  // Our read of the same register again or another master's next read takes
+  // over its entry; otherwise a free or expired one, or else the oldest
+  void pend(int address, uint32_t now_ms, bool own) {
+    int slot = -1;
+    for (int i = 0; i < PENDING_MAX && slot < 0; i++) {
+      const Pending& p = pending_[i];
+      if (live(p, now_ms) && p.own == own && (!own || p.address == address)) slot = i;
+    }
+    for (int i = 0; i < PENDING_MAX && slot < 0; i++) {
+      if (!live(pending_[i], now_ms)) slot = i;
+    }
+    if (slot < 0) {
+      slot = 0;
+      for (int i = 1; i < PENDING_MAX; i++) {
+        if ((int32_t)(pending_[i].at_ms - pending_[slot].at_ms) < 0) slot = i;
+      }
+    }
+    pending_[slot] = Pending{ true, own, address, now_ms };
+  }
+
+  uint32_t timeout_ms_;
+  uint32_t own_timeout_ms_;
+  Pending pending_[PENDING_MAX];
+  SniffCounters counters_;
+};
+
+#endif  // TITON_SNIFF_H
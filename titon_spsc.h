@@ -0,0 +1,119 @@
+// Titon MVHR - Lock-free primitives for the bus/network task split
+// Plain C++11 atomics with no Arduino dependencies so the same code runs on
+// both ESP32 cores and under ThreadSanitizer on a Linux host.
+//
+// SpscQueue: bounded ring for exactly one producer thread and one consumer
+// thread. Each side only writes its own index; acquire/release on the indices
+// publishes the slot contents.
+//
+// Seqlock: a single writer publishes a trivially copyable snapshot that any
+// number of readers copy out without blocking the writer. Readers retry if a
+// write overlapped their copy. The payload is held as atomic words so
+// concurrent access is well defined; release stores / acquire loads on the
+// words order them against the sequence counter without standalone fences,
+// which ThreadSanitizer can't model.
+
+#ifndef TITON_SPSC_H
+#define TITON_SPSC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+template <typename T, uint32_t N>
+class SpscQueue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+
+public:
+  SpscQueue() : head_(0), tail_(0) {}
+
+  // Producer
+  bool push(const T& item) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) return false;
+    slots_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer: look at the oldest item without removing it
+  bool peek(T& out) const {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    out = slots_[tail & (N - 1)];
+    return true;
+  }
+
+  // Consumer: drop the item peek() returned
+  void pop() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool pop(T& out) {
+    if (!peek(out)) return false;
+    pop();
+    return true;
+  }
+
+  // Approximate when called from a third thread
+  uint32_t size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  T slots_[N];
+  std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> tail_;
+};
+
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value, "Seqlock payload must be trivially copyable");
+  static const size_t WORDS = (sizeof(T) + 3) / 4;
+
+public:
+  Seqlock() : seq_(0) {
+    for (size_t i = 0; i < WORDS; i++) words_[i].store(0, std::memory_order_relaxed);
+  }
+
+  // Single writer only. Copies a word at a time, so neither side needs a
+  // second T on its stack.
+  void write(const T& value) {
+    const uint8_t* bytes = (const uint8_t*)&value;
+    uint32_t seq = seq_.load(std::memory_order_relaxed);
+    seq_.store(seq + 1, std::memory_order_relaxed);  // odd: write in progress
+    for (size_t i = 0; i < WORDS; i++) {
+      uint32_t word = 0;
+      memcpy(&word, bytes + i * 4, chunk(i));
+      words_[i].store(word, std::memory_order_release);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // Returns the sequence number of the copy (even, 0 = never written)
+  uint32_t read(T& out) const {
+    uint8_t* bytes = (uint8_t*)&out;
+    uint32_t before, after;
+    do {
+      before = seq_.load(std::memory_order_acquire);
+      for (size_t i = 0; i < WORDS; i++) {
+        uint32_t word = words_[i].load(std::memory_order_acquire);
+        memcpy(bytes + i * 4, &word, chunk(i));
+      }
+      after = seq_.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return before;
+  }
+
+  uint32_t sequence() const { return seq_.load(std::memory_order_acquire); }
+
+private:
+  static size_t chunk(size_t word) { return word + 1 < WORDS ? 4 : sizeof(T) - word * 4; }
+
+  std::atomic<uint32_t> seq_;
+  std::atomic<uint32_t> words_[WORDS];
+};
+
+#endif  // TITON_SPSC_H
@@ -13,7 +13,25 @@ const char* mqtt_password = "***";
 // mqtt client settings
 const char* client_id                   = "titon"; // Must be unique on the MQTT network
 
-const char* vallox_temp_topic         = "titon/temp"; // temperature topic
-const char* vallox_set_topic          = "titon/set"; // set topic
-const char* vallox_state_topic        = "titon/state"; // dynamically updatig values (on/off, temp, etc ...)
-const char* vallox_debug_topic        = "titon/debug"; // debug topic
+const char* titon_debug_topic         = "titon/debug"; // debug topic, shared by all units
+
+// One entry per MVHR unit, each on its own MAX485. A unit's topics are
+// <prefix>/temp, <prefix>/set and <prefix>/state. UART 0-2 is Serial,
+// Serial1, Serial2; units sharing a UART need separate DE and RE pins.
+// Relay pins of -1 are not driven.
+struct TitonUnitConfig {
+  const char* topic_prefix;
+  int uart;
+  int rx_pin;
+  int tx_pin;
+  int de_pin;
+  int re_pin;
+  int sw1_pin;  // SUMMERboost disable
+  int sw2_pin;  // wet room boost
+  int sw3_pin;  // kitchen boost
+};
+
+const TitonUnitConfig titon_units[] = {
+  { "titon", 2, 16, 17, 4, 4, 25, 26, 27 },  // wiring as for titon.cpp
+  // { "titon_loft", 1, 32, 33, 13, 14, -1, -1, -1 },
+};
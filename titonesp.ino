@@ -22,31 +22,52 @@
 
 #define titonESP_VERSION "1.0.0" // this version
 
+// WiFi and MQTT reconnect in the background so the units keep running
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define RECONNECT_MIN_MS 1000
+#define RECONNECT_MAX_MS 60000
+#define MQTT_SOCKET_TIMEOUT_S 2 // bounds the CONNACK wait in client.connect()
+
 // Callbacks
 void mqttCallback(char* topic, byte* payload, unsigned int payloadLength);
 
 WiFiClient wifiClient;
 PubSubClient client(mqtt_server, mqtt_port, mqttCallback, wifiClient);
-titon tn(DEBUG); 
+const int UNIT_COUNT = sizeof(titon_units) / sizeof(titon_units[0]);
+titon tn[UNIT_COUNT];
+TitonUnits units;  // shares the RS485 lines and runs every unit from loop()
 
 unsigned long lastUpdated = 0;
 bool debug = DEBUG;
+const char* setupError = nullptr;  // published once MQTT is connected
 
-void setup() {
-  wifiConnect();
-  mqttConnect();
-
-  // Setup OTA
-  initOTA();
+bool wifiConnecting = false;
+bool otaStarted = false;
+unsigned long wifiStartedAt = 0;
+unsigned long nextConnectAt = 0;
+unsigned long reconnectDelay = RECONNECT_MIN_MS;
 
-  tn.setPacketCallback(packetDebug);
-  tn.setStatusChangedCallback(statusChanged);
-  tn.setDebugPrintCallback(debugPrint);
-  tn.setTemperatureChangedCallback(temperatureChanged);
-  
-  tn.connect(&Serial);
+void setup() {
+  // WiFi, MQTT and OTA come up from loop() (see networkLoop)
+  client.setSocketTimeout(MQTT_SOCKET_TIMEOUT_S);
+
+  for (int i = 0; i < UNIT_COUNT; i++) {
+    const TitonUnitConfig& cfg = titon_units[i];
+    tn[i].setDebug(debug);
+    tn[i].setPacketCallback(packetDebug);
+    tn[i].setStatusChangedCallback(statusChanged);
+    tn[i].setDebugPrintCallback(debugPrint);
+    tn[i].setTemperatureChangedCallback(temperatureChanged);
+
+    tn[i].connect(cfg.rx_pin, cfg.tx_pin, cfg.de_pin, cfg.re_pin, cfg.uart);
+    tn[i].setRelayPins(cfg.sw1_pin, cfg.sw2_pin, cfg.sw3_pin);
+    if (!units.add(tn[i])) {
+      setupError = "Unit not added, check its UART and DE/RE pins.";
+    }
+  }
 
   client.setCallback(mqttCallback);
+  publishSetupError();
 
   if (debug) {
     client.publish(titon_debug_topic, "Setup done.");
@@ -56,12 +77,10 @@ void setup() {
 void loop() {
 
   // loop tn messages
-  tn.loop();
+  units.loop();
 
-  // check that we are connected
-  if (!client.loop()) {
-    mqttConnect();
-  }
+  // keep the connections up without stalling the units
+  networkLoop();
 
 #ifndef ESP32
   MDNS.update();
@@ -77,49 +96,118 @@ void initOTA() {
   ArduinoOTA.begin();
 }
 
-void wifiConnect() {
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED) {
-    // wait 500ms
-    delay(500);
+// One step per call: start WiFi, wait for it (up to a timeout), then try
+// MQTT once. Failures retry after a delay that doubles up to a minute.
+void networkLoop() {
+  unsigned long now = millis();
+
+  if (WiFi.status() != WL_CONNECTED) {
+    if (wifiConnecting) {
+      if (now - wifiStartedAt > WIFI_CONNECT_TIMEOUT_MS) {
+        wifiConnecting = false;
+        retryLater(now);
+      }
+    } else if ((long)(now - nextConnectAt) >= 0) {
+      wifiConnect();
+    }
+    return;
+  }
+
+  if (wifiConnecting) {
+    wifiConnecting = false;
+    reconnectDelay = RECONNECT_MIN_MS;
+    nextConnectAt = now;
+  }
+
+  if (!otaStarted) {
+    initOTA();
+    otaStarted = true;
+  }
+
+  if (client.loop()) {
+    return;
   }
 
+  if ((long)(now - nextConnectAt) < 0) {
+    return;
+  }
+
+  if (mqttConnect()) {
+    reconnectDelay = RECONNECT_MIN_MS;
+  } else {
+    retryLater(now);
+  }
+}
+
+void retryLater(unsigned long now) {
+  nextConnectAt = now + reconnectDelay;
+  reconnectDelay = min(reconnectDelay * 2, (unsigned long)RECONNECT_MAX_MS);
+}
+
+void wifiConnect() {
   WiFi.mode(WIFI_STA);
+  WiFi.begin(ssid, password);
+  wifiConnecting = true;
+  wifiStartedAt = millis();
 }
 
-void mqttConnect() {
-  if (!!!client.connected()) {
-    int count = 20;
-    while (count-- > 0 && !!!client.connect(client_id, mqtt_username, mqtt_password)) {
-      delay(500);
+// A single attempt; networkLoop() schedules the next one
+bool mqttConnect() {
+  if (!client.connected()) {
+    if (!client.connect(client_id, mqtt_username, mqtt_password)) {
+      return false;
     }
 
-    if (client.subscribe(titon_set_topic)) {
-      // OK
-      if (debug) {
-        client.publish(titon_debug_topic, "Subscribed to titon set topic.");
-      }
-    } else {
-      // FAIL
-      if (debug) {
-        client.publish(titon_debug_topic, "Failed to subscribe to titon set topic.");
+    for (int i = 0; i < UNIT_COUNT; i++) {
+      if (client.subscribe(unitTopic(i, "set").c_str())) {
+        // OK
+        if (debug) {
+          client.publish(titon_debug_topic, "Subscribed to titon set topic.");
+        }
+      } else {
+        // FAIL
+        if (debug) {
+          client.publish(titon_debug_topic, "Failed to subscribe to titon set topic.");
+        }
       }
     }
+
+    publishSetupError();
+  }
+  return true;
+}
+
+// Setup runs before MQTT may be up, so its errors wait for a connection
+void publishSetupError() {
+  if (setupError && client.connected() && client.publish(titon_debug_topic, setupError)) {
+    setupError = nullptr;
   }
 }
 
+String unitTopic(int unit, const char* leaf) {
+  return String(titon_units[unit].topic_prefix) + "/" + leaf;
+}
+
+int unitIndex(titon& unit) {
+  return &unit - tn;
+}
+
 void publishAllData() {
-  publishState();
-  publishTemperatures();
+  for (int i = 0; i < UNIT_COUNT; i++) {
+    publishState(i);
+    publishTemperatures(i);
+  }
 }
 
 void mqttCallback(char* topic, byte * payload, unsigned int length) {
-  if (strcmp (titon_set_topic, topic) == 0) {
-    handleUpdate(payload);
+  for (int i = 0; i < UNIT_COUNT; i++) {
+    if (unitTopic(i, "set") == topic) {
+      handleUpdate(i, payload);
+    }
   }
 }
 
-void handleUpdate(byte * payload) {
+void handleUpdate(int unit, byte * payload) {
   DynamicJsonDocument d(JSON_BUFFER_LENGTH);
   DeserializationError error = deserializeJson(d, (char*)payload);
 
@@ -133,132 +221,110 @@ void handleUpdate(byte * payload) {
   if (d.containsKey("DEBUG")) {
     boolean debg = d["DEBUG"];
     debug = debg;
-    tn.setDebug(debug);
-  }
-
-  if (d.containsKey("mode")) {
-    String m = d["mode"];
-
-    if (m == "FAN") {
-      // Fan only
-      if (!tn.isOn()) {
-        tn.setOn();
-      }
-      tn.setHeatingModeOff();
-    } else if (m == "HEAT") {
-      // Set heat mode
-      if (!tn.isOn()) {
-        tn.setOn();
-      }
-      tn.setHeatingModeOn();
+    for (int i = 0; i < UNIT_COUNT; i++) {
+      tn[i].setDebug(debug);
     }
-   
   }
 
-  // I've disabled possibility to turn off the ventilation
-  // If you wish to have such feature, feel free to implement :-)
+  // The unit has no off or heating modes; speed, boost and bypass only
 
   // Speed
   if (d.containsKey("speed")) {
     int speed = d["speed"];
-    tn.setFanSpeed(speed);
+    tn[unit].setFanSpeed(speed);
   }
 
-  // Heat target
-  if (d.containsKey("heat_target")) {
-    int ht = d["heat_target"];
-    tn.setHeatingTarget(ht);
+  // Activate boost (wet room switch input)
+  if (d.containsKey("activate_switch")) {
+    tn[unit].setSwitchOn();
   }
 
-  // Activate boost/fireplace
-  if (d.containsKey("activate_switch")) {
-    tn.setSwitchOn();
+  if (d.containsKey("boost_inhibit")) {
+    bool inhibit = d["boost_inhibit"];
+    tn[unit].setBoostInhibit(inhibit);
+  }
+
+  if (d.containsKey("summer_bypass")) {
+    bool enabled = d["summer_bypass"];
+    tn[unit].setSummerBypass(enabled);
+  }
+
+  if (d.containsKey("summerboost")) {
+    bool enabled = d["summerboost"];
+    tn[unit].setSummerBoost(enabled);
   }
 }
 
 // State
-void publishState() {
+void publishState(int unit) {
   DynamicJsonDocument root(JSON_BUFFER_LENGTH);
 
   // Mode
-  root["mode"] = !tn.isOn() ? "OFF" : (tn.isHeatingMode() ? "HEAT" : "FAN");
+  root["mode"] = !tn[unit].isOn() ? "OFF" : "FAN";
 
   // Boolean values
-  root["heating"] = tn.isHeating();
-  root["on"] = tn.isOn();
-  root["fault"] = tn.isFault();
-  root["rh_mode"] = tn.isRhMode();
-  root["service_needed"] = tn.isServiceNeeded();
+  root["on"] = tn[unit].isOn();
+  root["fault"] = tn[unit].isFault();
+  root["service_needed"] = tn[unit].isServiceNeeded();
   
-  root["summer_mode"] = tn.isSummerMode();
-  // root["error_relay"] = tn.isErrorRelay();
-  root["motor_in"] = !tn.isMotorIn();
-  root["motor_out"] = !tn.isMotorOut();
-  root["front_heating"] = tn.isFrontHeating();
+  root["summer_mode"] = tn[unit].isSummerMode();
+  root["summerboost"] = tn[unit].isSummerBoost();
  
   // Int values
-  root["speed"] = tn.getFanSpeed();
-  root["default_fan_speed"] = tn.getDefaultFanSpeed();
-  root["service_period"] = tn.getServicePeriod();
-  root["service_counter"] = tn.getServiceCounter();
-  root["heat_target"] = tn.getHeatingTarget();  
+  root["speed"] = tn[unit].getFanSpeed();
+  root["status_word"] = tn[unit].getStatusWord();
+  root["runtime_hours"] = tn[unit].getRuntimeHours();
+  root["filter_remaining"] = tn[unit].getFilterRemaining();
 
-  root["switch_active"] = tn.isSwitchActive();
+  root["switch_active"] = tn[unit].isSwitchActive();
 
-  root["titonesp_sw_version"] = titonESP_VERSION;
+  // How far the stalest reading is behind its poll period
+  root["poll_overdue_ms"] = tn[unit].getMaxOverdueMs();
 
-  if (tn.getSwitchType() != NOT_SET) {
-    root["switch_type"] = tn.getSwitchType() == 1 ? "boost" : "fireplace";
-  }
+  root["titonesp_sw_version"] = titonESP_VERSION;
 
   
   String mqttOutput;
   serializeJson(root, mqttOutput);
-  client.beginPublish(titon_state_topic, mqttOutput.length(), true);
+  client.beginPublish(unitTopic(unit, "state").c_str(), mqttOutput.length(), true);
   client.print(mqttOutput);
   client.endPublish();
 }
 
-void publishTemperatures() {
+void publishTemperatures(int unit) {
   DynamicJsonDocument root(JSON_BUFFER_LENGTH);
 
-  root["temp_outside"] = tn.getOutsideTemp();
-  root["temp_inside"] = tn.getInsideTemp();
-  root["temp_incoming"] = tn.getIncomingTemp();
-  root["temp_exhaust"] = tn.getExhaustTemp();
+  root["temp_outside"] = tn[unit].getOutsideTemp();
+  root["temp_inside"] = tn[unit].getInsideTemp();
+  root["temp_incoming"] = tn[unit].getIncomingTemp();
+  root["temp_exhaust"] = tn[unit].getExhaustTemp();
 
   // Publish only if RH values are something else than not set
-  if(tn.getRh1() != NOT_SET) {
-    root["rh_1"] = tn.getRh1();
+  if(tn[unit].getRh1() != NOT_SET) {
+    root["rh_1"] = tn[unit].getRh1();
   }
 
-  if(tn.getRh2() != NOT_SET) {
-    root["rh_2"] = tn.getRh2();
-  }
-
-  if(tn.getCO2() != NOT_SET) {
-    root["co2"] = tn.getCO2();
-  }
+  root["temp_extract"] = tn[unit].getExtractTemp();
 
   String mqttOutput;
   serializeJson(root, mqttOutput);
-  client.beginPublish(titon_temp_topic, mqttOutput.length(), true);
+  client.beginPublish(unitTopic(unit, "temp").c_str(), mqttOutput.length(), true);
   client.print(mqttOutput);
   client.endPublish();
 }
 
-void statusChanged() {
-  publishState();
+void statusChanged(titon& unit) {
+  publishState(unitIndex(unit));
 }
 
-void temperatureChanged() {
-  publishTemperatures();
+void temperatureChanged(titon& unit) {
+  publishTemperatures(unitIndex(unit));
 }
 
-void debugPrint(String message) {
+void debugPrint(const char* message) {
   if (debug) {
     // publish to debug topic
-    client.publish(titon_debug_topic, message.c_str());
+    client.publish(titon_debug_topic, message);
   }
 }
 